@@ -107,11 +107,21 @@ int SP_DictSortedArray :: binarySearch( const void * item, int * insertPoint,
 
 int SP_DictSortedArray :: insert( void * item )
 {
+	void * old = replace( item );
+	if( NULL != old ) mHandler->destroy( old );
+
+	return NULL != old ? 1 : 0;
+}
+
+void * SP_DictSortedArray :: replace( void * item )
+{
+	void * ret = NULL;
+
 	int insertPoint = -1;
 
 	int index = binarySearch( item, &insertPoint );
 	if( index >= 0 ) {
-		mHandler->destroy( mList[ index ]->takeItem() );
+		ret = mList[ index ]->takeItem();
 		mList[ index ]->setItem( item );
 	} else {
 		if( mCount >= mMaxCount ) {
@@ -128,7 +138,7 @@ int SP_DictSortedArray :: insert( void * item )
 		mCount++;
 	}
 
-	return index >= 0 ? 1 : 0;
+	return ret;
 }
 
 const void * SP_DictSortedArray :: search( const void * key ) const
@@ -168,7 +168,15 @@ int SP_DictBSTree :: getCount() const
 
 int SP_DictBSTree :: insert( void * item )
 {
-	int ret = 0;
+	void * old = replace( item );
+	if( NULL != old ) mHandler->destroy( old );
+
+	return NULL != old ? 1 : 0;
+}
+
+void * SP_DictBSTree :: replace( void * item )
+{
+	void * ret = NULL;
 	if( NULL == mRoot ) {
 		mCount++;
 		mRoot = new SP_DictBSTreeNode( item );
@@ -176,8 +184,7 @@ int SP_DictBSTree :: insert( void * item )
 		for( SP_DictBSTreeNode * curr = mRoot; NULL != curr; ) {
 			int cmpRet = mHandler->compare( item, curr->getItem() );
 			if( 0 == cmpRet ) {
-				ret = 1;
-				mHandler->destroy( curr->takeItem() );
+				ret = curr->takeItem();
 				curr->setItem( item );
 				curr = NULL;
 			} else if( cmpRet > 0 ) {
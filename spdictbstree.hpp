@@ -66,6 +66,7 @@ public:
 	virtual ~SP_DictBSTree();
 
 	virtual int insert( void * item );
+	virtual void * replace( void * item );
 	virtual const void * search( const void * key ) const;
 	virtual void * remove( const void * key );
 	virtual int getCount() const;
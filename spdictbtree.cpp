@@ -109,6 +109,18 @@ void SP_DictBTreeNode :: updateItem( int index, void * item )
 	}
 }
 
+void * SP_DictBTreeNode :: swapItem( int index, void * item )
+{
+	void * ret = NULL;
+
+	if( index >= 0 && index < mItemCount ) {
+		ret = mItemList[ index ];
+		mItemList[ index ] = item;
+	}
+
+	return ret;
+}
+
 void SP_DictBTreeNode :: insertNode( int index, SP_DictBTreeNode * node )
 {
 	if( NULL == node ) return;
@@ -346,6 +358,16 @@ SP_DictBTreeNode * SP_DictBTree :: split( int rank,
 
 int SP_DictBTree :: insert( void * item )
 {
+	void * old = replace( item );
+	if( NULL != old ) mHandler->destroy( old );
+
+	return NULL != old ? 1 : 0;
+}
+
+void * SP_DictBTree :: replace( void * item )
+{
+	void * ret = NULL;
+
 	SP_DictBTreeSearchResult result;
 	search( mRoot, item, &result );
 
@@ -377,11 +399,10 @@ int SP_DictBTree :: insert( void * item )
 			}
 		}
 	} else {
-		result.getNode()->updateItem( result.getIndex(), item );
-		printf( "overwrite\n" );
+		ret = result.getNode()->swapItem( result.getIndex(), item );
 	}
 
-	return result.getTag();
+	return ret;
 }
 
 const void * SP_DictBTree :: search( const void * key ) const
@@ -20,6 +20,7 @@ public:
 	void * takeItem( int index );
 	void * getItem( int index ) const;
 	void updateItem( int index, void * item );
+	void * swapItem( int index, void * item );
 
 	int getNodeCount() const;
 	void insertNode( int index, SP_DictBTreeNode * node );
@@ -93,6 +94,7 @@ public:
 	SP_DictBTree( int rank, SP_DictHandler * handler );
 	virtual ~SP_DictBTree();
 	virtual int insert( void * item );
+	virtual void * replace( void * item );
 	virtual const void * search( const void * key ) const;
 	virtual void * remove( const void * key );
 	virtual int getCount() const;
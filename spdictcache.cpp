@@ -8,14 +8,24 @@
 #include <assert.h>
 #include <stdio.h>
 
+#include <new>
+#include <algorithm>
+
 #ifndef WIN32
 #include <pthread.h>
+#define SP_ATOMIC_INC(ptr) __sync_add_and_fetch(ptr,1)
+#define SP_ATOMIC_LOAD(ptr) __atomic_load_n(ptr,__ATOMIC_RELAXED)
+#define SP_ATOMIC_STORE(ptr,value) __atomic_store_n(ptr,value,__ATOMIC_RELAXED)
 #else
 #include <windows.h>
+#define SP_ATOMIC_INC(ptr) InterlockedIncrement((volatile LONG*)(ptr))
+#define SP_ATOMIC_LOAD(ptr) (*(ptr))
+#define SP_ATOMIC_STORE(ptr,value) (*(ptr)=(value))
 #endif
 
 #include "spdictcache.hpp"
 #include "spdictionary.hpp"
+#include "spdicthash.hpp"
 
 //===========================================================================
 
@@ -23,6 +33,21 @@ SP_DictCacheHandler :: ~SP_DictCacheHandler()
 {
 }
 
+unsigned int SP_DictCacheHandler :: hash( const void * item )
+{
+	return 0;
+}
+
+int SP_DictCacheHandler :: isHashable()
+{
+	return 0;
+}
+
+size_t SP_DictCacheHandler :: getSize( const void * item )
+{
+	return 1;
+}
+
 //===========================================================================
 
 SP_DictCacheStatistics :: ~SP_DictCacheStatistics()
@@ -38,18 +63,30 @@ public:
 	virtual int getHits() const;
 	virtual int getAccesses() const;
 	virtual int getSize() const;
+	virtual int getRejects() const;
+	virtual size_t getBytes() const;
 
 	void setSize( int size );
+	void setBytes( size_t bytes );
+	// the readers of SP_ThreadSafeCacheWrapper mark at the same time
 	void markHit();
 	void markMiss();
+	void markReject();
+
+	void add( const SP_DictCacheStatistics * other );
 
 private:
-	int mHits, mAccesses, mSize;
+	volatile int mHits, mAccesses;
+	int mSize;
+	int mRejects;
+	size_t mBytes;
 };
 
 SP_DictCacheStatisticsImpl :: SP_DictCacheStatisticsImpl()
 {
 	mHits = mAccesses = mSize = 0;
+	mRejects = 0;
+	mBytes = 0;
 }
 
 SP_DictCacheStatisticsImpl :: SP_DictCacheStatisticsImpl( SP_DictCacheStatisticsImpl & other )
@@ -57,6 +94,8 @@ SP_DictCacheStatisticsImpl :: SP_DictCacheStatisticsImpl( SP_DictCacheStatistics
 	mHits = other.getHits();
 	mAccesses = other.getAccesses();
 	mSize = other.getSize();
+	mRejects = other.getRejects();
+	mBytes = other.getBytes();
 }
 
 SP_DictCacheStatisticsImpl :: ~SP_DictCacheStatisticsImpl()
@@ -78,20 +117,49 @@ int SP_DictCacheStatisticsImpl :: getSize() const
 	return mSize;
 }
 
+int SP_DictCacheStatisticsImpl :: getRejects() const
+{
+	return mRejects;
+}
+
+size_t SP_DictCacheStatisticsImpl :: getBytes() const
+{
+	return mBytes;
+}
+
 void SP_DictCacheStatisticsImpl :: setSize( int size )
 {
 	mSize = size;
 }
 
+void SP_DictCacheStatisticsImpl :: setBytes( size_t bytes )
+{
+	mBytes = bytes;
+}
+
 void SP_DictCacheStatisticsImpl :: markHit()
 {
-	mHits++;
-	mAccesses++;
+	SP_ATOMIC_INC( &mHits );
+	SP_ATOMIC_INC( &mAccesses );
 }
 
 void SP_DictCacheStatisticsImpl :: markMiss()
 {
-	mAccesses++;
+	SP_ATOMIC_INC( &mAccesses );
+}
+
+void SP_DictCacheStatisticsImpl :: markReject()
+{
+	mRejects++;
+}
+
+void SP_DictCacheStatisticsImpl :: add( const SP_DictCacheStatistics * other )
+{
+	mHits += other->getHits();
+	mAccesses += other->getAccesses();
+	mSize += other->getSize();
+	mRejects += other->getRejects();
+	mBytes += other->getBytes();
 }
 
 //===========================================================================
@@ -113,10 +181,36 @@ public:
 	void setExpTime( time_t expTime );
 	time_t getExpTime();
 
+	void setSize( size_t size );
+	size_t getSize();
+
+	// the shared readers set the bit at the same time
+	void setReferenced( int referenced );
+	int isReferenced();
+
+	void setInWindow( int inWindow );
+	int isInWindow();
+
+	void setWheelPrev( SP_DictCacheEntry * prev );
+	SP_DictCacheEntry * getWheelPrev();
+
+	void setWheelNext( SP_DictCacheEntry * next );
+	SP_DictCacheEntry * getWheelNext();
+
+	// -1 : not in the timing wheel
+	void setWheelSlot( int slot );
+	int getWheelSlot();
+
 private:
 	SP_DictCacheEntry * mPrev, * mNext;
 	const void * mItem;
 	time_t mExpTime;
+	size_t mSize;
+	volatile int mReferenced;
+	int mInWindow;
+
+	SP_DictCacheEntry * mWheelPrev, * mWheelNext;
+	int mWheelSlot;
 };
 
 SP_DictCacheEntry :: SP_DictCacheEntry( const void * item )
@@ -124,6 +218,11 @@ SP_DictCacheEntry :: SP_DictCacheEntry( const void * item )
 	mItem = item;
 	mPrev = mNext = NULL;
 	mExpTime = 0;
+	mSize = 0;
+	mReferenced = 0;
+	mInWindow = 0;
+	mWheelPrev = mWheelNext = NULL;
+	mWheelSlot = -1;
 }
 
 SP_DictCacheEntry :: ~SP_DictCacheEntry()
@@ -172,6 +271,66 @@ time_t SP_DictCacheEntry :: getExpTime()
 	return mExpTime;
 }
 
+void SP_DictCacheEntry :: setSize( size_t size )
+{
+	mSize = size;
+}
+
+size_t SP_DictCacheEntry :: getSize()
+{
+	return mSize;
+}
+
+void SP_DictCacheEntry :: setReferenced( int referenced )
+{
+	SP_ATOMIC_STORE( &mReferenced, referenced );
+}
+
+int SP_DictCacheEntry :: isReferenced()
+{
+	return SP_ATOMIC_LOAD( &mReferenced );
+}
+
+void SP_DictCacheEntry :: setInWindow( int inWindow )
+{
+	mInWindow = inWindow;
+}
+
+int SP_DictCacheEntry :: isInWindow()
+{
+	return mInWindow;
+}
+
+void SP_DictCacheEntry :: setWheelPrev( SP_DictCacheEntry * prev )
+{
+	mWheelPrev = prev;
+}
+
+SP_DictCacheEntry * SP_DictCacheEntry :: getWheelPrev()
+{
+	return mWheelPrev;
+}
+
+void SP_DictCacheEntry :: setWheelNext( SP_DictCacheEntry * next )
+{
+	mWheelNext = next;
+}
+
+SP_DictCacheEntry * SP_DictCacheEntry :: getWheelNext()
+{
+	return mWheelNext;
+}
+
+void SP_DictCacheEntry :: setWheelSlot( int slot )
+{
+	mWheelSlot = slot;
+}
+
+int SP_DictCacheEntry :: getWheelSlot()
+{
+	return mWheelSlot;
+}
+
 class SP_DictCacheEntryList {
 public:
 	SP_DictCacheEntryList();
@@ -179,17 +338,26 @@ public:
 
 	SP_DictCacheEntry * getHead();
 
+	int getCount();
+
+	// total size of the entries
+	size_t getBytes();
+
 	void append( SP_DictCacheEntry * entry );
 
 	void remove( SP_DictCacheEntry * entry );
 
 private:
 	SP_DictCacheEntry * mHead, * mTail;
+	int mCount;
+	size_t mBytes;
 };
 
 SP_DictCacheEntryList :: SP_DictCacheEntryList()
 {
 	mHead = mTail = NULL;
+	mCount = 0;
+	mBytes = 0;
 }
 
 SP_DictCacheEntryList :: ~SP_DictCacheEntryList()
@@ -201,6 +369,16 @@ SP_DictCacheEntry * SP_DictCacheEntryList :: getHead()
 	return mHead;
 }
 
+int SP_DictCacheEntryList :: getCount()
+{
+	return mCount;
+}
+
+size_t SP_DictCacheEntryList :: getBytes()
+{
+	return mBytes;
+}
+
 void SP_DictCacheEntryList :: append( SP_DictCacheEntry * entry )
 {
 	entry->setPrev( NULL );
@@ -214,6 +392,9 @@ void SP_DictCacheEntryList :: append( SP_DictCacheEntry * entry )
 
 		mTail = entry;
 	}
+
+	mCount++;
+	mBytes += entry->getSize();
 }
 
 void SP_DictCacheEntryList :: remove( SP_DictCacheEntry * entry )
@@ -237,259 +418,1025 @@ void SP_DictCacheEntryList :: remove( SP_DictCacheEntry * entry )
 
 	entry->setPrev( NULL );
 	entry->setNext( NULL );
+
+	mCount--;
+	mBytes -= entry->getSize();
 }
 
 //===========================================================================
 
-class SP_DictCacheHandlerAdapter : public SP_DictHandler {
+// recycles entries through a free list, the slabs are only released by the destructor
+class SP_DictCacheEntryPool {
 public:
-	SP_DictCacheHandlerAdapter( SP_DictCacheHandler * handler );
-	~SP_DictCacheHandlerAdapter();
+	SP_DictCacheEntryPool( int maxItems );
+	~SP_DictCacheEntryPool();
 
-	virtual int compare( const void * item1, const void * item2 ) const;
-	virtual void destroy( void * item ) const;
+	SP_DictCacheEntry * alloc( const void * item );
+
+	void free( SP_DictCacheEntry * entry );
 
 private:
-	SP_DictCacheHandler * mHandler;
+	void addSlab();
+
+	int mSlabSize;
+
+	void ** mSlabList;
+	int mSlabCount, mMaxSlabCount;
+
+	SP_DictCacheEntry * mFreeList;
 };
 
-SP_DictCacheHandlerAdapter :: SP_DictCacheHandlerAdapter( SP_DictCacheHandler * handler )
+SP_DictCacheEntryPool :: SP_DictCacheEntryPool( int maxItems )
 {
-	mHandler = handler;
+	// a full cache holds maxItems + 1 entries while put is evicting
+	mSlabSize = maxItems > 0 ? maxItems + 1 : 256;
+	if( mSlabSize < 16 ) mSlabSize = 16;
+	if( mSlabSize > 4096 ) mSlabSize = 4096;
+
+	mSlabCount = 0;
+	mMaxSlabCount = 16;
+	mSlabList = (void**)malloc( sizeof( void * ) * mMaxSlabCount );
+
+	mFreeList = NULL;
 }
 
-SP_DictCacheHandlerAdapter :: ~SP_DictCacheHandlerAdapter()
+SP_DictCacheEntryPool :: ~SP_DictCacheEntryPool()
 {
+	for( int i = 0; i < mSlabCount; i++ ) {
+		::free( mSlabList[i] );
+	}
+
+	::free( mSlabList );
 }
 
-int SP_DictCacheHandlerAdapter :: compare( const void * item1, const void * item2 ) const
+void SP_DictCacheEntryPool :: addSlab()
 {
-	SP_DictCacheEntry * entry1 = ( SP_DictCacheEntry * ) item1;
-	SP_DictCacheEntry * entry2 = ( SP_DictCacheEntry * ) item2;
+	if( mSlabCount >= mMaxSlabCount ) {
+		mMaxSlabCount = mMaxSlabCount * 2;
+		mSlabList = (void**)realloc( mSlabList, sizeof( void * ) * mMaxSlabCount );
+	}
 
-	return mHandler->compare( entry1->getItem(), entry2->getItem() );
+	SP_DictCacheEntry * slab = (SP_DictCacheEntry*)malloc(
+			sizeof( SP_DictCacheEntry ) * mSlabSize );
+	mSlabList[ mSlabCount++ ] = slab;
+
+	for( int i = mSlabSize - 1; i >= 0; i-- ) {
+		SP_DictCacheEntry * entry = new ( slab + i ) SP_DictCacheEntry( NULL );
+		entry->setNext( mFreeList );
+		mFreeList = entry;
+	}
 }
 
-void SP_DictCacheHandlerAdapter :: destroy( void * item ) const
+SP_DictCacheEntry * SP_DictCacheEntryPool :: alloc( const void * item )
 {
-	SP_DictCacheEntry * entry = ( SP_DictCacheEntry * ) item;
-	mHandler->destroy( (void*)entry->getItem() );
-	delete entry;
+	if( NULL == mFreeList ) addSlab();
+
+	SP_DictCacheEntry * entry = mFreeList;
+	mFreeList = entry->getNext();
+
+	entry->setNext( NULL );
+	entry->setItem( item );
+	entry->setExpTime( 0 );
+	entry->setSize( 0 );
+	entry->setReferenced( 0 );
+	entry->setInWindow( 0 );
+	entry->setWheelSlot( -1 );
+
+	return entry;
 }
 
-//===========================================================================
+void SP_DictCacheEntryPool :: free( SP_DictCacheEntry * entry )
+{
+	entry->setItem( NULL );
+	entry->setPrev( NULL );
+	entry->setNext( mFreeList );
+	mFreeList = entry;
+}
 
+//===========================================================================
 
-class SP_DictCacheImpl : public SP_DictCache {
+/**
+ * hierarchical timing wheel, LEVELS wheels of SLOTS one-second slots.
+ * An entry sits in the lowest level which covers its expiration time,
+ * and cascades down one level each time the lower level wraps around.
+ */
+class SP_DictCacheTimingWheel {
 public:
-	SP_DictCacheImpl( int algo, int maxItems, SP_DictCacheHandler * handler );
-	virtual ~SP_DictCacheImpl();
+	SP_DictCacheTimingWheel( time_t now );
+	~SP_DictCacheTimingWheel();
 
-	virtual int put( void * item, time_t expTime = 0 );
-	virtual int get( const void * key, void * resultHolder );
-	virtual int erase( const void * key );
-	virtual void * remove( const void * key, time_t * expTime = 0 );
-	virtual SP_DictCacheStatistics * getStatistics();
+	void add( SP_DictCacheEntry * entry );
+
+	// it's ok to remove an entry which is not in the wheel
+	void remove( SP_DictCacheEntry * entry );
+
+	/**
+	 * Every jump to the next busy tick and every expired or cascaded entry
+	 * costs one unit of budget, the empty ticks are skipped for free.
+	 *
+	 * @return NOT NULL : an entry expired before now, it's out of the wheel
+	 * @return NULL : no more expired entry, or run out of budget
+	 */
+	SP_DictCacheEntry * popExpired( time_t now, int * budget );
+
+	int getCount();
 
 private:
-	SP_DictCacheHandler * mHandler;
-	int mMaxItems;
-	int mAlgo;
+	enum { LEVELS = 4, SLOT_BITS = 6, SLOTS = 1 << SLOT_BITS, SLOT_MASK = SLOTS - 1 };
 
-	SP_Dictionary * mDict;
-	SP_DictCacheEntryList * mList;
-	SP_DictCacheStatisticsImpl * mStatistics;
+	void link( int slot, SP_DictCacheEntry * entry );
+
+	/**
+	 * move the entries of the current slot of level down to the lower levels
+	 *
+	 * @return 1 : the slot is empty, 0 : run out of budget
+	 */
+	int cascade( int level, int * budget );
+
+	// @return the first tick after mCurrent and before now which has a slot to visit, or now
+	time_t getNextTick( time_t now );
+
+	SP_DictCacheEntry * mSlots[ LEVELS * SLOTS ];
+	int mCount;
+
+	// all the ticks before mCurrent have been processed
+	time_t mCurrent;
+
+	// the cascades of mCurrent go on from this level, 0 : all done
+	int mCascadeLevel;
 };
 
-SP_DictCacheImpl :: SP_DictCacheImpl( int algo, int maxItems,
-		SP_DictCacheHandler * handler )
+SP_DictCacheTimingWheel :: SP_DictCacheTimingWheel( time_t now )
 {
-	mAlgo = algo;
-	mMaxItems = maxItems;
-	mHandler = handler;
-
-	mDict = SP_Dictionary::newInstance( SP_Dictionary::eBTree,
-			new SP_DictCacheHandlerAdapter( handler ) );
-	mList = new SP_DictCacheEntryList();
+	memset( mSlots, 0, sizeof( mSlots ) );
+	mCount = 0;
 
-	mStatistics = new SP_DictCacheStatisticsImpl();
+	mCurrent = now;
+	mCascadeLevel = LEVELS - 1;
 }
 
-SP_DictCacheImpl :: ~SP_DictCacheImpl()
+SP_DictCacheTimingWheel :: ~SP_DictCacheTimingWheel()
 {
-	delete mStatistics;
-	delete mList;
-	delete mDict;
-	delete mHandler;
 }
 
-int SP_DictCacheImpl :: put( void * item, time_t expTime )
+int SP_DictCacheTimingWheel :: getCount()
 {
-	int result = 0;
+	return mCount;
+}
 
-	SP_DictCacheEntry * entry = new SP_DictCacheEntry( item );
-	entry->setExpTime( expTime );
+void SP_DictCacheTimingWheel :: link( int slot, SP_DictCacheEntry * entry )
+{
+	SP_DictCacheEntry * head = mSlots[ slot ];
 
-	SP_DictCacheEntry * oldEntry = (SP_DictCacheEntry*)mDict->search( entry );
-	if( NULL != oldEntry ) {
-		result = 1;
+	entry->setWheelPrev( NULL );
+	entry->setWheelNext( head );
+	entry->setWheelSlot( slot );
 
-		mList->remove( oldEntry );
-		mDict->remove( oldEntry );
+	if( NULL != head ) head->setWheelPrev( entry );
+	mSlots[ slot ] = entry;
+}
 
-		mHandler->destroy( (void*)oldEntry->getItem() );
-		delete oldEntry;
-	}
+void SP_DictCacheTimingWheel :: add( SP_DictCacheEntry * entry )
+{
+	time_t expTime = entry->getExpTime();
 
-	mDict->insert( entry );
-	mList->append( entry );
+	if( expTime < mCurrent ) expTime = mCurrent;
 
-	for( ; mDict->getCount() > mMaxItems && mMaxItems > 0; ) {
-		SP_DictCacheEntry * head = mList->getHead();
+	time_t delta = expTime - mCurrent;
 
-		mList->remove( head );
-		mDict->remove( head );
+	int level = 0;
+	for( ; level < LEVELS - 1 && delta >= ( (time_t)1 << ( SLOT_BITS * ( level + 1 ) ) ); ) {
+		level++;
+	}
 
-		mHandler->destroy( (void*)head->getItem() );
-		delete head;
+	// beyond the range of the wheel, it is placed again when its slot cascades
+	if( delta >= ( (time_t)1 << ( SLOT_BITS * LEVELS ) ) ) {
+		expTime = mCurrent + ( (time_t)1 << ( SLOT_BITS * LEVELS ) ) - 1;
 	}
 
-	return result;
+	link( level * SLOTS + (int)( ( expTime >> ( SLOT_BITS * level ) ) & SLOT_MASK ), entry );
+
+	mCount++;
 }
 
-int SP_DictCacheImpl :: get( const void * key, void * resultHolder )
+void SP_DictCacheTimingWheel :: remove( SP_DictCacheEntry * entry )
 {
-	int result = 0;
-
-	SP_DictCacheEntry keyEntry( key );
-	SP_DictCacheEntry * entry = (SP_DictCacheEntry*)mDict->search( &keyEntry );
+	int slot = entry->getWheelSlot();
+	if( slot < 0 ) return;
 
-	if( NULL != entry ) {
-		if( entry->getExpTime() > 0 && entry->getExpTime() < time( NULL ) ) {
-			erase( key );
-		} else {
-			result = 1;
-			mHandler->onHit( entry->getItem(), resultHolder );
-
-			if( eLRU == mAlgo ) {
-				mList->remove( entry );
-				mList->append( entry );
-			}
+	SP_DictCacheEntry * prev = entry->getWheelPrev(), * next = entry->getWheelNext();
 
-			mStatistics->markHit();
-		}
+	if( NULL == prev ) {
+		assert( mSlots[ slot ] == entry );
+		mSlots[ slot ] = next;
 	} else {
-		mStatistics->markMiss();
+		prev->setWheelNext( next );
 	}
 
-	return result;
+	if( NULL != next ) next->setWheelPrev( prev );
+
+	entry->setWheelPrev( NULL );
+	entry->setWheelNext( NULL );
+	entry->setWheelSlot( -1 );
+
+	mCount--;
 }
 
-int SP_DictCacheImpl :: erase( const void * key )
+int SP_DictCacheTimingWheel :: cascade( int level, int * budget )
 {
-	int result = 0;
+	int slot = level * SLOTS + (int)( ( mCurrent >> ( SLOT_BITS * level ) ) & SLOT_MASK );
 
-	void * item = remove( key );
-
-	if( NULL != item ) {
-		result = 1;
-		mHandler->destroy( item );
+	for( SP_DictCacheEntry * entry = mSlots[ slot ]; NULL != entry && *budget > 0;
+			entry = mSlots[ slot ] ) {
+		remove( entry );
+		add( entry );
+		(*budget)--;
 	}
 
-	return result;
+	return NULL == mSlots[ slot ] ? 1 : 0;
 }
 
-void * SP_DictCacheImpl :: remove( const void * key, time_t * expTime )
+time_t SP_DictCacheTimingWheel :: getNextTick( time_t now )
 {
-	void * result = NULL;
+	time_t next = now;
 
-	SP_DictCacheEntry keyEntry( key );
-	SP_DictCacheEntry * entry = (SP_DictCacheEntry*)mDict->remove( &keyEntry );
-
-	if( NULL != entry ) {
-		mList->remove( entry );
+	// a slot of level is visited when the tick is a multiple of SLOTS ^ level
+	for( int level = 0; level < LEVELS; level++ ) {
+		int shift = SLOT_BITS * level;
+		time_t base = mCurrent >> shift;
 
-		if( NULL != expTime ) *expTime = entry->getExpTime();
-		result = (void*)entry->getItem();
-		delete entry;
+		for( int i = 1; i <= SLOTS && ( ( base + i ) << shift ) < next; i++ ) {
+			if( NULL != mSlots[ level * SLOTS + (int)( ( base + i ) & SLOT_MASK ) ] ) {
+				next = ( base + i ) << shift;
+				break;
+			}
+		}
 	}
 
-	return result;
+	return next;
 }
 
-SP_DictCacheStatistics * SP_DictCacheImpl :: getStatistics()
+SP_DictCacheEntry * SP_DictCacheTimingWheel :: popExpired( time_t now, int * budget )
 {
-	SP_DictCacheStatisticsImpl * ret = new SP_DictCacheStatisticsImpl( *mStatistics );
-	ret->setSize( mDict->getCount() );
+	for( ; mCurrent < now && *budget > 0; ) {
+		if( 0 == mCount ) {
+			mCurrent = now;
+			mCascadeLevel = LEVELS - 1;
+			break;
+		}
 
-	return ret;
+		// higher levels first, they may refill the slots of the lower levels,
+		// a cascade out of budget goes on in the next call
+		for( ; mCascadeLevel > 0; mCascadeLevel-- ) {
+			time_t mask = ( (time_t)1 << ( SLOT_BITS * mCascadeLevel ) ) - 1;
+
+			if( 0 == ( mCurrent & mask ) && ! cascade( mCascadeLevel, budget ) ) return NULL;
+		}
+
+		SP_DictCacheEntry * entry = mSlots[ mCurrent & SLOT_MASK ];
+		if( NULL != entry ) {
+			if( *budget <= 0 ) break;
+
+			remove( entry );
+			(*budget)--;
+			return entry;
+		}
+
+		mCurrent = getNextTick( now );
+		mCascadeLevel = LEVELS - 1;
+		(*budget)--;
+	}
+
+	return NULL;
 }
 
 //===========================================================================
 
-class SP_ThreadSafeCacheWrapper : public SP_DictCache {
+// count-min sketch with 4 rows of 4-bit counters, halved periodically
+class SP_DictCacheSketch {
 public:
-	SP_ThreadSafeCacheWrapper( SP_DictCache * cache );
-	virtual ~SP_ThreadSafeCacheWrapper();
+	SP_DictCacheSketch( int maxItems );
+	~SP_DictCacheSketch();
 
-	virtual int put( void * item, time_t expTime = 0 );
-	virtual int get( const void * key, void * resultHolder );
-	virtual int erase( const void * key );
-	virtual void * remove( const void * key, time_t * expTime );
-	virtual SP_DictCacheStatistics * getStatistics();
+	void increment( unsigned int hash );
+
+	int estimate( unsigned int hash );
 
 private:
+	enum { DEPTH = 4 };
 
-	void lock();
-	void unlock();
+	unsigned int getIndex( unsigned int hash, int row );
 
-	SP_DictCache * mCache;
+	void halve();
 
-#ifndef WIN32
-	pthread_mutex_t mMutex;
-#else
-	HANDLE mMutex;
-#endif
+	// mWidth counters per row, two counters per byte
+	unsigned char * mTable;
+	unsigned int mWidth;
 
+	int mSamples, mSampleSize;
 };
 
-SP_ThreadSafeCacheWrapper :: SP_ThreadSafeCacheWrapper( SP_DictCache * cache )
+SP_DictCacheSketch :: SP_DictCacheSketch( int maxItems )
 {
-	mCache = cache;
+	mWidth = 64;
+	for( ; (int)mWidth < maxItems; ) mWidth *= 2;
 
-#ifndef WIN32
-	pthread_mutex_init( &mMutex, NULL );
-#else
-	mMutex = CreateMutex(0, FALSE, 0);
-#endif
+	mTable = (unsigned char*)malloc( DEPTH * mWidth / 2 );
+	memset( mTable, 0, DEPTH * mWidth / 2 );
+
+	mSamples = 0;
+	mSampleSize = 10 * mWidth;
 }
 
-SP_ThreadSafeCacheWrapper :: ~SP_ThreadSafeCacheWrapper()
+SP_DictCacheSketch :: ~SP_DictCacheSketch()
 {
-	delete mCache;
-
-#ifndef WIN32
-	pthread_mutex_destroy( &mMutex );
-#else
-	CloseHandle( mMutex );
-#endif
+	free( mTable );
 }
 
-void SP_ThreadSafeCacheWrapper :: lock()
+unsigned int SP_DictCacheSketch :: getIndex( unsigned int hash, int row )
 {
-#ifndef WIN32
-	pthread_mutex_lock( &mMutex );
-#else
-	WaitForSingleObject( mMutex, INFINITE );
-#endif
+	static const unsigned int seeds[ DEPTH ] = {
+		0x9e3779b1U, 0x85ebca77U, 0xc2b2ae3dU, 0x27d4eb2fU };
+
+	hash = ( hash + seeds[ row ] ) * seeds[ ( row + 1 ) % DEPTH ];
+	hash ^= hash >> 15;
+
+	return row * mWidth + ( hash & ( mWidth - 1 ) );
 }
 
-void SP_ThreadSafeCacheWrapper :: unlock()
+void SP_DictCacheSketch :: increment( unsigned int hash )
 {
-#ifndef WIN32
-	pthread_mutex_unlock( &mMutex );
-#else
-	ReleaseMutex( mMutex );
+	int added = 0;
+
+	for( int i = 0; i < DEPTH; i++ ) {
+		unsigned int index = getIndex( hash, i );
+		int shift = ( index & 1 ) * 4;
+		unsigned char * counter = mTable + index / 2;
+
+		if( ( ( *counter >> shift ) & 0x0F ) < 0x0F ) {
+			*counter += ( 1 << shift );
+			added = 1;
+		}
+	}
+
+	if( added && ++mSamples >= mSampleSize ) halve();
+}
+
+int SP_DictCacheSketch :: estimate( unsigned int hash )
+{
+	int ret = 0x0F;
+
+	for( int i = 0; i < DEPTH; i++ ) {
+		unsigned int index = getIndex( hash, i );
+		int count = ( mTable[ index / 2 ] >> ( ( index & 1 ) * 4 ) ) & 0x0F;
+		if( count < ret ) ret = count;
+	}
+
+	return ret;
+}
+
+void SP_DictCacheSketch :: halve()
+{
+	// age the history, so that old hot items can be evicted
+	for( unsigned int i = 0; i < DEPTH * mWidth / 2; i++ ) {
+		mTable[i] = ( mTable[i] >> 1 ) & 0x77;
+	}
+
+	mSamples = mSamples / 2;
+}
+
+//===========================================================================
+
+class SP_DictCacheHandlerAdapter : public SP_DictHashHandler {
+public:
+	SP_DictCacheHandlerAdapter( SP_DictCacheHandler * handler,
+			SP_DictCacheEntryPool * pool );
+	~SP_DictCacheHandlerAdapter();
+
+	virtual int compare( const void * item1, const void * item2 ) const;
+	virtual void destroy( void * item ) const;
+	virtual unsigned int hash( const void * item ) const;
+
+private:
+	SP_DictCacheHandler * mHandler;
+	SP_DictCacheEntryPool * mPool;
+};
+
+SP_DictCacheHandlerAdapter :: SP_DictCacheHandlerAdapter( SP_DictCacheHandler * handler,
+		SP_DictCacheEntryPool * pool )
+{
+	mHandler = handler;
+	mPool = pool;
+}
+
+SP_DictCacheHandlerAdapter :: ~SP_DictCacheHandlerAdapter()
+{
+}
+
+int SP_DictCacheHandlerAdapter :: compare( const void * item1, const void * item2 ) const
+{
+	SP_DictCacheEntry * entry1 = ( SP_DictCacheEntry * ) item1;
+	SP_DictCacheEntry * entry2 = ( SP_DictCacheEntry * ) item2;
+
+	return mHandler->compare( entry1->getItem(), entry2->getItem() );
+}
+
+void SP_DictCacheHandlerAdapter :: destroy( void * item ) const
+{
+	SP_DictCacheEntry * entry = ( SP_DictCacheEntry * ) item;
+	mHandler->destroy( (void*)entry->getItem() );
+	mPool->free( entry );
+}
+
+unsigned int SP_DictCacheHandlerAdapter :: hash( const void * item ) const
+{
+	SP_DictCacheEntry * entry = ( SP_DictCacheEntry * ) item;
+
+	return mHandler->hash( entry->getItem() );
+}
+
+//===========================================================================
+
+
+class SP_DictCacheImpl : public SP_DictCache {
+public:
+	SP_DictCacheImpl( int algo, int maxItems, size_t maxBytes,
+			SP_DictCacheHandler * handler, int ownHandler = 1 );
+	virtual ~SP_DictCacheImpl();
+
+	virtual int put( void * item, time_t expTime = 0 );
+	virtual int get( const void * key, void * resultHolder );
+	virtual int erase( const void * key );
+	virtual void * remove( const void * key, time_t * expTime = 0 );
+	virtual int getMulti( const void ** keys, int count,
+			void ** resultHolders, int * found );
+	virtual int putMulti( void ** items, time_t * expTimes, int count );
+	virtual SP_DictCacheStatistics * getStatistics();
+	virtual int purgeExpired( int budget );
+
+	/**
+	 * eFIFO, eCLOCK : a lookup which leaves the lists and the index as they
+	 * are, several readers may call it at the same time, only with each other.
+	 * A hit of eCLOCK sets the reference bit, no purge is piggybacked on it.
+	 *
+	 * @return 1 : found it, 0 : no such key
+	 * @return -1 : call get, the algo changes the lists on a hit, or the item is expired
+	 */
+	int getShared( const void * key, void * resultHolder );
+
+private:
+	// budget of the purge piggybacked on each put/get
+	enum { AUTO_PURGE_BUDGET = 8 };
+
+	// how many keys ahead getMulti/putMulti prefetch the hash table
+	enum { PREFETCH_DISTANCE = 8 };
+
+	/**
+	 * @return NULL : the index is a hash table, visit the items in order and prefetch
+	 * @return NOT NULL : the visit order of the items, sorted so that the btree
+	 *  descents share the upper levels, caller must free the return value
+	 */
+	int * getOrder( const void ** items, int count );
+
+	void prefetch( const void * key );
+
+	SP_DictCacheEntry * getVictim();
+
+	SP_DictCacheEntryList * getList( SP_DictCacheEntry * entry );
+
+	// move the items out of the window, through the admission check
+	void admit();
+
+	// @return 1 : the main list of eTinyLFU has room for the entry
+	int hasRoom( SP_DictCacheEntry * entry );
+
+	void evict( SP_DictCacheEntry * entry );
+
+	SP_DictCacheHandler * mHandler;
+	int mOwnHandler;
+	int mMaxItems;
+	size_t mMaxBytes;
+	int mAlgo;
+
+	SP_DictCacheEntryPool * mPool;
+	SP_Dictionary * mDict;
+	SP_DictCacheEntryList * mList;
+	SP_DictCacheStatisticsImpl * mStatistics;
+	SP_DictCacheTimingWheel * mWheel;
+
+	// only for eTinyLFU
+	SP_DictCacheEntryList * mWindow;
+	int mWindowItems;
+	size_t mWindowBytes;
+	SP_DictCacheSketch * mSketch;
+};
+
+SP_DictCacheImpl :: SP_DictCacheImpl( int algo, int maxItems, size_t maxBytes,
+		SP_DictCacheHandler * handler, int ownHandler )
+{
+	mAlgo = algo;
+	mMaxItems = maxItems;
+	mMaxBytes = maxBytes;
+	mHandler = handler;
+	mOwnHandler = ownHandler;
+
+	mPool = new SP_DictCacheEntryPool( maxItems );
+
+	SP_DictCacheHandlerAdapter * adapter = new SP_DictCacheHandlerAdapter( handler, mPool );
+
+	// a cache never needs ordering, the btree is only for compare-only handlers
+	if( handler->isHashable() ) {
+		mDict = SP_Dictionary::newHashTable( maxItems > 0 ? maxItems + 1 : 0, adapter );
+	} else {
+		mDict = SP_Dictionary::newInstance( SP_Dictionary::eBTree, adapter );
+	}
+	mList = new SP_DictCacheEntryList();
+
+	mStatistics = new SP_DictCacheStatisticsImpl();
+	mWheel = new SP_DictCacheTimingWheel( time( NULL ) );
+
+	mWindow = NULL;
+	mWindowItems = 0;
+	mWindowBytes = 0;
+	mSketch = NULL;
+
+	if( eTinyLFU == mAlgo ) {
+		if( handler->isHashable() ) {
+			// 1% of the items and of the bytes are in the window
+			mWindow = new SP_DictCacheEntryList();
+			mWindowItems = mMaxItems / 100 > 0 ? mMaxItems / 100 : 1;
+			mWindowBytes = mMaxBytes / 100;
+
+			// guess 1KB per item if only the bytes are bounded
+			int sketchItems = mMaxItems;
+			if( sketchItems <= 0 ) {
+				sketchItems = mMaxBytes / 1024 < 1048576 ? (int)( mMaxBytes / 1024 ) : 1048576;
+			}
+			mSketch = new SP_DictCacheSketch( sketchItems );
+		} else {
+			mAlgo = eLRU;
+		}
+	}
+}
+
+SP_DictCacheImpl :: ~SP_DictCacheImpl()
+{
+	if( NULL != mSketch ) delete mSketch;
+	if( NULL != mWindow ) delete mWindow;
+	delete mWheel;
+	delete mStatistics;
+	delete mList;
+	delete mDict;
+	delete mPool;
+	if( mOwnHandler ) delete mHandler;
+}
+
+int SP_DictCacheImpl :: put( void * item, time_t expTime )
+{
+	int result = 0;
+
+	purgeExpired( AUTO_PURGE_BUDGET );
+
+	size_t size = mHandler->getSize( item );
+
+	if( mMaxBytes > 0 && size > mMaxBytes ) {
+		// it never fits, the old item of the key is stale now, the caller keeps the item
+		erase( item );
+		mStatistics->markReject();
+
+		return -1;
+	}
+
+	SP_DictCacheEntry * entry = mPool->alloc( item );
+	entry->setExpTime( expTime );
+	entry->setSize( size );
+	if( expTime > 0 ) mWheel->add( entry );
+
+	if( NULL != mSketch ) {
+		mSketch->increment( mHandler->hash( item ) );
+		entry->setInWindow( 1 );
+	}
+
+	SP_DictCacheEntry * oldEntry = (SP_DictCacheEntry*)mDict->replace( entry );
+	if( NULL != oldEntry ) {
+		result = 1;
+
+		getList( oldEntry )->remove( oldEntry );
+		mWheel->remove( oldEntry );
+		entry->setInWindow( oldEntry->isInWindow() );
+
+		mHandler->destroy( (void*)oldEntry->getItem() );
+		mPool->free( oldEntry );
+	}
+
+	if( NULL != mSketch ) {
+		getList( entry )->append( entry );
+		if( mMaxItems > 0 || mMaxBytes > 0 ) admit();
+
+		return result;
+	}
+
+	// evict before appending, the clock hand must not pick the new entry
+	for( ; ( mMaxItems > 0 && mDict->getCount() > mMaxItems )
+			|| ( mMaxBytes > 0 && mList->getBytes() + size > mMaxBytes ); ) {
+		SP_DictCacheEntry * head = getVictim();
+
+		mList->remove( head );
+		evict( head );
+	}
+
+	mList->append( entry );
+
+	return result;
+}
+
+SP_DictCacheEntryList * SP_DictCacheImpl :: getList( SP_DictCacheEntry * entry )
+{
+	return entry->isInWindow() ? mWindow : mList;
+}
+
+void SP_DictCacheImpl :: evict( SP_DictCacheEntry * entry )
+{
+	mDict->remove( entry );
+	mWheel->remove( entry );
+
+	mHandler->destroy( (void*)entry->getItem() );
+	mPool->free( entry );
+}
+
+int SP_DictCacheImpl :: hasRoom( SP_DictCacheEntry * entry )
+{
+	if( mMaxItems > 0 && mList->getCount() >= mMaxItems - mWindowItems ) return 0;
+
+	if( mMaxBytes > 0 && mList->getBytes() + entry->getSize() > mMaxBytes - mWindowBytes ) return 0;
+
+	return 1;
+}
+
+void SP_DictCacheImpl :: admit()
+{
+	// the newest item always stays in the window, even if it's larger than mWindowBytes
+	for( ; ( mMaxItems > 0 && mWindow->getCount() > mWindowItems )
+			|| ( mMaxBytes > 0 && mWindow->getBytes() > mWindowBytes && mWindow->getCount() > 1 ); ) {
+		SP_DictCacheEntry * candidate = mWindow->getHead();
+		mWindow->remove( candidate );
+		candidate->setInWindow( 0 );
+
+		int frequency = mSketch->estimate( mHandler->hash( candidate->getItem() ) );
+
+		// larger than the main list, don't flush the list for nothing
+		if( mMaxBytes > 0 && candidate->getSize() > mMaxBytes - mWindowBytes ) frequency = 0;
+
+		// a large candidate may push out several victims, it must beat each of them
+		for( ; ! hasRoom( candidate ); ) {
+			SP_DictCacheEntry * victim = mList->getHead();
+
+			if( NULL == victim || frequency
+					<= mSketch->estimate( mHandler->hash( victim->getItem() ) ) ) {
+				break;
+			}
+
+			mList->remove( victim );
+			evict( victim );
+		}
+
+		if( hasRoom( candidate ) ) {
+			mList->append( candidate );
+		} else {
+			mStatistics->markReject();
+
+			evict( candidate );
+		}
+	}
+
+	// make place for an oversized window
+	for( ; mMaxBytes > 0 && mList->getBytes() + mWindow->getBytes() > mMaxBytes; ) {
+		SP_DictCacheEntry * victim = mList->getHead();
+
+		mList->remove( victim );
+		evict( victim );
+	}
+}
+
+SP_DictCacheEntry * SP_DictCacheImpl :: getVictim()
+{
+	SP_DictCacheEntry * head = mList->getHead();
+
+	if( eCLOCK == mAlgo ) {
+		// the list head is the clock hand, referenced items get a second chance
+		for( ; head->isReferenced(); head = mList->getHead() ) {
+			head->setReferenced( 0 );
+
+			mList->remove( head );
+			mList->append( head );
+		}
+	}
+
+	return head;
+}
+
+int SP_DictCacheImpl :: get( const void * key, void * resultHolder )
+{
+	int result = 0;
+
+	purgeExpired( AUTO_PURGE_BUDGET );
+
+	if( NULL != mSketch ) mSketch->increment( mHandler->hash( key ) );
+
+	SP_DictCacheEntry keyEntry( key );
+	SP_DictCacheEntry * entry = (SP_DictCacheEntry*)mDict->search( &keyEntry );
+
+	if( NULL != entry ) {
+		if( entry->getExpTime() > 0 && entry->getExpTime() < time( NULL ) ) {
+			erase( key );
+		} else {
+			result = 1;
+			mHandler->onHit( entry->getItem(), resultHolder );
+
+			if( eLRU == mAlgo ) {
+				mList->remove( entry );
+				mList->append( entry );
+			} else if( eCLOCK == mAlgo ) {
+				entry->setReferenced( 1 );
+			} else if( eTinyLFU == mAlgo ) {
+				getList( entry )->remove( entry );
+				getList( entry )->append( entry );
+			}
+
+			mStatistics->markHit();
+		}
+	} else {
+		mStatistics->markMiss();
+	}
+
+	return result;
+}
+
+int SP_DictCacheImpl :: getShared( const void * key, void * resultHolder )
+{
+	if( eFIFO != mAlgo && eCLOCK != mAlgo ) return -1;
+
+	SP_DictCacheEntry keyEntry( key );
+	SP_DictCacheEntry * entry = (SP_DictCacheEntry*)mDict->search( &keyEntry );
+
+	if( NULL == entry ) {
+		mStatistics->markMiss();
+		return 0;
+	}
+
+	// get erases it
+	if( entry->getExpTime() > 0 && entry->getExpTime() < time( NULL ) ) return -1;
+
+	mHandler->onHit( entry->getItem(), resultHolder );
+
+	// the readers only set the bit, the hand of put clears it under the exclusive lock
+	if( eCLOCK == mAlgo && ! entry->isReferenced() ) entry->setReferenced( 1 );
+
+	mStatistics->markHit();
+
+	return 1;
+}
+
+int SP_DictCacheImpl :: erase( const void * key )
+{
+	int result = 0;
+
+	void * item = remove( key );
+
+	if( NULL != item ) {
+		result = 1;
+		mHandler->destroy( item );
+	}
+
+	return result;
+}
+
+void * SP_DictCacheImpl :: remove( const void * key, time_t * expTime )
+{
+	void * result = NULL;
+
+	SP_DictCacheEntry keyEntry( key );
+	SP_DictCacheEntry * entry = (SP_DictCacheEntry*)mDict->remove( &keyEntry );
+
+	if( NULL != entry ) {
+		getList( entry )->remove( entry );
+		mWheel->remove( entry );
+
+		if( NULL != expTime ) *expTime = entry->getExpTime();
+		result = (void*)entry->getItem();
+		mPool->free( entry );
+	}
+
+	return result;
+}
+
+// orders the indexes of a batch by their items
+class SP_DictCacheItemLess {
+public:
+	SP_DictCacheItemLess( SP_DictCacheHandler * handler, const void ** items ) {
+		mHandler = handler;
+		mItems = items;
+	}
+
+	bool operator()( int index1, int index2 ) const {
+		return mHandler->compare( mItems[ index1 ], mItems[ index2 ] ) < 0;
+	}
+
+private:
+	SP_DictCacheHandler * mHandler;
+	const void ** mItems;
+};
+
+int * SP_DictCacheImpl :: getOrder( const void ** items, int count )
+{
+	if( mHandler->isHashable() || count <= 1 ) return NULL;
+
+	int * order = (int*)malloc( sizeof( int ) * count );
+	for( int i = 0; i < count; i++ ) order[i] = i;
+
+	// stable, the last one of the duplicate items wins in putMulti
+	std::stable_sort( order, order + count, SP_DictCacheItemLess( mHandler, items ) );
+
+	return order;
+}
+
+void SP_DictCacheImpl :: prefetch( const void * key )
+{
+	SP_DictCacheEntry keyEntry( key );
+	mDict->prefetch( &keyEntry );
+}
+
+int SP_DictCacheImpl :: getMulti( const void ** keys, int count,
+		void ** resultHolders, int * found )
+{
+	int result = 0;
+
+	int * order = getOrder( keys, count );
+
+	if( NULL == order ) {
+		for( int i = 0; i < count && i < PREFETCH_DISTANCE; i++ ) prefetch( keys[i] );
+	}
+
+	for( int i = 0; i < count; i++ ) {
+		int index = i;
+
+		if( NULL != order ) {
+			index = order[i];
+		} else if( i + PREFETCH_DISTANCE < count ) {
+			prefetch( keys[ i + PREFETCH_DISTANCE ] );
+		}
+
+		found[ index ] = get( keys[ index ], resultHolders[ index ] );
+		result += found[ index ];
+	}
+
+	if( NULL != order ) free( order );
+
+	return result;
+}
+
+int SP_DictCacheImpl :: putMulti( void ** items, time_t * expTimes, int count )
+{
+	int result = 0;
+
+	int * order = getOrder( (const void**)items, count );
+
+	if( NULL == order ) {
+		for( int i = 0; i < count && i < PREFETCH_DISTANCE; i++ ) prefetch( items[i] );
+	}
+
+	for( int i = 0; i < count; i++ ) {
+		int index = i;
+
+		if( NULL != order ) {
+			index = order[i];
+		} else if( i + PREFETCH_DISTANCE < count ) {
+			prefetch( items[ i + PREFETCH_DISTANCE ] );
+		}
+
+		int ret = put( items[ index ], NULL != expTimes ? expTimes[ index ] : 0 );
+
+		if( ret < 0 ) {
+			mHandler->destroy( items[ index ] );
+		} else {
+			result += ret;
+		}
+	}
+
+	if( NULL != order ) free( order );
+
+	return result;
+}
+
+SP_DictCacheStatistics * SP_DictCacheImpl :: getStatistics()
+{
+	SP_DictCacheStatisticsImpl * ret = new SP_DictCacheStatisticsImpl( *mStatistics );
+	ret->setSize( mDict->getCount() );
+	ret->setBytes( mList->getBytes() + ( NULL != mWindow ? mWindow->getBytes() : 0 ) );
+
+	return ret;
+}
+
+int SP_DictCacheImpl :: purgeExpired( int budget )
+{
+	int count = 0;
+
+	time_t now = time( NULL );
+
+	for( SP_DictCacheEntry * entry = mWheel->popExpired( now, &budget );
+			NULL != entry; entry = mWheel->popExpired( now, &budget ) ) {
+		getList( entry )->remove( entry );
+		evict( entry );
+		count++;
+	}
+
+	return count;
+}
+
+//===========================================================================
+
+/**
+ * The writers take the lock exclusively. get and getMulti of eFIFO and eCLOCK
+ * take it shared, and only fall back to the exclusive lock for an expired
+ * item. WIN32 has no read/write lock here, all the calls are exclusive.
+ */
+class SP_ThreadSafeCacheWrapper : public SP_DictCache {
+public:
+	SP_ThreadSafeCacheWrapper( SP_DictCacheImpl * cache );
+	virtual ~SP_ThreadSafeCacheWrapper();
+
+	virtual int put( void * item, time_t expTime = 0 );
+	virtual int get( const void * key, void * resultHolder );
+	virtual int erase( const void * key );
+	virtual void * remove( const void * key, time_t * expTime );
+	virtual int getMulti( const void ** keys, int count,
+			void ** resultHolders, int * found );
+	virtual int putMulti( void ** items, time_t * expTimes, int count );
+	virtual SP_DictCacheStatistics * getStatistics();
+	virtual int purgeExpired( int budget );
+
+private:
+
+	void lock();
+	void lockShared();
+	void unlock();
+
+	SP_DictCacheImpl * mCache;
+
+#ifndef WIN32
+	pthread_rwlock_t mMutex;
+#else
+	HANDLE mMutex;
+#endif
+
+};
+
+SP_ThreadSafeCacheWrapper :: SP_ThreadSafeCacheWrapper( SP_DictCacheImpl * cache )
+{
+	mCache = cache;
+
+#ifndef WIN32
+	pthread_rwlock_init( &mMutex, NULL );
+#else
+	mMutex = CreateMutex(0, FALSE, 0);
+#endif
+}
+
+SP_ThreadSafeCacheWrapper :: ~SP_ThreadSafeCacheWrapper()
+{
+	delete mCache;
+
+#ifndef WIN32
+	pthread_rwlock_destroy( &mMutex );
+#else
+	CloseHandle( mMutex );
+#endif
+}
+
+void SP_ThreadSafeCacheWrapper :: lock()
+{
+#ifndef WIN32
+	pthread_rwlock_wrlock( &mMutex );
+#else
+	WaitForSingleObject( mMutex, INFINITE );
+#endif
+}
+
+void SP_ThreadSafeCacheWrapper :: lockShared()
+{
+#ifndef WIN32
+	pthread_rwlock_rdlock( &mMutex );
+#else
+	WaitForSingleObject( mMutex, INFINITE );
+#endif
+}
+
+void SP_ThreadSafeCacheWrapper :: unlock()
+{
+#ifndef WIN32
+	pthread_rwlock_unlock( &mMutex );
+#else
+	ReleaseMutex( mMutex );
 #endif
 }
 
@@ -506,12 +1453,20 @@ int SP_ThreadSafeCacheWrapper :: put( void * item, time_t expTime )
 
 int SP_ThreadSafeCacheWrapper :: get( const void * key, void * resultHolder )
 {
-	lock();
+	lockShared();
 
-	int ret = mCache->get( key, resultHolder );
+	int ret = mCache->getShared( key, resultHolder );
 
 	unlock();
 
+	if( ret < 0 ) {
+		lock();
+
+		ret = mCache->get( key, resultHolder );
+
+		unlock();
+	}
+
 	return ret;
 }
 
@@ -537,6 +1492,57 @@ void * SP_ThreadSafeCacheWrapper :: remove( const void * key, time_t * expTime )
 	return item;
 }
 
+int SP_ThreadSafeCacheWrapper :: getMulti( const void ** keys, int count,
+		void ** resultHolders, int * found )
+{
+	int ret = 0, pending = 0;
+
+	lockShared();
+
+	for( int i = 0; i < count; i++ ) {
+		found[i] = mCache->getShared( keys[i], resultHolders[i] );
+
+		if( found[i] < 0 ) {
+			pending++;
+		} else {
+			ret += found[i];
+		}
+	}
+
+	unlock();
+
+	// eLRU and eTinyLFU change the lists on every hit, they go here at once
+	if( pending > 0 ) {
+		lock();
+
+		if( pending == count ) {
+			ret = mCache->getMulti( keys, count, resultHolders, found );
+		} else {
+			for( int i = 0; i < count; i++ ) {
+				if( found[i] < 0 ) {
+					found[i] = mCache->get( keys[i], resultHolders[i] );
+					ret += found[i];
+				}
+			}
+		}
+
+		unlock();
+	}
+
+	return ret;
+}
+
+int SP_ThreadSafeCacheWrapper :: putMulti( void ** items, time_t * expTimes, int count )
+{
+	lock();
+
+	int ret = mCache->putMulti( items, expTimes, count );
+
+	unlock();
+
+	return ret;
+}
+
 SP_DictCacheStatistics * SP_ThreadSafeCacheWrapper :: getStatistics()
 {
 	lock();
@@ -548,17 +1554,270 @@ SP_DictCacheStatistics * SP_ThreadSafeCacheWrapper :: getStatistics()
 	return stat;
 }
 
+int SP_ThreadSafeCacheWrapper :: purgeExpired( int budget )
+{
+	lock();
+
+	int ret = mCache->purgeExpired( budget );
+
+	unlock();
+
+	return ret;
+}
+
+//===========================================================================
+
+class SP_DictShardedCache : public SP_DictCache {
+public:
+	SP_DictShardedCache( int algo, int maxItems, size_t maxBytes,
+			SP_DictCacheHandler * handler, int threadSafe, int shardCount );
+	virtual ~SP_DictShardedCache();
+
+	virtual int put( void * item, time_t expTime = 0 );
+	virtual int get( const void * key, void * resultHolder );
+	virtual int erase( const void * key );
+	virtual void * remove( const void * key, time_t * expTime );
+	virtual int getMulti( const void ** keys, int count,
+			void ** resultHolders, int * found );
+	virtual int putMulti( void ** items, time_t * expTimes, int count );
+	virtual SP_DictCacheStatistics * getStatistics();
+	virtual int purgeExpired( int budget );
+
+private:
+
+	int getShardIndex( const void * key );
+
+	SP_DictCache * getShard( const void * key );
+
+	/**
+	 * group the items by shard, the items of shard i are
+	 * items[ order[ offsets[i] ] ] ... items[ order[ offsets[i + 1] - 1 ] ]
+	 *
+	 * @param offsets : mShardCount + 1 elements
+	 * @return order, caller must free the return value
+	 */
+	int * groupByShard( const void ** items, int count, int * offsets );
+
+	SP_DictCacheHandler * mHandler;
+
+	int mShardCount;
+	SP_DictCache ** mShards;
+};
+
+SP_DictShardedCache :: SP_DictShardedCache( int algo, int maxItems, size_t maxBytes,
+		SP_DictCacheHandler * handler, int threadSafe, int shardCount )
+{
+	mHandler = handler;
+
+	// every shard holds one item at least, the limits add up to maxItems
+	mShardCount = ( maxItems > 0 && shardCount > maxItems ) ? maxItems : shardCount;
+
+	mShards = (SP_DictCache**)malloc( sizeof( void * ) * mShardCount );
+
+	for( int i = 0; i < mShardCount; i++ ) {
+		// split maxItems, the first shards take the remainder
+		int shardItems = 0;
+		if( maxItems > 0 ) {
+			shardItems = maxItems / mShardCount + ( i < maxItems % mShardCount ? 1 : 0 );
+		}
+
+		size_t shardBytes = 0;
+		if( maxBytes > 0 ) {
+			shardBytes = maxBytes / mShardCount + ( i < (int)( maxBytes % mShardCount ) ? 1 : 0 );
+		}
+
+		SP_DictCacheImpl * impl = new SP_DictCacheImpl( algo, shardItems, shardBytes, handler, 0 );
+		SP_DictCache * shard = impl;
+		if( threadSafe ) shard = new SP_ThreadSafeCacheWrapper( impl );
+
+		mShards[i] = shard;
+	}
+}
+
+SP_DictShardedCache :: ~SP_DictShardedCache()
+{
+	for( int i = 0; i < mShardCount; i++ ) {
+		delete mShards[i];
+	}
+
+	free( mShards );
+
+	delete mHandler;
+}
+
+int SP_DictShardedCache :: getShardIndex( const void * key )
+{
+	// spread weak hash codes before taking the modulus
+	unsigned int hash = mHandler->hash( key ) * 2654435761U;
+	hash ^= hash >> 16;
+
+	return hash % mShardCount;
+}
+
+SP_DictCache * SP_DictShardedCache :: getShard( const void * key )
+{
+	return mShards[ getShardIndex( key ) ];
+}
+
+int * SP_DictShardedCache :: groupByShard( const void ** items, int count, int * offsets )
+{
+	int * shardList = (int*)malloc( sizeof( int ) * count );
+	int * order = (int*)malloc( sizeof( int ) * count );
+
+	memset( offsets, 0, sizeof( int ) * ( mShardCount + 1 ) );
+
+	// counting sort, keeps the order of the items in each shard
+	for( int i = 0; i < count; i++ ) {
+		shardList[i] = getShardIndex( items[i] );
+		offsets[ shardList[i] + 1 ]++;
+	}
+
+	for( int i = 0; i < mShardCount; i++ ) offsets[ i + 1 ] += offsets[i];
+
+	for( int i = 0; i < count; i++ ) {
+		order[ offsets[ shardList[i] ]++ ] = i;
+	}
+
+	// the fill loop moved each offset to the start of the next shard
+	for( int i = mShardCount; i > 0; i-- ) offsets[i] = offsets[ i - 1 ];
+	offsets[0] = 0;
+
+	free( shardList );
+
+	return order;
+}
+
+int SP_DictShardedCache :: getMulti( const void ** keys, int count,
+		void ** resultHolders, int * found )
+{
+	int result = 0;
+
+	int * offsets = (int*)malloc( sizeof( int ) * ( mShardCount + 1 ) );
+	int * order = groupByShard( keys, count, offsets );
+
+	const void ** shardKeys = (const void**)malloc( sizeof( void * ) * count );
+	void ** shardHolders = (void**)malloc( sizeof( void * ) * count );
+	int * shardFound = (int*)malloc( sizeof( int ) * count );
+
+	for( int i = 0; i < count; i++ ) {
+		shardKeys[i] = keys[ order[i] ];
+		shardHolders[i] = resultHolders[ order[i] ];
+	}
+
+	for( int i = 0; i < mShardCount; i++ ) {
+		int begin = offsets[i], end = offsets[ i + 1 ];
+		if( begin >= end ) continue;
+
+		result += mShards[i]->getMulti( shardKeys + begin, end - begin,
+				shardHolders + begin, shardFound + begin );
+	}
+
+	for( int i = 0; i < count; i++ ) found[ order[i] ] = shardFound[i];
+
+	free( shardFound );
+	free( shardHolders );
+	free( shardKeys );
+	free( order );
+	free( offsets );
+
+	return result;
+}
+
+int SP_DictShardedCache :: putMulti( void ** items, time_t * expTimes, int count )
+{
+	int result = 0;
+
+	int * offsets = (int*)malloc( sizeof( int ) * ( mShardCount + 1 ) );
+	int * order = groupByShard( (const void**)items, count, offsets );
+
+	void ** shardItems = (void**)malloc( sizeof( void * ) * count );
+	time_t * shardExpTimes = NULL;
+	if( NULL != expTimes ) shardExpTimes = (time_t*)malloc( sizeof( time_t ) * count );
+
+	for( int i = 0; i < count; i++ ) {
+		shardItems[i] = items[ order[i] ];
+		if( NULL != expTimes ) shardExpTimes[i] = expTimes[ order[i] ];
+	}
+
+	for( int i = 0; i < mShardCount; i++ ) {
+		int begin = offsets[i], end = offsets[ i + 1 ];
+		if( begin >= end ) continue;
+
+		result += mShards[i]->putMulti( shardItems + begin,
+				NULL != shardExpTimes ? shardExpTimes + begin : NULL, end - begin );
+	}
+
+	if( NULL != shardExpTimes ) free( shardExpTimes );
+	free( shardItems );
+	free( order );
+	free( offsets );
+
+	return result;
+}
+
+int SP_DictShardedCache :: put( void * item, time_t expTime )
+{
+	return getShard( item )->put( item, expTime );
+}
+
+int SP_DictShardedCache :: get( const void * key, void * resultHolder )
+{
+	return getShard( key )->get( key, resultHolder );
+}
+
+int SP_DictShardedCache :: erase( const void * key )
+{
+	return getShard( key )->erase( key );
+}
+
+void * SP_DictShardedCache :: remove( const void * key, time_t * expTime )
+{
+	return getShard( key )->remove( key, expTime );
+}
+
+SP_DictCacheStatistics * SP_DictShardedCache :: getStatistics()
+{
+	SP_DictCacheStatisticsImpl * ret = new SP_DictCacheStatisticsImpl();
+
+	for( int i = 0; i < mShardCount; i++ ) {
+		SP_DictCacheStatistics * stat = mShards[i]->getStatistics();
+		ret->add( stat );
+		delete stat;
+	}
+
+	return ret;
+}
+
+int SP_DictShardedCache :: purgeExpired( int budget )
+{
+	int count = 0;
+
+	// split the budget, the first shards take the remainder
+	for( int i = 0; i < mShardCount; i++ ) {
+		int shardBudget = budget / mShardCount + ( i < budget % mShardCount ? 1 : 0 );
+		if( shardBudget > 0 ) count += mShards[i]->purgeExpired( shardBudget );
+	}
+
+	return count;
+}
+
 //===========================================================================
 
 SP_DictCache :: ~SP_DictCache()
 {
 }
 
-SP_DictCache * SP_DictCache :: newInstance( int algo,
-		int maxItems, SP_DictCacheHandler * handler, int threadSafe )
+SP_DictCache * SP_DictCache :: newInstance( int algo, int maxItems,
+		SP_DictCacheHandler * handler, int threadSafe, int shardCount, size_t maxBytes )
 {
-	SP_DictCache * cache = new SP_DictCacheImpl( algo, maxItems, handler );
-	if( threadSafe ) cache = new SP_ThreadSafeCacheWrapper( cache );
+	if( shardCount > 1 && handler->isHashable() ) {
+		return new SP_DictShardedCache( algo, maxItems, maxBytes, handler,
+				threadSafe, shardCount );
+	}
+
+	SP_DictCacheImpl * impl = new SP_DictCacheImpl( algo, maxItems, maxBytes, handler );
+	SP_DictCache * cache = impl;
+	if( threadSafe ) cache = new SP_ThreadSafeCacheWrapper( impl );
 
 	return cache;
 }
@@ -7,6 +7,7 @@
 #define __spdictcache_hpp__
 
 #include <time.h>
+#include <sys/types.h>
 
 class SP_DictCacheHandler {
 public:
@@ -15,6 +16,20 @@ public:
 	virtual int compare( const void * item1, const void * item2 ) = 0;
 	virtual void destroy( void * item ) = 0;
 	virtual void onHit( const void * item, void * resultHolder ) = 0;
+
+	// @return hash code of the item, equal items must have the same hash code
+	virtual unsigned int hash( const void * item );
+
+	/**
+	 * @return 1 : hash() is implemented, the cache indexes the items with
+	 *  a hash table and may be sharded
+	 * @return 0 : only compare() is implemented, the cache falls back to
+	 *  a btree index and a single shard
+	 */
+	virtual int isHashable();
+
+	// @return bytes charged to the cache for the item, default is 1
+	virtual size_t getSize( const void * item );
 };
 
 class SP_DictCacheStatistics {
@@ -24,6 +39,13 @@ public:
 	virtual int getHits() const = 0;
 	virtual int getAccesses() const = 0;
 	virtual int getSize() const = 0;
+
+	// count of new items which lost the admission check of eTinyLFU,
+	// or which are larger than maxBytes
+	virtual int getRejects() const = 0;
+
+	// total size of the cached items, reported by SP_DictCacheHandler::getSize
+	virtual size_t getBytes() const = 0;
 };
 
 class SP_DictCache {
@@ -39,6 +61,8 @@ public:
 	 *  server time). 
 	 *
 	 * @return 0 : insert ok, 1 : update ok
+	 * @return -1 : the item is larger than maxBytes, it's still owned by the
+	 *  caller, and the old item of the same key is erased
 	 */
 	virtual int put( void * item, time_t expTime = 0 ) = 0;
 
@@ -51,15 +75,63 @@ public:
 	// @return NULL : no such key, NOT NULL : remove and return the item
 	virtual void * remove( const void * key, time_t * expTime = 0 ) = 0;
 
+	/**
+	 * get a batch of keys with one lock per shard
+	 *
+	 * @param resultHolders : resultHolders[i] is passed to onHit for keys[i]
+	 * @param found : found[i] is set to 1 if keys[i] is found, else 0
+	 * @return count of the found keys
+	 */
+	virtual int getMulti( const void ** keys, int count,
+			void ** resultHolders, int * found ) = 0;
+
+	/**
+	 * put a batch of items with one lock per shard
+	 *
+	 * @param expTimes : NULL if none of the items expires
+	 * @return count of the updated items, the items put rejects are destroyed
+	 */
+	virtual int putMulti( void ** items, time_t * expTimes, int count ) = 0;
+
 	// caller need to delete the return object
 	virtual SP_DictCacheStatistics * getStatistics() = 0;
 
+	/**
+	 * Reclaim the expired items. put/get already do it with a small budget,
+	 * call it from a timer if the cache is idle for long periods.
+	 *
+	 * @param budget : upper bound of the work, about one unit per item
+	 * @return count of the reclaimed items
+	 */
+	virtual int purgeExpired( int budget ) = 0;
+
 	//===========================================================
 
-	enum { eFIFO, eLRU };
+	// eCLOCK : second chance, a hit only sets the reference bit of the item,
+	//   put sweeps the list and evicts the first unreferenced item.
+	//   The gets of eFIFO and eCLOCK on a threadSafe cache run at the same
+	//   time, onHit must be safe to be called from several threads.
+	// eTinyLFU : new items enter a small LRU window, an item leaving the
+	//   window only replaces the LRU victim of the main list if a frequency
+	//   sketch estimates it to be more popular, it's scan resistant.
+	//   It falls back to eLRU if the handler is not hashable.
+	enum { eFIFO, eLRU, eCLOCK, eTinyLFU };
 
+	/**
+	 * @param shardCount : if it's greater than 1, the keys are hashed into
+	 *  shardCount independent caches, each with its own lock and its own
+	 *  FIFO/LRU list, and maxItems is split across the shards, there are
+	 *  never more shards than maxItems.
+	 *  It's ignored if the handler is not hashable. The handler must be
+	 *  safe to be called from several threads at the same time.
+	 * @param maxBytes : if it's greater than 0, put also evicts items until
+	 *  the total size of the items fits maxBytes, maxItems may be 0 to only
+	 *  bound the bytes. put rejects an item larger than maxBytes, and erases
+	 *  the old item of the same key.
+	 */
 	static SP_DictCache * newInstance( int algo, int maxItems,
-			SP_DictCacheHandler * handler, int threadSafe = 1 );
+			SP_DictCacheHandler * handler, int threadSafe = 1, int shardCount = 1,
+			size_t maxBytes = 0 );
 };
 
 #endif
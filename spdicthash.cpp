@@ -0,0 +1,235 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "spdicthash.hpp"
+
+//===========================================================================
+
+SP_DictHashHandler :: ~SP_DictHashHandler()
+{
+}
+
+//===========================================================================
+
+SP_DictHashTableIterator :: SP_DictHashTableIterator( void ** itemList,
+		int maxCount, int count )
+{
+	mItemList = itemList;
+	mMaxCount = maxCount;
+	mIndex = 0;
+	mRemainCount = count;
+}
+
+SP_DictHashTableIterator :: ~SP_DictHashTableIterator()
+{
+}
+
+const void * SP_DictHashTableIterator :: getNext( int * level )
+{
+	if( NULL != level ) *level = 0;
+
+	for( ; mIndex < mMaxCount; ) {
+		void * item = mItemList[ mIndex++ ];
+		if( NULL != item ) {
+			assert( mRemainCount-- >= 0 );
+			return item;
+		}
+	}
+
+	return NULL;
+}
+
+//===========================================================================
+
+SP_DictHashTable :: SP_DictHashTable( int initCount, SP_DictHashHandler * handler )
+{
+	mHandler = handler;
+	mCount = 0;
+
+	// keep the load factor below 3/4
+	int maxCount = 16;
+	for( ; maxCount * 3 < initCount * 4; ) maxCount *= 2;
+
+	mMaxCount = 0;
+	mItemList = NULL;
+	mHashList = NULL;
+
+	resize( maxCount );
+}
+
+SP_DictHashTable :: ~SP_DictHashTable()
+{
+	for( int i = 0; i < mMaxCount; i++ ) {
+		if( NULL != mItemList[i] ) mHandler->destroy( mItemList[i] );
+	}
+
+	free( mItemList );
+	free( mHashList );
+
+	delete mHandler;
+}
+
+unsigned int SP_DictHashTable :: mixHash( unsigned int hash )
+{
+	// murmur3 finalizer, the table only uses the low bits
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+
+	return hash;
+}
+
+int SP_DictHashTable :: lookup( const void * key, unsigned int hash,
+		int * insertPoint ) const
+{
+	unsigned int mask = mMaxCount - 1;
+
+	for( unsigned int i = hash & mask; ; i = ( i + 1 ) & mask ) {
+		if( NULL == mItemList[i] ) {
+			if( NULL != insertPoint ) *insertPoint = i;
+			break;
+		}
+
+		if( mHashList[i] == hash && 0 == mHandler->compare( key, mItemList[i] ) ) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+void SP_DictHashTable :: resize( int maxCount )
+{
+	void ** oldItemList = mItemList;
+	unsigned int * oldHashList = mHashList;
+	int oldMaxCount = mMaxCount;
+
+	mMaxCount = maxCount;
+	mItemList = (void**)malloc( sizeof( void * ) * mMaxCount );
+	memset( mItemList, 0, sizeof( void * ) * mMaxCount );
+	mHashList = (unsigned int*)malloc( sizeof( unsigned int ) * mMaxCount );
+	memset( mHashList, 0, sizeof( unsigned int ) * mMaxCount );
+
+	unsigned int mask = mMaxCount - 1;
+
+	for( int i = 0; i < oldMaxCount; i++ ) {
+		if( NULL == oldItemList[i] ) continue;
+
+		unsigned int index = oldHashList[i] & mask;
+		for( ; NULL != mItemList[ index ]; ) index = ( index + 1 ) & mask;
+
+		mItemList[ index ] = oldItemList[i];
+		mHashList[ index ] = oldHashList[i];
+	}
+
+	free( oldItemList );
+	free( oldHashList );
+}
+
+void SP_DictHashTable :: removeAt( int index )
+{
+	unsigned int mask = mMaxCount - 1;
+
+	// backward shift deletion, the table never holds tombstones
+	unsigned int hole = index;
+	for( unsigned int i = ( hole + 1 ) & mask; NULL != mItemList[i]; i = ( i + 1 ) & mask ) {
+		unsigned int home = mHashList[i] & mask;
+
+		// move the item if its home slot is not in ( hole, i ]
+		if( ( ( i - home ) & mask ) >= ( ( i - hole ) & mask ) ) {
+			mItemList[ hole ] = mItemList[i];
+			mHashList[ hole ] = mHashList[i];
+			hole = i;
+		}
+	}
+
+	mItemList[ hole ] = NULL;
+	mHashList[ hole ] = 0;
+
+	mCount--;
+}
+
+int SP_DictHashTable :: insert( void * item )
+{
+	void * old = replace( item );
+	if( NULL != old ) mHandler->destroy( old );
+
+	return NULL != old ? 1 : 0;
+}
+
+void * SP_DictHashTable :: replace( void * item )
+{
+	assert( NULL != item );
+
+	unsigned int hash = mixHash( mHandler->hash( item ) );
+
+	int insertPoint = -1;
+	int index = lookup( item, hash, &insertPoint );
+
+	if( index >= 0 ) {
+		void * ret = mItemList[ index ];
+		mItemList[ index ] = item;
+
+		return ret;
+	}
+
+	if( ( mCount + 1 ) * 4 > mMaxCount * 3 ) {
+		resize( mMaxCount * 2 );
+		lookup( item, hash, &insertPoint );
+	}
+
+	mItemList[ insertPoint ] = item;
+	mHashList[ insertPoint ] = hash;
+	mCount++;
+
+	return NULL;
+}
+
+const void * SP_DictHashTable :: search( const void * key ) const
+{
+	int index = lookup( key, mixHash( mHandler->hash( key ) ) );
+
+	return index >= 0 ? mItemList[ index ] : NULL;
+}
+
+void * SP_DictHashTable :: remove( const void * key )
+{
+	void * ret = NULL;
+
+	int index = lookup( key, mixHash( mHandler->hash( key ) ) );
+	if( index >= 0 ) {
+		ret = mItemList[ index ];
+		removeAt( index );
+	}
+
+	return ret;
+}
+
+int SP_DictHashTable :: getCount() const
+{
+	return mCount;
+}
+
+SP_DictIterator * SP_DictHashTable :: getIterator() const
+{
+	return new SP_DictHashTableIterator( mItemList, mMaxCount, mCount );
+}
+
+void SP_DictHashTable :: prefetch( const void * key ) const
+{
+#ifdef __GNUC__
+	unsigned int index = mixHash( mHandler->hash( key ) ) & ( mMaxCount - 1 );
+
+	__builtin_prefetch( mItemList + index );
+	__builtin_prefetch( mHashList + index );
+#endif
+}
+
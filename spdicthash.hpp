@@ -0,0 +1,69 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __spdicthash_hpp__
+#define __spdicthash_hpp__
+
+#include "spdictionary.hpp"
+
+class SP_DictHashHandler : public SP_DictHandler {
+public:
+	virtual ~SP_DictHashHandler();
+
+	// equal items must have the same hash code
+	virtual unsigned int hash( const void * item ) const = 0;
+};
+
+class SP_DictHashTableIterator : public SP_DictIterator {
+public:
+	SP_DictHashTableIterator( void ** itemList, int maxCount, int count );
+	virtual ~SP_DictHashTableIterator();
+
+	// the items are not sorted
+	virtual const void * getNext( int * level = 0 );
+
+private:
+	void ** mItemList;
+	int mMaxCount;
+	int mIndex;
+	int mRemainCount;
+};
+
+// open addressing hash table, linear probing
+class SP_DictHashTable : public SP_Dictionary {
+public:
+	SP_DictHashTable( int initCount, SP_DictHashHandler * handler );
+	virtual ~SP_DictHashTable();
+
+	virtual int insert( void * item );
+	virtual void * replace( void * item );
+	virtual const void * search( const void * key ) const;
+	virtual void * remove( const void * key );
+	virtual int getCount() const;
+	virtual SP_DictIterator * getIterator() const;
+	virtual void prefetch( const void * key ) const;
+
+private:
+
+	// @return >= 0 : found, -1 : not found, insertPoint is the first empty slot
+	int lookup( const void * key, unsigned int hash, int * insertPoint = 0 ) const;
+
+	void resize( int maxCount );
+
+	void removeAt( int index );
+
+	static unsigned int mixHash( unsigned int hash );
+
+	SP_DictHashHandler * mHandler;
+
+	// mMaxCount is a power of 2, mHashList caches the mixed hash of each item
+	void ** mItemList;
+	unsigned int * mHashList;
+	int mMaxCount;
+	int mCount;
+};
+
+#endif
+
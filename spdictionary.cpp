@@ -12,6 +12,7 @@
 #include "spdictarray.hpp"
 #include "spdictbstree.hpp"
 #include "spdictrbtree.hpp"
+#include "spdicthash.hpp"
 
 //===========================================================================
 
@@ -31,6 +32,19 @@ SP_Dictionary :: ~SP_Dictionary()
 {
 }
 
+void * SP_Dictionary :: replace( void * item )
+{
+	void * old = remove( item );
+
+	insert( item );
+
+	return old;
+}
+
+void SP_Dictionary :: prefetch( const void * key ) const
+{
+}
+
 SP_Dictionary * SP_Dictionary :: newBTree( int rank, SP_DictHandler * handler )
 {
 	return new SP_DictBTree( rank, handler );
@@ -41,6 +55,11 @@ SP_Dictionary * SP_Dictionary :: newSkipList( int maxLevel, SP_DictHandler * han
 	return new SP_DictSkipList( maxLevel, handler );
 }
 
+SP_Dictionary * SP_Dictionary :: newHashTable( int initCount, SP_DictHashHandler * handler )
+{
+	return new SP_DictHashTable( initCount, handler );
+}
+
 SP_Dictionary * SP_Dictionary :: newInstance( int type, SP_DictHandler * handler )
 {
 	if( eSkipList == type ) {
@@ -6,6 +6,8 @@
 #ifndef __spdictionary_hpp__
 #define __spdictionary_hpp__
 
+class SP_DictHashHandler;
+
 class SP_DictHandler {
 public:
 	virtual ~SP_DictHandler();
@@ -35,6 +37,16 @@ public:
 	// @return 0 : insert ok, 1 : update ok
 	virtual int insert( void * item ) = 0;
 
+	/**
+	 * insert the item, or swap it with the stored item of the same key,
+	 * the default is remove then insert, the in-tree dictionaries do both
+	 * in one lookup
+	 * @return NULL : insert ok
+	 * @return NOT NULL : update ok, return the replaced item,
+	 *           caller must destroy the return value
+	 */
+	virtual void * replace( void * item );
+
 	// @return NOT NULL : OK, NULL : FAIL
 	virtual const void * search( const void * key ) const = 0;
 
@@ -51,12 +63,18 @@ public:
 	// get the iterator of the dictionary
 	virtual SP_DictIterator * getIterator() const = 0;
 
+	// hint that the key will be searched soon, the default does nothing
+	virtual void prefetch( const void * key ) const;
+
 	//============================================================
 
 	static SP_Dictionary * newBTree( int rank, SP_DictHandler * handler );
 
 	static SP_Dictionary * newSkipList( int maxLevel, SP_DictHandler * handler );
 
+	// unordered, initCount is the expected item count
+	static SP_Dictionary * newHashTable( int initCount, SP_DictHashHandler * handler );
+
 	enum { eBSTree, eRBTree, eBTree, eSkipList, eSortedArray };
 	static SP_Dictionary * newInstance( int type, SP_DictHandler * handler );
 };
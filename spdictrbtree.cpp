@@ -240,7 +240,15 @@ void SP_DictRBTree :: rightRotate( SP_DictRBTreeNode * root )
 
 int SP_DictRBTree :: insert( void * item )
 {
-	int ret = 0;
+	void * old = replace( item );
+	if( NULL != old ) mHandler->destroy( old );
+
+	return NULL != old ? 1 : 0;
+}
+
+void * SP_DictRBTree :: replace( void * item )
+{
+	void * ret = NULL;
 
 	SP_DictRBTreeNode * parent = mNil;
 	SP_DictRBTreeNode * curr = mNil->getRight();
@@ -256,13 +264,13 @@ int SP_DictRBTree :: insert( void * item )
 		} else if( cmpRet > 0 ) {
 			curr = curr->getRight();
 		} else {
-			ret = 1;
-			mHandler->destroy( curr->takeItem() );
+			ret = curr->takeItem();
 			curr->setItem( item );
+			break;
 		}
 	}
 
-	if( 0 == ret ) {
+	if( NULL == ret ) {
 		mCount++;
 
 		SP_DictRBTreeNode * newNode = new SP_DictRBTreeNode( item );
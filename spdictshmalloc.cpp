@@ -8,64 +8,221 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-
-#pragma warning(disable : 4786)
+
+#ifdef __linux__
+#include <sys/vfs.h>
+#endif
+
+#ifndef WIN32
+#include <pthread.h>
+#include <unistd.h>
+#else
+#include <windows.h>
+#endif
+
+#pragma warning(disable : 4786)
 
 #include <set>
+#include <vector>
 
 using namespace std;
 
 #include "spdictshmalloc.hpp"
 #include "spdictmmap.hpp"
+#include "spdictshmlock.hpp"
 
-SP_DictShmAllocator :: SP_DictShmAllocator( void * ptrBase, size_t len, size_t itemSize )
+SP_DictShmAllocator :: SP_DictShmAllocator( void * ptrBase, size_t len, size_t itemSize,
+		int isConcurrent )
 {
 	mPtrBase = (char*)ptrBase;
 	mLen = len;
 	mItemSize = itemSize;
+	mIsConcurrent = isConcurrent;
 
-	mRecordSize = sizeof( char ) + itemSize;
+	// keep every record 8-byte aligned
+	mRecordSize = offsetof( Chunk_t, mPtr ) + itemSize;
+	mRecordSize = ( mRecordSize + 7 ) & ~( (size_t)7 );
 
-	mFirst = (Chunk_t*)ptrBase;
+	// the first records hold the head and the magazines
+	size_t headLen = sizeof( Head_t ) + ( isConcurrent ? sizeof( Magazine_t ) * MAX_MAGAZINE : 0 );
+
+	mHead = (Head_t*)ptrBase;
+	mReserved = ( headLen + mRecordSize - 1 ) / mRecordSize;
+
+	mMagazineList = isConcurrent ? (Magazine_t*)( mPtrBase + sizeof( Head_t ) ) : NULL;
+	mMagazine = NULL;
 }
 
 SP_DictShmAllocator :: ~SP_DictShmAllocator()
 {
 }
 
-int SP_DictShmAllocator :: getFreeCount() const
+int SP_DictShmAllocator :: isConcurrent() const
 {
-	int count = 0;
+	return mIsConcurrent;
+}
 
-	for( int idx = mFirst->mNext; idx > 0; ) {
-		Chunk_t * chunk = (Chunk_t*)( mPtrBase + idx * mRecordSize );
-		idx = chunk->mNext;
-		count++;
+void SP_DictShmAllocator :: attachMagazine( int slot )
+{
+	if( ! mIsConcurrent || slot < 0 || slot >= MAX_MAGAZINE ) return;
+
+	mMagazine = mMagazineList + slot;
+
+	// left by a process which exited without detach
+	drainMagazine( mMagazine, mMagazine->mCount );
+}
+
+void SP_DictShmAllocator :: detachMagazine()
+{
+	if( NULL != mMagazine ) drainMagazine( mMagazine, mMagazine->mCount );
+
+	mMagazine = NULL;
+}
+
+void SP_DictShmAllocator :: drainMagazine( Magazine_t * magazine, int count )
+{
+	for( ; count > 0 && magazine->mCount > 0; count-- ) {
+		pushFree( magazine->mIndex[ --magazine->mCount ] );
+	}
+}
+
+void SP_DictShmAllocator :: refillMagazine()
+{
+	for( ; mMagazine->mCount < MAGAZINE_BATCH; ) {
+		int index = popFree();
+
+		if( 0 == index ) {
+			index = bumpHighWater();
+			if( 0 == index ) break;
+
+			// a magazine only holds free records
+			Chunk_t * chunk = getRecord( index );
+			memset( chunk, 0, mRecordSize );
+			chunk->mFlags = FLAG_FREE;
+		}
+
+		mMagazine->mIndex[ mMagazine->mCount++ ] = index;
 	}
+}
 
-	return count;
+SP_DictShmAllocator::Chunk_t * SP_DictShmAllocator :: getRecord( size_t index ) const
+{
+	return (Chunk_t*)( mPtrBase + index * mRecordSize );
 }
 
-size_t SP_DictShmAllocator :: alloc()
+int SP_DictShmAllocator :: popFree()
 {
-	size_t ret = 0;
+	if( ! mIsConcurrent ) {
+		int index = mHead->mNext;
+		if( index > 0 ) mHead->mNext = getRecord( index )->mNext;
 
-	if( mFirst->mNext > 0 ) {
-		Chunk_t * chunk = (Chunk_t*)( mPtrBase + mFirst->mNext * mRecordSize );
+		return index;
+	}
 
-		assert( FLAG_FREE == chunk->mFlags );
+	for( ; ; ) {
+		unsigned long long top = mHead->mFreeTop;
+
+		int index = (int)( top & 0xffffffff );
+		if( 0 == index ) return 0;
+
+		// the record may be taken by others, then the tag is changed and the swap fails
+		int next = ( (volatile Chunk_t*)getRecord( index ) )->mNext;
 
-		mFirst->mNext = chunk->mNext;
+		unsigned long long newTop = ( ( ( top >> 32 ) + 1 ) << 32 ) | (unsigned int)next;
 
-		memset( chunk, 0, mRecordSize );
-		chunk->mFlags = FLAG_USED;
+		if( SP_DictShmLock::compareAndSwap( &( mHead->mFreeTop ), top, newTop ) ) return index;
+	}
+}
+
+void SP_DictShmAllocator :: pushFree( int index )
+{
+	Chunk_t * chunk = getRecord( index );
+
+	if( ! mIsConcurrent ) {
+		chunk->mNext = mHead->mNext;
+		mHead->mNext = index;
 
-		ret = ( chunk->mPtr - mPtrBase );
+		return;
 	}
 
-	return ret;
+	for( ; ; ) {
+		unsigned long long top = mHead->mFreeTop;
+
+		chunk->mNext = (int)( top & 0xffffffff );
+
+		unsigned long long newTop = ( ( ( top >> 32 ) + 1 ) << 32 ) | (unsigned int)index;
+
+		if( SP_DictShmLock::compareAndSwap( &( mHead->mFreeTop ), top, newTop ) ) return;
+	}
+}
+
+int SP_DictShmAllocator :: bumpHighWater()
+{
+	size_t maxCount = getMaxCount();
+
+	if( ! mIsConcurrent ) {
+		return mHead->mHighWater < maxCount ? (int)( mHead->mHighWater++ ) : 0;
+	}
+
+	for( ; ; ) {
+		size_t highWater = SP_DictShmLock::load( &( mHead->mHighWater ) );
+		if( highWater >= maxCount ) return 0;
+
+		if( SP_DictShmLock::compareAndSwap( &( mHead->mHighWater ), highWater, highWater + 1 ) ) {
+			return (int)highWater;
+		}
+	}
+}
+
+void SP_DictShmAllocator :: addFreeCount( long delta )
+{
+	if( mIsConcurrent ) {
+		SP_DictShmLock::atomicAdd( &( mHead->mFreeCount ), delta );
+	} else {
+		mHead->mFreeCount += delta;
+	}
+}
+
+int SP_DictShmAllocator :: getFreeCount() const
+{
+	return mHead->mFreeCount;
+}
+
+size_t SP_DictShmAllocator :: getMaxCount() const
+{
+	return mLen / mRecordSize;
+}
+
+size_t SP_DictShmAllocator :: alloc( size_t size )
+{
+	assert( size <= mItemSize );
+
+	int index = 0;
+
+	if( NULL != mMagazine ) {
+		if( 0 == mMagazine->mCount ) refillMagazine();
+		if( mMagazine->mCount > 0 ) index = mMagazine->mIndex[ --mMagazine->mCount ];
+	} else {
+		index = popFree();
+
+		// never used, it is not in the free list
+		if( 0 == index ) index = bumpHighWater();
+	}
+
+	if( 0 == index ) return 0;
+
+	addFreeCount( -1 );
+
+	Chunk_t * chunk = getRecord( index );
+
+	memset( chunk, 0, mRecordSize );
+	chunk->mFlags = FLAG_USED;
+
+	return chunk->mPtr - mPtrBase;
 }
 
 void SP_DictShmAllocator :: free( size_t offset )
@@ -74,47 +231,54 @@ void SP_DictShmAllocator :: free( size_t offset )
 
 	int index = ( offset / mRecordSize );
 
-	Chunk_t * chunk = (Chunk_t*)( mPtrBase + index * mRecordSize );
+	Chunk_t * chunk = getRecord( index );
 
 	assert( FLAG_USED == chunk->mFlags );
 
 	memset( chunk, 0, mRecordSize );
 	chunk->mFlags = FLAG_FREE;
-	chunk->mNext = mFirst->mNext;
-	mFirst->mNext = index;
-}
 
-int SP_DictShmAllocator :: isValid( size_t offset ) const
-{
-	int ret = 0;
+	if( NULL != mMagazine ) {
+		if( MAGAZINE_SIZE == mMagazine->mCount ) drainMagazine( mMagazine, MAGAZINE_BATCH );
+		mMagazine->mIndex[ mMagazine->mCount++ ] = index;
+	} else {
+		pushFree( index );
+	}
 
-	if( offset > 0 && offset < (size_t)mLen ) {
-		int index = ( offset / mRecordSize );
+	addFreeCount( 1 );
+}
 
-		Chunk_t * chunk = (Chunk_t*)( mPtrBase + index * mRecordSize );
+size_t SP_DictShmAllocator :: getItemSize( size_t offset ) const
+{
+	return mRecordSize - offsetof( Chunk_t, mPtr );
+}
 
-		if( (int)offset == ( chunk->mPtr - mPtrBase ) ) ret = 1;
-	}
+size_t SP_DictShmAllocator :: getFitSize( size_t size ) const
+{
+	size_t itemSize = mRecordSize - offsetof( Chunk_t, mPtr );
 
-	return ret;
+	return size <= itemSize ? itemSize : 0;
 }
 
-int SP_DictShmAllocator :: isUsed( size_t offset ) const
+int SP_DictShmAllocator :: isValid( size_t offset ) const
 {
 	int ret = 0;
 
 	if( offset > 0 && offset < (size_t)mLen ) {
-		int index = ( offset / mRecordSize );
+		size_t index = ( offset / mRecordSize );
 
-		Chunk_t * chunk = (Chunk_t*)( mPtrBase + index * mRecordSize );
-
-		if( (int)offset == ( chunk->mPtr - mPtrBase )
-				&& FLAG_USED == chunk->mFlags ) ret = 1;
+		if( index >= mReserved && index < getMaxCount()
+				&& offset == (size_t)( getRecord( index )->mPtr - mPtrBase ) ) ret = 1;
 	}
 
 	return ret;
 }
 
+int SP_DictShmAllocator :: isUsed( size_t offset ) const
+{
+	return isValid( offset ) && FLAG_USED == getRecord( offset / mRecordSize )->mFlags ? 1 : 0;
+}
+
 void * SP_DictShmAllocator :: getPtr( size_t offset ) const
 {
 	assert( isValid( offset ) );
@@ -133,61 +297,97 @@ size_t SP_DictShmAllocator :: getOffset( void * ptr ) const
 
 void SP_DictShmAllocator :: reset()
 {
-	int count = mLen / mRecordSize;
-
-	for( int i = 0; i < count; i++ ) {
-		Chunk_t * chunk = (Chunk_t*)( mPtrBase + i * mRecordSize );
+	size_t count = getMaxCount();
 
-		memset( chunk, 0, mRecordSize );
-
-		chunk->mFlags = FLAG_FREE;
+	// the records are cleared when alloc takes them first
+	memset( mHead, 0, sizeof( Head_t ) );
+	if( NULL != mMagazineList ) memset( mMagazineList, 0, sizeof( Magazine_t ) * MAX_MAGAZINE );
+	mHead->mHighWater = mReserved;
+	mHead->mFreeCount = count > mReserved ? count - mReserved : 0;
+}
 
-		if( i < count - 1 ) {
-			chunk->mNext = i + 1;
-		} else {
-			chunk->mNext = 0;
-		}
-	}
+size_t SP_DictShmAllocator :: getRangeCount() const
+{
+	return getMaxCount();
 }
 
 void SP_DictShmAllocator :: check( CheckFunc_t checkFunc, void * arg )
 {
-	int count = mLen / mRecordSize;
+	checkRange( checkFunc, arg, 0, getRangeCount() );
 
-	memset( mFirst, 0, mRecordSize );
-
-	int i = 0;
+	rebuildFreeList();
+}
 
-	for( i = 0; i < count; i++ ) {
-		Chunk_t * chunk = (Chunk_t*)( mPtrBase + i * mRecordSize );
+void SP_DictShmAllocator :: checkRange( CheckFunc_t checkFunc, void * arg,
+		size_t begin, size_t end )
+{
+	// the records above the high water are never used
+	if( begin < mReserved ) begin = mReserved;
+	if( end > mHead->mHighWater ) end = mHead->mHighWater;
+
+	for( size_t i = begin; i < end; i++ ) {
+		Chunk_t * chunk = getRecord( i );
 
 		if( FLAG_USED == chunk->mFlags ) {
 			if( 0 == checkFunc( chunk->mPtr, arg ) ) {
 				memset( chunk, 0, mRecordSize );
-				chunk->mFlags = FLAG_USED;
+				chunk->mFlags = FLAG_FREE;
 			}
 		}
 	}
+}
 
-	for( i = count - 1; i > 0; i-- ) {
-		Chunk_t * chunk = (Chunk_t*)( mPtrBase + i * mRecordSize );
+void SP_DictShmAllocator :: rebuildFreeList()
+{
+	size_t count = getMaxCount();
 
-		if( FLAG_FREE == chunk->mFlags ) {
-			chunk->mNext = mFirst->mNext;
-			mFirst->mNext = i;
+	// a broken head only costs a scan of the whole file
+	if( mHead->mHighWater < mReserved || mHead->mHighWater > count ) mHead->mHighWater = count;
+
+	// give the free records at the top back to the high water
+	for( ; mHead->mHighWater > mReserved
+			&& FLAG_USED != getRecord( mHead->mHighWater - 1 )->mFlags; ) {
+		mHead->mHighWater--;
+	}
+
+	// all the records of the magazines are linked below, the owners are locked out
+	if( NULL != mMagazineList ) {
+		for( int i = 0; i < MAX_MAGAZINE; i++ ) mMagazineList[i].mCount = 0;
+	}
+
+	mHead->mNext = 0;
+	mHead->mFreeCount = count - mHead->mHighWater;
+
+	for( size_t i = mHead->mHighWater; i > mReserved; i-- ) {
+		Chunk_t * chunk = getRecord( i - 1 );
+
+		// a record may be taken by a crashed alloc before it is marked
+		if( FLAG_USED != chunk->mFlags ) {
+			memset( chunk, 0, mRecordSize );
+			chunk->mFlags = FLAG_FREE;
+			chunk->mNext = mHead->mNext;
+			mHead->mNext = i - 1;
+
+			mHead->mFreeCount++;
 		}
 	}
+
+	if( mIsConcurrent ) {
+		unsigned long long tag = ( mHead->mFreeTop >> 32 ) + 1;
+		mHead->mFreeTop = ( tag << 32 ) | (unsigned int)mHead->mNext;
+		mHead->mNext = 0;
+	}
 }
 
 void SP_DictShmAllocator :: selfCheck( size_t * freeCount, size_t * usedCount )
 {
-	int count = mLen / mRecordSize;
+	size_t count = getMaxCount();
 
-	// 1. every record is free or used
-	assert( 0 == mFirst->mFlags );
+	assert( mHead->mHighWater >= mReserved && mHead->mHighWater <= count );
 
-	for( int i = 1; i < count; i++ ) {
-		Chunk_t * chunk = (Chunk_t*)( mPtrBase + i * mRecordSize );
+	// 1. every record below the high water is free or used
+	for( size_t i = mReserved; i < mHead->mHighWater; i++ ) {
+		Chunk_t * chunk = getRecord( i );
 
 		if( FLAG_FREE == chunk->mFlags ) {
 			(*freeCount) ++;
@@ -201,9 +401,11 @@ void SP_DictShmAllocator :: selfCheck( size_t * freeCount, size_t * usedCount )
 	set<int> freeSet;
 
 	// 2. check loop free record
-	for( int idx = mFirst->mNext; idx > 0; ) {
-		Chunk_t * chunk = (Chunk_t*)( mPtrBase + idx * mRecordSize );
+	int first = mIsConcurrent ? (int)( mHead->mFreeTop & 0xffffffff ) : mHead->mNext;
+	for( int idx = first; idx > 0; ) {
+		Chunk_t * chunk = getRecord( idx );
 
+		assert( (size_t)idx >= mReserved && (size_t)idx < mHead->mHighWater );
 		assert( FLAG_FREE == chunk->mFlags );
 
 		set<int>::iterator it = freeSet.find( idx );
@@ -213,15 +415,391 @@ void SP_DictShmAllocator :: selfCheck( size_t * freeCount, size_t * usedCount )
 		idx = chunk->mNext;
 	}
 
+	// 3. all free record is in freelist or in a magazine
+	for( int i = 0; NULL != mMagazineList && i < MAX_MAGAZINE; i++ ) {
+		Magazine_t * magazine = mMagazineList + i;
+
+		assert( magazine->mCount >= 0 && magazine->mCount <= MAGAZINE_SIZE );
+
+		for( int j = 0; j < magazine->mCount; j++ ) {
+			int idx = magazine->mIndex[j];
+
+			assert( (size_t)idx >= mReserved && (size_t)idx < mHead->mHighWater );
+			assert( FLAG_FREE == getRecord( idx )->mFlags );
+
+			assert( freeSet.end() == freeSet.find( idx ) );
+			freeSet.insert( idx );
+		}
+	}
+
+	assert( *freeCount == freeSet.size() );
+
+	// 4. the counter has the free list and the records above the high water
+	assert( mHead->mFreeCount == freeSet.size() + count - mHead->mHighWater );
+
+	(*freeCount) += count - mHead->mHighWater;
+}
+
+//---------------------------------------------------------------------------
+
+SP_DictShmSlabAllocator :: SP_DictShmSlabAllocator( void * ptrBase, size_t len,
+		size_t minItemSize, size_t maxItemSize )
+	: SP_DictShmAllocator( ptrBase, len, maxItemSize )
+{
+	size_t minRecord = ( offsetof( Chunk_t, mPtr ) + minItemSize + 7 ) & ~( (size_t)7 );
+	size_t maxRecord = mRecordSize;
+
+	// geometric classes, the last one is maxRecord
+	mClassCount = 0;
+	for( size_t size = minRecord; size < maxRecord && mClassCount < MAX_CLASS - 1; ) {
+		mClassSize[ mClassCount++ ] = size;
+
+		size_t next = ( ( size * 5 / 4 ) + 7 ) & ~( (size_t)7 );
+		size = next > size ? next : size + 8;
+	}
+	mClassSize[ mClassCount++ ] = maxRecord;
+
+	// a page holds a few of the largest records
+	mPageSize = 4 * maxRecord > 4096 ? 4 * maxRecord : 4096;
+	mPageSize = ( mPageSize + 4095 ) & ~( (size_t)4095 );
+
+	size_t headerLen = sizeof( SlabHeader_t ) + 64;
+	mPageCount = len > headerLen ? ( len - headerLen ) / ( mPageSize + 1 ) : 0;
+	mPageStart = ( sizeof( SlabHeader_t ) + mPageCount + 63 ) & ~( (size_t)63 );
+
+	mSlabHeader = (SlabHeader_t*)ptrBase;
+	mPageClass = (unsigned char*)ptrBase + sizeof( SlabHeader_t );
+}
+
+SP_DictShmSlabAllocator :: ~SP_DictShmSlabAllocator()
+{
+}
+
+int SP_DictShmSlabAllocator :: getClass( size_t size ) const
+{
+	size_t record = offsetof( Chunk_t, mPtr ) + size;
+
+	int low = 0, high = mClassCount;
+	for( ; low < high; ) {
+		int mid = ( low + high ) / 2;
+		if( mClassSize[ mid ] < record ) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	return low < mClassCount ? low : -1;
+}
+
+SP_DictShmAllocator::Chunk_t * SP_DictShmSlabAllocator :: getChunk( size_t offset, int * cls ) const
+{
+	size_t start = offset - offsetof( Chunk_t, mPtr );
+
+	if( offset < offsetof( Chunk_t, mPtr ) || start < mPageStart ) return NULL;
+
+	size_t page = ( start - mPageStart ) / mPageSize;
+	if( page >= mPageCount || 0 == mPageClass[ page ] ) return NULL;
+
+	*cls = mPageClass[ page ] - 1;
+	if( *cls >= mClassCount ) return NULL;
+
+	size_t inPage = ( start - mPageStart ) % mPageSize;
+	size_t classSize = mClassSize[ *cls ];
+
+	if( 0 != inPage % classSize || inPage / classSize >= mPageSize / classSize ) return NULL;
+
+	return (Chunk_t*)( mPtrBase + start );
+}
+
+int SP_DictShmSlabAllocator :: addPage( int cls )
+{
+	if( mSlabHeader->mUsedPages >= mPageCount ) return 0;
+
+	size_t page = mSlabHeader->mUsedPages++;
+	mPageClass[ page ] = cls + 1;
+
+	size_t classSize = mClassSize[ cls ];
+	size_t pageOffset = mPageStart + page * mPageSize;
+
+	// link the records in address order
+	for( size_t i = mPageSize / classSize; i > 0; i-- ) {
+		size_t start = pageOffset + ( i - 1 ) * classSize;
+		Chunk_t * chunk = (Chunk_t*)( mPtrBase + start );
+
+		memset( chunk, 0, classSize );
+		chunk->mFlags = FLAG_FREE;
+		chunk->mNextOffset = mSlabHeader->mFreeList[ cls ];
+		mSlabHeader->mFreeList[ cls ] = start;
+		mSlabHeader->mFreeCount++;
+	}
+
+	return 1;
+}
+
+size_t SP_DictShmSlabAllocator :: alloc( size_t size )
+{
+	int cls = getClass( 0 == size ? mItemSize : size );
+	if( cls < 0 ) return 0;
+
+	if( 0 == mSlabHeader->mFreeList[ cls ] && ! addPage( cls ) ) {
+		// no more page, borrow a free record of a larger class
+		for( cls++; cls < mClassCount && 0 == mSlabHeader->mFreeList[ cls ]; ) cls++;
+		if( cls >= mClassCount ) return 0;
+	}
+
+	Chunk_t * chunk = (Chunk_t*)( mPtrBase + mSlabHeader->mFreeList[ cls ] );
+
+	assert( FLAG_FREE == chunk->mFlags );
+
+	mSlabHeader->mFreeList[ cls ] = chunk->mNextOffset;
+	mSlabHeader->mFreeCount--;
+
+	memset( chunk, 0, mClassSize[ cls ] );
+	chunk->mFlags = FLAG_USED;
+
+	return chunk->mPtr - mPtrBase;
+}
+
+void SP_DictShmSlabAllocator :: free( size_t offset )
+{
+	int cls = 0;
+	Chunk_t * chunk = getChunk( offset, &cls );
+
+	assert( NULL != chunk && FLAG_USED == chunk->mFlags );
+
+	memset( chunk, 0, mClassSize[ cls ] );
+	chunk->mFlags = FLAG_FREE;
+	chunk->mNextOffset = mSlabHeader->mFreeList[ cls ];
+	mSlabHeader->mFreeList[ cls ] = (char*)chunk - mPtrBase;
+	mSlabHeader->mFreeCount++;
+}
+
+size_t SP_DictShmSlabAllocator :: getItemSize( size_t offset ) const
+{
+	int cls = 0;
+	Chunk_t * chunk = getChunk( offset, &cls );
+
+	return NULL != chunk ? mClassSize[ cls ] - offsetof( Chunk_t, mPtr ) : 0;
+}
+
+size_t SP_DictShmSlabAllocator :: getFitSize( size_t size ) const
+{
+	int cls = getClass( 0 == size ? mItemSize : size );
+
+	return cls >= 0 ? mClassSize[ cls ] - offsetof( Chunk_t, mPtr ) : 0;
+}
+
+int SP_DictShmSlabAllocator :: isValid( size_t offset ) const
+{
+	int cls = 0;
+
+	return NULL != getChunk( offset, &cls ) ? 1 : 0;
+}
+
+int SP_DictShmSlabAllocator :: isUsed( size_t offset ) const
+{
+	int cls = 0;
+	Chunk_t * chunk = getChunk( offset, &cls );
+
+	return NULL != chunk && FLAG_USED == chunk->mFlags ? 1 : 0;
+}
+
+void SP_DictShmSlabAllocator :: reset()
+{
+	// the pages are cleared when a class takes them
+	memset( mSlabHeader, 0, sizeof( SlabHeader_t ) );
+	memset( mPageClass, 0, mPageCount );
+}
+
+int SP_DictShmSlabAllocator :: getFreeCount() const
+{
+	return mSlabHeader->mFreeCount;
+}
+
+size_t SP_DictShmSlabAllocator :: getMaxCount() const
+{
+	return mPageCount * ( mPageSize / mClassSize[0] );
+}
+
+size_t SP_DictShmSlabAllocator :: getRangeCount() const
+{
+	return mSlabHeader->mUsedPages < mPageCount ? mSlabHeader->mUsedPages : mPageCount;
+}
+
+void SP_DictShmSlabAllocator :: checkRange( CheckFunc_t checkFunc, void * arg,
+		size_t begin, size_t end )
+{
+	if( end > getRangeCount() ) end = getRangeCount();
+
+	for( size_t page = begin; page < end; page++ ) {
+		int cls = mPageClass[ page ] - 1;
+		if( cls < 0 || cls >= mClassCount ) continue;
+
+		size_t classSize = mClassSize[ cls ];
+
+		for( size_t i = 0; i < mPageSize / classSize; i++ ) {
+			Chunk_t * chunk = (Chunk_t*)( mPtrBase + mPageStart + page * mPageSize + i * classSize );
+
+			if( FLAG_USED == chunk->mFlags && 0 == checkFunc( chunk->mPtr, arg ) ) {
+				memset( chunk, 0, classSize );
+				chunk->mFlags = FLAG_FREE;
+			}
+		}
+	}
+}
+
+void SP_DictShmSlabAllocator :: rebuildFreeList()
+{
+	memset( mSlabHeader->mFreeList, 0, sizeof( mSlabHeader->mFreeList ) );
+	mSlabHeader->mFreeCount = 0;
+
+	for( size_t page = getRangeCount(); page > 0; page-- ) {
+		int cls = mPageClass[ page - 1 ] - 1;
+		if( cls < 0 || cls >= mClassCount ) continue;
+
+		size_t classSize = mClassSize[ cls ];
+		size_t pageOffset = mPageStart + ( page - 1 ) * mPageSize;
+
+		for( size_t i = mPageSize / classSize; i > 0; i-- ) {
+			size_t start = pageOffset + ( i - 1 ) * classSize;
+			Chunk_t * chunk = (Chunk_t*)( mPtrBase + start );
+
+			if( FLAG_USED != chunk->mFlags ) {
+				memset( chunk, 0, classSize );
+				chunk->mFlags = FLAG_FREE;
+				chunk->mNextOffset = mSlabHeader->mFreeList[ cls ];
+				mSlabHeader->mFreeList[ cls ] = start;
+				mSlabHeader->mFreeCount++;
+			}
+		}
+	}
+}
+
+void SP_DictShmSlabAllocator :: selfCheck( size_t * freeCount, size_t * usedCount )
+{
+	// 1. every record of the used pages is free or used
+	assert( mSlabHeader->mUsedPages <= mPageCount );
+
+	for( size_t page = 0; page < mPageCount; page++ ) {
+		int cls = mPageClass[ page ] - 1;
+
+		if( page >= mSlabHeader->mUsedPages ) {
+			assert( cls < 0 );
+			continue;
+		}
+
+		assert( cls >= 0 && cls < mClassCount );
+
+		size_t classSize = mClassSize[ cls ];
+
+		for( size_t i = 0; i < mPageSize / classSize; i++ ) {
+			Chunk_t * chunk = (Chunk_t*)( mPtrBase + mPageStart + page * mPageSize + i * classSize );
+
+			if( FLAG_FREE == chunk->mFlags ) {
+				(*freeCount) ++;
+			} else if( FLAG_USED == chunk->mFlags ) {
+				(*usedCount) ++;
+			} else {
+				assert( 0 );
+			}
+		}
+	}
+
+	set<size_t> freeSet;
+
+	// 2. check loop free record, and the class of the free record
+	for( int i = 0; i < mClassCount; i++ ) {
+		for( size_t iter = mSlabHeader->mFreeList[i]; iter > 0; ) {
+			int cls = -1;
+			Chunk_t * chunk = getChunk( iter + offsetof( Chunk_t, mPtr ), &cls );
+
+			assert( NULL != chunk && i == cls && FLAG_FREE == chunk->mFlags );
+
+			assert( freeSet.end() == freeSet.find( iter ) );
+			freeSet.insert( iter );
+
+			iter = chunk->mNextOffset;
+		}
+	}
+
 	// 3. all free record is in freelist
 	assert( *freeCount == freeSet.size() );
+	assert( mSlabHeader->mFreeCount == freeSet.size() );
+}
+
+//---------------------------------------------------------------------------
+
+#ifdef __linux__
+
+#define SP_HUGETLBFS_MAGIC 0x958458f6
+
+// @return 0 : not on hugetlbfs, > 0 : the huge page size
+static size_t getHugetlbfsPageSize( int fd )
+{
+	struct statfs fsStat;
+
+	if( 0 == fstatfs( fd, &fsStat ) && SP_HUGETLBFS_MAGIC == (unsigned long)fsStat.f_type ) {
+		return fsStat.f_bsize;
+	}
+
+	return 0;
 }
 
+// @return 0 : no transparent huge page in the mapping of ptr, > 0 : the huge page size
+static size_t getTransHugePageSize( void * ptr )
+{
+	size_t ret = 0;
+
+	FILE * fp = fopen( "/proc/self/smaps", "r" );
+	if( NULL == fp ) return 0;
+
+	char line[ 256 ] = { 0 };
+	int isFound = 0;
+
+	for( ; 0 == ret && NULL != fgets( line, sizeof( line ), fp ); ) {
+		unsigned long start = 0, end = 0, kbytes = 0;
+		char name[ 64 ] = { 0 };
+
+		// only the first line of a mapping is "start-end ..."
+		if( 2 == sscanf( line, "%lx-%lx", &start, &end ) ) {
+			isFound = ( start == (unsigned long)ptr );
+		} else if( isFound && 2 == sscanf( line, "%63[^:]: %lu kB", name, &kbytes ) ) {
+			if( kbytes > 0 && ( 0 == strcmp( name, "ShmemPmdMapped" )
+					|| 0 == strcmp( name, "FilePmdMapped" ) || 0 == strcmp( name, "AnonHugePages" ) ) ) {
+				ret = 2 * 1024 * 1024;
+
+				FILE * sizeFp = fopen( "/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r" );
+				if( NULL != sizeFp ) {
+					unsigned long pmdSize = 0;
+					if( 1 == fscanf( sizeFp, "%lu", &pmdSize ) && pmdSize > 0 ) ret = pmdSize;
+					fclose( sizeFp );
+				}
+			}
+		}
+	}
+
+	fclose( fp );
+
+	return ret;
+}
+
+#endif
+
 void * SP_DictShmAllocator :: getMmapPtr( const char * filePath,
 		size_t len, int * isNewFile )
+{
+	return getMmapPtr( filePath, len, isNewFile, 0, NULL );
+}
+
+void * SP_DictShmAllocator :: getMmapPtr( const char * filePath,
+		size_t len, int * isNewFile, int mmapFlags, size_t * pageSize,
+		int zeroThreads, ProgressFunc_t progressFunc, void * progressArg )
 {
 	*isNewFile = 0;
 
+	size_t hugeSize = 0, fileLen = len;
+
 	int fd = open( filePath, O_RDWR );
 	if( fd < 0 ) {
 		if( ENOENT == errno ) {
@@ -229,15 +807,29 @@ void * SP_DictShmAllocator :: getMmapPtr( const char * filePath,
 			if( fd >= 0 ) {
 				*isNewFile = 1;
 
-				char buffer[ 1024 ] = { 0 };
-				memset( buffer, 0, sizeof( buffer ) );
-				for( int i = 0; i < (int)len; i += sizeof( buffer ) ) {
-					write( fd, buffer, sizeof( buffer ) );
+#ifdef __linux__
+				hugeSize = getHugetlbfsPageSize( fd );
+#endif
+
+				int isCreated = 1;
+
+				if( hugeSize > 0 ) {
+					// hugetlbfs has no write(), the pages are zero
+					fileLen = ( len + hugeSize - 1 ) / hugeSize * hugeSize;
+					if( 0 != ftruncate( fd, fileLen ) ) {
+						printf( "ftruncate fail, errno %d, %s\n", errno, strerror( errno ) );
+						isCreated = 0;
+					}
+				} else {
+					isCreated = 0 == createFile( fd, len, zeroThreads, progressFunc, progressArg );
 				}
 
-				ftruncate( fd, len );
-
-				lseek( fd, 0, SEEK_SET );
+				// never leave a short file, the next init would reject it
+				if( ! isCreated ) {
+					close( fd );
+					unlink( filePath );
+					fd = -1;
+				}
 			} else {
 				printf( "Create %s fail, errno %d, %s\n",
 						filePath, errno, strerror( errno ) );
@@ -246,6 +838,11 @@ void * SP_DictShmAllocator :: getMmapPtr( const char * filePath,
 			printf( "Open %s fail, errno %d, %s\n",
 					filePath, errno, strerror( errno ) );
 		}
+	} else {
+#ifdef __linux__
+		hugeSize = getHugetlbfsPageSize( fd );
+#endif
+		if( hugeSize > 0 ) fileLen = ( len + hugeSize - 1 ) / hugeSize * hugeSize;
 	}
 
 	void * ret = NULL;
@@ -253,16 +850,25 @@ void * SP_DictShmAllocator :: getMmapPtr( const char * filePath,
 	if( fd >= 0 ) {
 		struct stat fileStat;
 		if( 0 == fstat( fd, &fileStat ) ) {
-			if( fileStat.st_size == (int)len ) {
-				ret = mmap( 0, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+			if( fileStat.st_size == (off_t)fileLen ) {
+				int flags = MAP_SHARED;
+
+#ifdef MAP_POPULATE
+				// transparent huge pages must be asked before the faults
+				if( ( mmapFlags & eMmapPopulate ) && ! ( mmapFlags & eMmapHugePage ) ) {
+					flags |= MAP_POPULATE;
+				}
+#endif
+
+				ret = mmap( 0, fileLen, PROT_READ | PROT_WRITE, flags, fd, 0 );
 				if( MAP_FAILED == ret ) {
 					printf( "mmap %s fail, errno %d, %s\n",
 							filePath, errno, strerror( errno ) );
 					ret = NULL;
 				}
 			} else {
-				printf( "invalid file size, real %li, except %i",
-						fileStat.st_size, len );
+				printf( "invalid file size, real %li, except %li",
+						(long)fileStat.st_size, (long)fileLen );
 			}
 		} else {
 			printf( "Stat %s fail, errno %d, %s\n",
@@ -272,14 +878,237 @@ void * SP_DictShmAllocator :: getMmapPtr( const char * filePath,
 		close( fd );
 	}
 
+	if( NULL != ret ) adviseMmapPtr( ret, fileLen, mmapFlags, hugeSize, pageSize );
+
 	return ret;
 }
 
-void SP_DictShmAllocator :: freeMmapPtr( void * ptr, size_t len )
+typedef struct tagZeroArg {
+	int mFd;
+	size_t mLen, mNextOffset, mDoneLen;
+	int mErrno;
+
+	SP_DictShmAllocator::ProgressFunc_t mProgressFunc;
+	void * mProgressArg;
+
+#ifndef WIN32
+	pthread_mutex_t mMutex;
+#endif
+} ZeroArg_t;
+
+// the threads take the chunks one by one, a small file is not split
+#ifndef WIN32
+static void * zeroFunc( void * arg )
+#else
+static unsigned long __stdcall zeroFunc( void * arg )
+#endif
+{
+	static const size_t ZERO_CHUNK = 16 * 1024 * 1024;
+
+	ZeroArg_t * zeroArg = (ZeroArg_t*)arg;
+
+	size_t bufferLen = 1024 * 1024;
+	char * buffer = (char*)calloc( 1, bufferLen );
+
+	if( NULL == buffer ) {
+#ifndef WIN32
+		pthread_mutex_lock( &( zeroArg->mMutex ) );
+#endif
+		zeroArg->mErrno = ENOMEM;
+#ifndef WIN32
+		pthread_mutex_unlock( &( zeroArg->mMutex ) );
+#endif
+	}
+
+	for( ; NULL != buffer; ) {
+		size_t begin = 0, end = 0;
+
+#ifndef WIN32
+		pthread_mutex_lock( &( zeroArg->mMutex ) );
+#endif
+		begin = zeroArg->mNextOffset;
+		end = begin + ZERO_CHUNK < zeroArg->mLen ? begin + ZERO_CHUNK : zeroArg->mLen;
+		zeroArg->mNextOffset = end;
+#ifndef WIN32
+		pthread_mutex_unlock( &( zeroArg->mMutex ) );
+#endif
+
+		if( begin >= end ) break;
+
+		int error = 0;
+
+		for( size_t offset = begin; offset < end && 0 == error; ) {
+			size_t writeLen = end - offset < bufferLen ? end - offset : bufferLen;
+#ifndef WIN32
+			ssize_t ret = pwrite( zeroArg->mFd, buffer, writeLen, offset );
+#else
+			int ret = -1;
+			if( offset == (size_t)lseek( zeroArg->mFd, offset, SEEK_SET ) ) {
+				ret = write( zeroArg->mFd, buffer, writeLen );
+			}
+#endif
+			if( ret > 0 ) {
+				offset += ret;
+			} else if( 0 == ret ) {
+				// no progress, never spin on it
+				error = EIO;
+			} else if( EINTR != errno ) {
+				error = errno;
+			}
+		}
+
+#ifndef WIN32
+		pthread_mutex_lock( &( zeroArg->mMutex ) );
+#endif
+		if( 0 != error ) zeroArg->mErrno = error;
+		zeroArg->mDoneLen += end - begin;
+		if( NULL != zeroArg->mProgressFunc ) {
+			zeroArg->mProgressFunc( zeroArg->mDoneLen, zeroArg->mLen, zeroArg->mProgressArg );
+		}
+#ifndef WIN32
+		pthread_mutex_unlock( &( zeroArg->mMutex ) );
+#endif
+
+		if( 0 != error ) break;
+	}
+
+	free( buffer );
+
+	return 0;
+}
+
+int SP_DictShmAllocator :: createFile( int fd, size_t len, int zeroThreads,
+		ProgressFunc_t progressFunc, void * progressArg )
+{
+	if( 0 != ftruncate( fd, len ) ) {
+		printf( "ftruncate fail, errno %d, %s\n", errno, strerror( errno ) );
+		return -1;
+	}
+
+	if( zeroThreads <= 0 ) {
+#ifdef __linux__
+		// a sparse file may get SIGBUS on a full disk, reserve the blocks now
+		int ret = posix_fallocate( fd, 0, len );
+		if( 0 != ret ) {
+			printf( "fallocate fail, errno %d, %s\n", ret, strerror( ret ) );
+			return -1;
+		}
+#endif
+
+		if( NULL != progressFunc ) progressFunc( len, len, progressArg );
+
+		return 0;
+	}
+
+	ZeroArg_t zeroArg;
+	memset( &zeroArg, 0, sizeof( zeroArg ) );
+	zeroArg.mFd = fd;
+	zeroArg.mLen = len;
+	zeroArg.mProgressFunc = progressFunc;
+	zeroArg.mProgressArg = progressArg;
+
+#ifndef WIN32
+	pthread_mutex_init( &( zeroArg.mMutex ), NULL );
+
+	vector< pthread_t > threadList( zeroThreads );
+	vector< int > isStarted( zeroThreads, 0 );
+
+	for( int i = 1; i < zeroThreads; i++ ) {
+		isStarted[i] = 0 == pthread_create( &threadList[i], NULL, zeroFunc, &zeroArg );
+	}
+
+	zeroFunc( &zeroArg );
+
+	for( int i = 1; i < zeroThreads; i++ ) {
+		if( isStarted[i] ) pthread_join( threadList[i], NULL );
+	}
+
+	pthread_mutex_destroy( &( zeroArg.mMutex ) );
+#else
+	// the chunks are not locked, write them in this thread
+	zeroFunc( &zeroArg );
+#endif
+
+	if( 0 != zeroArg.mErrno ) {
+		printf( "zero file fail, errno %d, %s\n", zeroArg.mErrno, strerror( zeroArg.mErrno ) );
+		return -1;
+	}
+
+	return 0;
+}
+
+void SP_DictShmAllocator :: adviseMmapPtr( void * ptr, size_t len, int mmapFlags,
+		size_t hugeSize, size_t * pageSize )
 {
-	if( 0 != munmap( ptr, len ) ) {
+	size_t realPageSize = hugeSize;
+
+#ifndef WIN32
+	if( 0 == realPageSize ) realPageSize = sysconf( _SC_PAGESIZE );
+
+#ifdef MADV_HUGEPAGE
+	if( ( mmapFlags & eMmapHugePage ) && 0 == hugeSize
+			&& 0 != madvise( ptr, len, MADV_HUGEPAGE ) ) {
+		printf( "madvise hugepage fail, errno %d, %s\n", errno, strerror( errno ) );
+	}
+#endif
+
+#ifdef MADV_RANDOM
+	if( ( mmapFlags & eMmapRandom ) && 0 != madvise( ptr, len, MADV_RANDOM ) ) {
+		printf( "madvise random fail, errno %d, %s\n", errno, strerror( errno ) );
+	}
+#endif
+
+	if( ( mmapFlags & eMmapPopulate ) && ( mmapFlags & eMmapHugePage ) ) {
+		int isPopulated = 0;
+#ifdef MADV_POPULATE_WRITE
+		isPopulated = ( 0 == madvise( ptr, len, MADV_POPULATE_WRITE ) );
+#endif
+		// a read fault of every page, the old kernels have no populate advice
+		for( size_t i = 0; ! isPopulated && i < len; i += realPageSize ) {
+			*( (volatile char*)ptr + i );
+		}
+	}
+
+	if( ( mmapFlags & eMmapLock ) && 0 != mlock( ptr, len ) ) {
+		printf( "mlock fail, errno %d, %s\n", errno, strerror( errno ) );
+	}
+
+#ifdef __linux__
+	if( ( mmapFlags & eMmapHugePage ) && 0 == hugeSize ) {
+		size_t transSize = getTransHugePageSize( ptr );
+		if( transSize > realPageSize ) realPageSize = transSize;
+	}
+#endif
+
+#else
+	realPageSize = 4096;
+#endif
+
+	if( NULL != pageSize ) *pageSize = realPageSize;
+}
+
+void SP_DictShmAllocator :: freeMmapPtr( void * ptr, size_t len, size_t pageSize )
+{
+	int ret = munmap( ptr, len );
+
+	// a hugetlbfs mapping may need whole pages
+	if( 0 != ret && EINVAL == errno && pageSize > 0 ) {
+		ret = munmap( ptr, ( len + pageSize - 1 ) / pageSize * pageSize );
+	}
+
+	if( 0 != ret ) {
 		printf( "munmap fail, errno %d, %s\n",
 				errno, strerror( errno ) );
 	}
 }
 
+void SP_DictShmAllocator :: syncMmapPtr( void * ptr, size_t len )
+{
+#ifndef WIN32
+	if( 0 != msync( ptr, len, MS_SYNC ) ) {
+		printf( "msync fail, errno %d, %s\n",
+				errno, strerror( errno ) );
+	}
+#endif
+}
+
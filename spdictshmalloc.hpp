@@ -10,19 +10,47 @@
 
 class SP_DictShmAllocator {
 public:
-	SP_DictShmAllocator( void * ptrBase, size_t len, size_t itemSize );
-	~SP_DictShmAllocator();
+	/**
+	 * @param isConcurrent : several processes call alloc and free at the same
+	 *   time without any lock. The free list is a lock-free stack, and every
+	 *   process keeps a magazine of free records after attachMagazine.
+	 */
+	SP_DictShmAllocator( void * ptrBase, size_t len, size_t itemSize, int isConcurrent = 0 );
+	virtual ~SP_DictShmAllocator();
 
-	// @return 0 : out of memory, > 0 : the buffer offset
-	size_t alloc();
+	enum { MAX_MAGAZINE = 64 };
 
-	void free( size_t offset );
+	/**
+	 * isConcurrent : alloc and free go through the magazine of slot, it is
+	 * refilled from and drained to the free list in batches. A slot has one
+	 * owner at a time, without a slot the process uses the free list only.
+	 */
+	void attachMagazine( int slot );
+
+	// give the records of the magazine back to the free list
+	void detachMagazine();
+
+	int isConcurrent() const;
+
+	/**
+	 * @param size : bytes of the buffer, 0 : itemSize
+	 * @return 0 : out of memory, > 0 : the buffer offset
+	 */
+	virtual size_t alloc( size_t size = 0 );
+
+	virtual void free( size_t offset );
+
+	// @return bytes of the buffer
+	virtual size_t getItemSize( size_t offset ) const;
+
+	// @return bytes of the smallest buffer alloc( size ) returns, 0 : too large
+	virtual size_t getFitSize( size_t size ) const;
 
 	// @return 1 : valid offset, 0 : invalid offset
-	int isValid( size_t offset ) const;
+	virtual int isValid( size_t offset ) const;
 
 	// @return 1 : has been used, 0 : free
-	int isUsed( size_t offset ) const;
+	virtual int isUsed( size_t offset ) const;
 
 	// convert offset to pointer
 	void * getPtr( size_t offset ) const;
@@ -30,39 +58,202 @@ public:
 	// convert pointer to offset
 	size_t getOffset( void * ptr ) const;
 
-	void reset();
+	virtual void reset();
+
+	// O(1), the records never used are free
+	virtual int getFreeCount() const;
 
-	int getFreeCount() const;
+	// count of the records, used or free
+	virtual size_t getMaxCount() const;
 
 	// @return 1 : check OK, 0 : check Fail
 	typedef int ( * CheckFunc_t ) ( void * ptr, void * arg );
 
 	void check( CheckFunc_t checkFunc, void * arg );
 
-	void selfCheck( size_t * freeCount, size_t * usedCount );
+	// count of the units of checkRange
+	virtual size_t getRangeCount() const;
+
+	/**
+	 * check the used records of the units [ begin, end ), free the failed ones,
+	 * different ranges can be checked by different threads at the same time
+	 */
+	virtual void checkRange( CheckFunc_t checkFunc, void * arg, size_t begin, size_t end );
+
+	// link all the free records, after checkRange, the magazines are emptied
+	virtual void rebuildFreeList();
+
+	virtual void selfCheck( size_t * freeCount, size_t * usedCount );
 
 	static void * getMmapPtr( const char * filePath, size_t len, int * isNewFile );
 
-	static void freeMmapPtr( void * ptr, size_t len );
+	/**
+	 * eMmapPopulate : fault in all the pages at mmap
+	 * eMmapHugePage : ask for transparent huge pages, a file on hugetlbfs
+	 *   always gets huge pages, and its length is rounded up to them
+	 * eMmapRandom : no read-ahead for the random access of the buckets
+	 * eMmapLock : lock the pages in memory, a failure only prints a warning
+	 */
+	enum { eMmapPopulate = 0x01, eMmapHugePage = 0x02, eMmapRandom = 0x04, eMmapLock = 0x08 };
 
-private:
+	// @param doneLen : bytes of the new file created so far
+	typedef void ( * ProgressFunc_t ) ( size_t doneLen, size_t totalLen, void * arg );
+
+	/**
+	 * A new file is sized by ftruncate, and its blocks are reserved by
+	 * fallocate, so it reads as zero without any write.
+	 *
+	 * @param pageSize : gets the page size of the mapping, a transparent huge
+	 *   page is only seen after the pages are faulted in by eMmapPopulate
+	 * @param zeroThreads : > 0, these threads also write zero to a new file in
+	 *   large chunks, for the file systems without fallocate
+	 * @param progressFunc : called by one thread at a time when a chunk is done
+	 */
+	static void * getMmapPtr( const char * filePath, size_t len, int * isNewFile,
+			int mmapFlags, size_t * pageSize, int zeroThreads = 0,
+			ProgressFunc_t progressFunc = 0, void * progressArg = 0 );
+
+	// @param pageSize : the page size got from getMmapPtr, a hugetlbfs mapping needs it
+	static void freeMmapPtr( void * ptr, size_t len, size_t pageSize = 0 );
+
+	// write the dirty pages back to the file
+	static void syncMmapPtr( void * ptr, size_t len );
+
+protected:
+
+	// madvise and mlock the mapping, @param hugeSize : the hugetlbfs page size, 0 : none
+	static void adviseMmapPtr( void * ptr, size_t len, int mmapFlags,
+			size_t hugeSize, size_t * pageSize );
+
+	// @return 0 : the new file has len bytes, -1 : ftruncate, fallocate or write fail
+	static int createFile( int fd, size_t len, int zeroThreads,
+			ProgressFunc_t progressFunc, void * progressArg );
 
 	typedef struct tagChunk {
 		char mFlags;
 		union {
 			int mNext;
+			size_t mNextOffset;
 			char mPtr[1];
 		};
 	} Chunk_t;
 
+	// in the first records of the region, the magazines follow it if isConcurrent
+	typedef struct tagHead {
+		int mNext;  // index of the first free record, 0 : empty
+		size_t mFreeCount;  // the free lists, the magazines and the records from mHighWater
+		size_t mHighWater;  // the records from it are never used
+
+		// isConcurrent : ( tag << 32 ) | index of the first free record,
+		// the tag changes on every pop and push, a stale top never matches
+		volatile unsigned long long mFreeTop;
+	} Head_t;
+
+	enum { MAGAZINE_SIZE = 32, MAGAZINE_BATCH = 16 };
+
+	typedef struct tagMagazine {
+		int mCount;
+		int mIndex[ MAGAZINE_SIZE ];
+	} Magazine_t;
+
+	Chunk_t * getRecord( size_t index ) const;
+
+	// @return 0 : the free list is empty, > 0 : index of the record
+	int popFree();
+
+	// the record is marked free
+	void pushFree( int index );
+
+	// @return 0 : no record above the high water, > 0 : index of the record
+	int bumpHighWater();
+
+	void addFreeCount( long delta );
+
+	// take up to MAGAZINE_BATCH records from the free list
+	void refillMagazine();
+
+	void drainMagazine( Magazine_t * magazine, int count );
+
 	char * mPtrBase;
 	size_t mLen, mItemSize;
 	size_t mRecordSize;
 
-	Chunk_t * mFirst;
+	Head_t * mHead;
+	size_t mReserved;  // count of the records of the head
+
+	int mIsConcurrent;
+	Magazine_t * mMagazineList;
+	Magazine_t * mMagazine;  // the magazine of this process, NULL : none
 
 	enum { FLAG_FREE = 0x01, FLAG_USED = 0x02 };
 };
 
+/**
+ * The region is cut into pages, every page holds the records of one size
+ * class, the classes grow by 1.25 from minItemSize to maxItemSize. A class
+ * takes a new page when it has no free record, the page is never given back.
+ * When no page is left, a larger class lends its free records.
+ * The free lists and the class of every page live in the region.
+ */
+class SP_DictShmSlabAllocator : public SP_DictShmAllocator {
+public:
+	SP_DictShmSlabAllocator( void * ptrBase, size_t len, size_t minItemSize, size_t maxItemSize );
+	virtual ~SP_DictShmSlabAllocator();
+
+	virtual size_t alloc( size_t size = 0 );
+
+	virtual void free( size_t offset );
+
+	virtual size_t getItemSize( size_t offset ) const;
+
+	virtual size_t getFitSize( size_t size ) const;
+
+	virtual int isValid( size_t offset ) const;
+
+	virtual int isUsed( size_t offset ) const;
+
+	virtual void reset();
+
+	// the records of the pages not used yet are not counted
+	virtual int getFreeCount() const;
+
+	virtual size_t getMaxCount() const;
+
+	// one unit is one page
+	virtual size_t getRangeCount() const;
+
+	virtual void checkRange( CheckFunc_t checkFunc, void * arg, size_t begin, size_t end );
+
+	virtual void rebuildFreeList();
+
+	virtual void selfCheck( size_t * freeCount, size_t * usedCount );
+
+private:
+	enum { MAX_CLASS = 64 };
+
+	typedef struct tagSlabHeader {
+		size_t mUsedPages;
+		size_t mFreeCount;  // records in the free lists
+		size_t mFreeList[ MAX_CLASS ];  // offset of the first free record, 0 : empty
+	} SlabHeader_t;
+
+	// @return -1 : too large, >= 0 : the smallest class for size
+	int getClass( size_t size ) const;
+
+	// @return NULL : not the buffer of a record
+	Chunk_t * getChunk( size_t offset, int * cls ) const;
+
+	// @return 0 : no more page, 1 : the class gets a page
+	int addPage( int cls );
+
+	SlabHeader_t * mSlabHeader;
+	unsigned char * mPageClass;  // 1 + class of every page, 0 : not used yet
+
+	size_t mPageSize, mPageStart, mPageCount;
+
+	size_t mClassSize[ MAX_CLASS ];  // record size of every class
+	int mClassCount;
+};
+
 #endif
 
@@ -4,20 +4,38 @@
  */
 
 #include <string.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <time.h>
 #include <stdio.h>
-
-#pragma warning(disable : 4786)
+#include <stddef.h>
+#include <errno.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#else
+#include <windows.h>
+#include <process.h>
+#define getpid _getpid
+#endif
+
+#pragma warning(disable : 4786)
 
-#include <map>
 #include <set>
+#include <algorithm>
 
 using namespace std;
 
 #include "spdictshmcache.hpp"
 #include "spdictshmalloc.hpp"
 #include "spdictshmhashmap.hpp"
+#include "spdictshmlock.hpp"
+
+// never a 32-bit checksum where long has 64 bits, elsewhere a record
+// whose checksum is all ones is dropped by recover
+static const unsigned long int CHECKSUM_UNSEALED = ~0UL;
 
 class SP_DictShmHashMapHandlerAdapter : public SP_DictShmHashMapHandler {
 public:
@@ -89,34 +107,60 @@ void SP_DictShmCacheStatistics :: markMiss()
 //---------------------------------------------------------------------------
 
 SP_DictShmCache :: SP_DictShmCache( SP_DictShmCacheHandler * handler,
-		size_t maxBucket, size_t itemSize )
+		size_t maxBucket, size_t itemSize, int flags )
 {
 	mAllocator = NULL;
+	mEvictList = NULL;
+	mHashMap = NULL;
 	mHeader = NULL;
+	mAccessList = NULL;
 
 	mHandler = handler;
 	mMaxBucket = maxBucket;
 	mItemSize = itemSize;
 	mRecordSize = sizeof( SP_DictShmHashMapEntry_t ) + itemSize;
+	mFlags = flags;
+
+	// the object is used by one thread, every concurrent get reuses the buffer
+	mReadBuffer = isConcurrent() ? (char*)malloc( itemSize > 0 ? itemSize : 1 ) : NULL;
+
+	setMinItemSize( 64 );
 
 	mEvictAlgo = eFIFO;
+
+	mRecoverThreads = 4;
+	mIsRecovered = 0;
+	mMmapFlags = 0;
+	mZeroThreads = 0;
+	mCheckSumType = eCheckSumFNV;
+	mIsDeferSeal = 0;
+	mPageSize = 0;
+	mAttachSlot = -1;
+	mTakeOverCount = 0;
 }
 
 SP_DictShmCache :: ~SP_DictShmCache()
 {
+	if( NULL != mHashMap ) detach();
+
 	if( NULL != mAllocator ) delete mAllocator;
 	mAllocator = NULL;
 
 	if( NULL != mEvictList ) delete mEvictList;
 	mEvictList = NULL;
 
+	if( NULL != mHashMap ) delete mHashMap;
+	mHashMap = NULL;
+
 	if( NULL != mHandler ) delete mHandler;
 	mHandler = NULL;
 
+	if( NULL != mReadBuffer ) free( mReadBuffer );
+	mReadBuffer = NULL;
+
 	if( NULL != mHeader ) {
-		size_t headerLen = sizeof( Header_t ) + sizeof( size_t ) * mMaxBucket;
-		size_t totalLen = mHeader->mLen + headerLen;
-		SP_DictShmAllocator::freeMmapPtr( (void*) mHeader, totalLen );
+		size_t totalLen = mHeader->mLen + getHeaderLen( mHeader->mLen );
+		SP_DictShmAllocator::freeMmapPtr( (void*) mHeader, totalLen, mPageSize );
 
 		mHeader = NULL;
 	}
@@ -127,312 +171,1457 @@ void SP_DictShmCache :: setEvictAlgo( int evictAlgo )
 	mEvictAlgo = evictAlgo;
 }
 
-int SP_DictShmCache :: init( const char * filePath, size_t len )
+void SP_DictShmCache :: setRecoverThreads( int recoverThreads )
 {
-	int retCode = -1;
+	mRecoverThreads = recoverThreads;
+}
 
-	int isNewFile = 0;
+void SP_DictShmCache :: setMinItemSize( size_t minItemSize )
+{
+	// the fixed records are all of mItemSize
+	mMinItemSize = ( mFlags & eSlabClass ) && minItemSize < mItemSize ? minItemSize : mItemSize;
+	mMinRecordSize = sizeof( SP_DictShmHashMapEntry_t ) + mMinItemSize;
+}
 
-	size_t headerLen = sizeof( Header_t ) + sizeof( size_t ) * mMaxBucket;
-	void * ptrHeader = SP_DictShmAllocator::getMmapPtr(
-			filePath, len + headerLen, &isNewFile );
+void SP_DictShmCache :: setMmapFlags( int mmapFlags )
+{
+	mMmapFlags = mmapFlags;
+}
 
-	if( NULL != ptrHeader ) {
-		//printf( "%s file %s", isNewFile ? "create" : "reuse", filePath );
+void SP_DictShmCache :: setZeroThreads( int zeroThreads )
+{
+	mZeroThreads = zeroThreads;
+}
 
-		mHeader = (Header_t*)ptrHeader;
-		mAllocator = new SP_DictShmAllocator( (char*)ptrHeader + headerLen, len, mRecordSize );
+size_t SP_DictShmCache :: getPageSize()
+{
+	return mPageSize;
+}
 
-		int isHeaderValid = 1;
+int SP_DictShmCache :: isRecovered()
+{
+	return mIsRecovered;
+}
 
-		if( isNewFile ) {
-			retCode = 0;
+void SP_DictShmCache :: setCheckSumType( int checkSumType )
+{
+	mCheckSumType = checkSumType;
+}
 
-			mHeader->mType0 = 'S';
-			mHeader->mType1 = 'P';
-			mHeader->mLen = len;
-			mHeader->mMaxBucket = mMaxBucket;
-			mHeader->mItemSize = mItemSize;
-			mHeader->mEvictHeader = 0;
-			mHeader->mEvictTail = 0;
-			memset( mHeader->mBucket, 0, sizeof( size_t ) * mMaxBucket );
+int SP_DictShmCache :: getCheckSumType()
+{
+	return mCheckSumType;
+}
 
-			mAllocator->reset();
-		} else {
-			retCode = 1;
+void SP_DictShmCache :: setDeferSeal( int isDeferSeal )
+{
+	mIsDeferSeal = isDeferSeal;
+}
 
-			if( mHeader->mType0 != 'S' || mHeader->mType1 != 'P' ) {
-				printf( "init %s fail, invalid type, %c%c",
-						filePath, mHeader->mType0, mHeader->mType1 );
-				isHeaderValid = 0;
-				retCode = -1;
-			}
+/**
+ * @return the start time of the process, linux mixes the boot id in it,
+ *   a reused pid gets another stamp, 0 : unknown
+ */
+static unsigned long long getProcessStamp( int pid )
+{
+	unsigned long long stamp = 0;
 
-			if( mHeader->mLen != len || mHeader->mMaxBucket != mMaxBucket
-					|| mHeader->mItemSize != mItemSize ) {
-				printf( "init %s fail, invalid metadata, "
-						"len %d %d, max.bucket %d %d, item.size %d %d",
-						filePath, mHeader->mLen, len, mHeader->mMaxBucket, mMaxBucket,
-						mHeader->mItemSize, mItemSize );
-				isHeaderValid = 0;
-				retCode = -1;
-			}
-		}
+#ifdef __linux__
+	char path[ 64 ], text[ 1024 ];
+	snprintf( path, sizeof( path ), "/proc/%d/stat", pid );
 
-		if( isHeaderValid ) {
-			CheckArg checkArg;
-			checkArg.first = mItemSize;
+	FILE * fp = fopen( path, "r" );
+	if( NULL == fp ) return 0;
 
-			// check allocator
-			mAllocator->check( checkFunc, &checkArg );
+	size_t len = fread( text, 1, sizeof( text ) - 1, fp );
+	text[ len ] = '\0';
+	fclose( fp );
 
-			// rebuild hashmap and evictlist
-			mHeader->mEvictHeader = 0;
-			mHeader->mEvictTail = 0;
-			memset( mHeader->mBucket, 0, sizeof( size_t ) * mMaxBucket );
+	// the name in the parentheses may hold spaces,
+	// starttime is the 20th field after the name
+	char * pos = strrchr( text, ')' );
+	for( int i = 0; NULL != pos && i < 20; i++ ) pos = strchr( pos + 1, ' ' );
+	if( NULL == pos ) return 0;
 
-			mEvictList = new SP_DictShmHashMapEntryList( &( mHeader->mEvictHeader ),
-					&( mHeader->mEvictTail ), mAllocator );
-			mHashMap = new SP_DictShmHashMap( mHeader->mBucket, mMaxBucket,
-					mAllocator, new SP_DictShmHashMapHandlerAdapter( mHandler ) );
-
-			for( EntryMap::iterator it = checkArg.second.begin();
-					checkArg.second.end() != it; it++ ) {
-				mHashMap->put( it->second );
-				mEvictList->append( it->second );
-			}
-		}
+	unsigned long long startTime = strtoull( pos + 1, NULL, 10 );
 
-		//printf( "allocator.count %d", mAllocator->getFreeCount() );
+	// the start time counts from the boot
+	char bootId[ 64 ] = { 0 };
+	fp = fopen( "/proc/sys/kernel/random/boot_id", "r" );
+	if( NULL != fp ) {
+		if( NULL == fgets( bootId, sizeof( bootId ), fp ) ) bootId[0] = '\0';
+		fclose( fp );
 	}
 
-	return retCode;
+	stamp = SP_DictShmCache::fastHash( bootId, strlen( bootId ), startTime );
+	if( 0 == stamp ) stamp = 1;
+#elif defined( WIN32 )
+	HANDLE process = OpenProcess( PROCESS_QUERY_INFORMATION, FALSE, pid );
+	if( NULL == process ) return 0;
+
+	FILETIME createTime, exitTime, kernelTime, userTime;
+	if( GetProcessTimes( process, &createTime, &exitTime, &kernelTime, &userTime ) ) {
+		stamp = ( (unsigned long long)createTime.dwHighDateTime << 32 ) | createTime.dwLowDateTime;
+	}
+
+	CloseHandle( process );
+#endif
+
+	return stamp;
 }
 
-int SP_DictShmCache :: checkFunc( void * ptr, void * arg )
+// @param stamp : getProcessStamp of the pid when it attached, 0 : unknown
+static int isProcessAlive( int pid, unsigned long long stamp )
 {
-	CheckArg * checkArg = ( CheckArg * ) arg;
+#ifndef WIN32
+	if( 0 != kill( pid, 0 ) && EPERM != errno ) return 0;
+#else
+	HANDLE process = OpenProcess( PROCESS_QUERY_INFORMATION, FALSE, pid );
+	if( NULL == process ) return ERROR_ACCESS_DENIED == GetLastError() ? 1 : 0;
 
-	SP_DictShmHashMapEntry_t * entry = (SP_DictShmHashMapEntry_t*)ptr;
+	DWORD exitCode = 0;
+	int isRunning = GetExitCodeProcess( process, &exitCode ) && STILL_ACTIVE == exitCode;
+	CloseHandle( process );
 
-	int ret = 0;
+	if( ! isRunning ) return 0;
+#endif
 
-	unsigned long int checksum = fnvHash( entry->mPtr, checkArg->first );
+	// the pid is reused by another process, a hidden process keeps its pid alive
+	unsigned long long current = 0 != stamp ? getProcessStamp( pid ) : 0;
 
-	if( entry->mCheckSum == checksum ) {
-		ret = 1;
+	return ( 0 == current || current == stamp ) ? 1 : 0;
+}
 
-		checkArg->second.insert( make_pair( entry->mExpTime, entry ) );
-	} else {
-		printf( "checksum fail, %ld, %ld\n", entry->mCheckSum, checksum );
+int SP_DictShmCache :: isOwnerAlive( unsigned int owner, void * arg )
+{
+	SP_DictShmCache * cache = (SP_DictShmCache*)arg;
+
+	// the owner is attached, except in attach itself
+	unsigned long long stamp = 0;
+	for( int i = 0; i < MAX_ATTACH && 0 == stamp; i++ ) {
+		if( cache->mHeader->mAttachPid[i] == (int)owner ) stamp = cache->mHeader->mAttachStamp[i];
 	}
 
-	return ret;
+	return isProcessAlive( (int)owner, stamp );
 }
 
-void SP_DictShmCache :: selfCheck()
+void SP_DictShmCache :: onReadStall( size_t bucket, void * arg )
 {
-	size_t freeCount = 0, usedCount = 0;
-
-	// 1. check allocator
-	mAllocator->selfCheck( &freeCount, &usedCount );
-
-	set<size_t> entrySet;
+	SP_DictShmCache * cache = (SP_DictShmCache*)arg;
 
-	// 2. check hashmap
-	for( int i = 0; i < (int)mMaxBucket; i++ ) {
-		size_t iter = mHeader->mBucket[i];
-		for( ; iter > 0; ) {
-			// 2.1 check loop entry
-			set<size_t>::iterator it = entrySet.find( iter );
-			assert( entrySet.end() == it );
-			entrySet.insert( iter );
+	// a live writer ends its write first, a dead one is taken over
+	cache->lockBucket( bucket );
+	cache->unlockBucket( bucket );
+}
 
-			// 2.2 entry must been used
-			assert( mAllocator->isUsed( iter ) );
+int SP_DictShmCache :: freeDeadSlots()
+{
+	int deadCount = 0;
 
-			SP_DictShmHashMapEntry_t * entry = (SP_DictShmHashMapEntry_t*)mAllocator->getPtr( iter );
+	for( int i = 0; i < MAX_ATTACH; i++ ) {
+		int attachPid = mHeader->mAttachPid[i];
 
-			iter = entry->mKeyNext;
+		if( 0 != attachPid && ! isProcessAlive( attachPid, mHeader->mAttachStamp[i] ) ) {
+			// it crashed, or exited without the destructor
+			mHeader->mAttachPid[i] = 0;
+			deadCount++;
 		}
 	}
 
-	// 2.3. all used record must been in hashmap
-	assert( usedCount == entrySet.size() );
+	return deadCount;
+}
 
-	entrySet.clear();
+void SP_DictShmCache :: checkTakeOver()
+{
+	if( ! isConcurrent() || mTakeOverCount == SP_DictShmLock::getTakeOverCount() ) return;
 
-	// 3. check evictlist
-	size_t evictPrev = 0;
-	for( SP_DictShmHashMapEntry_t * entry = mEvictList->getHead(); NULL != entry; ) {
-		size_t iter = mAllocator->getOffset( entry );
+	// the other locks of the dead owner are taken over by lockAll
+	lockAll( 1 );
 
-		// 3.1 check loop entry
-		set<size_t>::iterator it = entrySet.find( iter );
-		assert( entrySet.end() == it );
-		entrySet.insert( iter );
+	freeDeadSlots();
+	recover();
 
-		// 3.2 entry must been in hashmap
-		assert( entry == mHashMap->get( entry->mPtr ) );
+	mTakeOverCount = SP_DictShmLock::getTakeOverCount();
 
-		// 3.3 check prev point
-		assert( evictPrev == entry->mEvictPrev );
-		evictPrev = iter;
+	unlockAll();
+}
 
-		if( entry->mEvictNext > 0 ) {
-			entry = (SP_DictShmHashMapEntry_t*)mAllocator->getPtr( entry->mEvictNext );
-		} else {
-			break;
+int SP_DictShmCache :: attach()
+{
+	int pid = getpid(), liveCount = 0;
+
+	lockGlobal();
+
+	int deadCount = freeDeadSlots();
+
+	for( int i = 0; i < MAX_ATTACH; i++ ) {
+		if( 0 != mHeader->mAttachPid[i] ) {
+			liveCount++;
+		} else if( mAttachSlot < 0 ) {
+			mAttachSlot = i;
+			mHeader->mAttachPid[i] = pid;
+			mHeader->mAttachStamp[i] = getProcessStamp( pid );
 		}
 	}
 
-	// 3.5 all used count must been in evictlist
-	assert( usedCount == entrySet.size() );
+	// no dead slot is freed, the file is still consistent
+	if( mAttachSlot < 0 ) {
+		unlockGlobal();
+		return -1;
+	}
+
+	// the live processes keep the buckets consistent
+	int needRecover = deadCount > 0 || ( 0 == liveCount && ! mHeader->mIsClean );
+
+	mHeader->mIsClean = 0;
+
+	unlockGlobal();
+
+	return needRecover;
 }
 
-int SP_DictShmCache :: get( const void * keyItem, void * resultHolder )
+void SP_DictShmCache :: detach()
 {
-	SP_DictShmHashMapEntry_t * entry = mHashMap->get( keyItem );
+	// a forked child may destroy the cache of its parent
+	if( mAttachSlot < 0 || mHeader->mAttachPid[ mAttachSlot ] != getpid() ) return;
 
-	if( NULL != entry ) {
-		if( entry->mExpTime > 0 && entry->mExpTime < time( NULL ) ) {
-			mHandler->onDestroy( entry->mPtr );
+	lockGlobal();
 
-			entry = mHashMap->remove( keyItem );
-			mEvictList->remove( entry );
-			mAllocator->free( mAllocator->getOffset( entry ) );
+	// a recover of another process rebuilds the free list under the global lock
+	mAllocator->detachMagazine();
 
-			entry = NULL;
-		} else {
-			mHandler->onHit( entry->mPtr, resultHolder );
+	mHeader->mAttachPid[ mAttachSlot ] = 0;
+	mAttachSlot = -1;
 
-			if( eLRU == mEvictAlgo ) {
-				mEvictList->update( entry );
-			}
-		}
+	int liveCount = 0;
+	for( int i = 0; i < MAX_ATTACH; i++ ) {
+		if( 0 != mHeader->mAttachPid[i] ) liveCount++;
 	}
 
-	if( NULL != entry ) {
-		mStat.markHit();
-	} else {
-		mStat.markMiss();
+	if( 0 == liveCount ) {
+		// the records reach the file before the flag
+		SP_DictShmAllocator::syncMmapPtr( (void*)mHeader,
+				mHeader->mLen + getHeaderLen( mHeader->mLen ) );
+
+		mHeader->mIsClean = 1;
 	}
 
-	return NULL == entry ? 0 : 1;
+	unlockGlobal();
 }
 
-int SP_DictShmCache :: put( void * item, time_t expTime )
+size_t SP_DictShmCache :: getMaxOverflow( size_t len )
 {
-	int retCode = -1;
+	// mMinRecordSize is not more than the record size of the allocator
+	return ( mFlags & eTagBucket ) ? ( len / mMinRecordSize ) / 8 + 1 : 0;
+}
 
-	SP_DictShmHashMapEntry_t * entry = mHashMap->get( item );
+size_t SP_DictShmCache :: getBucketCapacity( size_t len )
+{
+	size_t maxLoad = ( mFlags & eTagBucket ) ? (size_t)SP_DictShmTagHashMap::MAX_LOAD
+			: (size_t)SP_DictShmChainHashMap::MAX_LOAD;
 
-	if( NULL != entry ) {
-		retCode = 1;
+	// the table only doubles, stop at the first size which holds all the records
+	size_t capacity = mMaxBucket;
+	for( ; capacity * maxLoad < len / mMinRecordSize; ) capacity *= 2;
 
-		memcpy( entry->mPtr, item, mItemSize );
-		entry->mCheckSum = fnvHash( entry->mPtr, mItemSize );
+	return capacity;
+}
 
-		entry->mExpTime = expTime;
-		mEvictList->update( entry );
+size_t SP_DictShmCache :: getBucketLen( size_t len )
+{
+	size_t capacity = getBucketCapacity( len );
+
+	if( mFlags & eTagBucket ) {
+		return SP_DictShmTagHashMap::getBucketLen( capacity, getMaxOverflow( len ) );
 	} else {
-		size_t offset = mAllocator->alloc();
-		if( 0 == offset ) {
-			SP_DictShmHashMapEntry_t * iter = mEvictList->getHead();
+		return ( sizeof( size_t ) + sizeof( unsigned int ) ) * capacity;
+	}
+}
 
-			if( NULL != iter && iter->mExpTime > 0 && iter->mExpTime < time( NULL ) ) {
-				mHandler->onDestroy( iter->mPtr );
+size_t SP_DictShmCache :: getAccessLen( size_t len )
+{
+	// two records are at least mMinRecordSize bytes away
+	return len / mMinRecordSize + 1;
+}
 
-				mHashMap->remove( iter->mPtr );
-				mEvictList->remove( iter );
-				mAllocator->free( mAllocator->getOffset( iter ) );
-			}
+size_t SP_DictShmCache :: getHeaderLen( size_t len )
+{
+	size_t headerLen = ( sizeof( Header_t ) + 63 ) & ~( (size_t)63 );
 
-			offset = mAllocator->alloc();
-		}
+	headerLen += getBucketLen( len ) + getAccessLen( len );
 
-		if( offset > 0 ) {
-			retCode = 0;
+	// keep the buckets and the records on cache lines
+	return ( headerLen + 63 ) & ~( (size_t)63 );
+}
 
-			entry = (SP_DictShmHashMapEntry_t*)mAllocator->getPtr( offset );
+unsigned char * SP_DictShmCache :: getAccess( size_t offset )
+{
+	return mAccessList + offset / mMinRecordSize;
+}
 
-			memcpy( entry->mPtr, item, mItemSize );
-			entry->mCheckSum = fnvHash( entry->mPtr, mItemSize );
-			mHashMap->put( entry );
+char * SP_DictShmCache :: getBucketList()
+{
+	return (char*)mHeader + ( ( sizeof( Header_t ) + 63 ) & ~( (size_t)63 ) );
+}
 
-			entry->mExpTime = expTime;
-			mEvictList->append( entry );
-		}
+SP_DictShmHashMap * SP_DictShmCache :: newHashMap()
+{
+	SP_DictShmHashMapHandler * handler = new SP_DictShmHashMapHandlerAdapter( mHandler );
+
+	size_t capacity = getBucketCapacity( mHeader->mLen );
+
+	SP_DictShmHashMap * hashMap = NULL;
+
+	if( mFlags & eTagBucket ) {
+		hashMap = new SP_DictShmTagHashMap( (SP_DictShmHashBucket_t*)getBucketList(),
+				mMaxBucket, capacity, &( mHeader->mActiveBucket ),
+				mHeader->mMaxOverflow, &( mHeader->mOverflowFree ),
+				&( mHeader->mOverflowLock ), mAllocator, handler,
+				&( mHeader->mCount ), isConcurrent() );
+	} else {
+		size_t * bucketList = (size_t*)getBucketList();
+
+		hashMap = new SP_DictShmChainHashMap( bucketList, (unsigned int*)( bucketList + capacity ),
+				mMaxBucket, capacity, &( mHeader->mActiveBucket ),
+				mAllocator, handler, &( mHeader->mCount ), isConcurrent() );
 	}
 
-	return retCode;
+	if( isConcurrent() ) hashMap->setDeadCheck( isOwnerAlive, onReadStall, this );
+
+	return hashMap;
 }
 
-int SP_DictShmCache :: erase( const void * keyItem )
+int SP_DictShmCache :: isConcurrent()
 {
-	int ret = 0;
-
-	SP_DictShmHashMapEntry_t * entry = mHashMap->remove( keyItem );
+	return ( mFlags & eConcurrent ) ? 1 : 0;
+}
 
-	if( NULL != entry ) {
-		ret = 1;
+void SP_DictShmCache :: lockBucket( size_t bucket )
+{
+	if( ! isConcurrent() ) return;
 
-		mHandler->onDestroy( entry->mPtr );
+	size_t stripe = bucket % LOCK_STRIPES;
 
-		mEvictList->remove( entry );
-		mAllocator->free( mAllocator->getOffset( entry ) );
+	// end the writes of the dead owner before anyone else gets the stripe
+	if( SP_DictShmLock::lock( mHeader->mStripeLock + stripe, isOwnerAlive, this ) ) {
+		mHashMap->repairSeq( stripe, LOCK_STRIPES );
 	}
-
-	return ret;
 }
 
-const SP_DictShmCacheStatistics * SP_DictShmCache :: getStatistics()
+int SP_DictShmCache :: tryLockBucket( size_t bucket )
 {
-	SP_DictShmCacheStatistics * ret = new SP_DictShmCacheStatistics( mStat );
-	ret->setSize( mHashMap->getCount() );
+	if( ! isConcurrent() ) return 1;
 
-	return ret;
+	return SP_DictShmLock::tryLock( mHeader->mStripeLock + bucket % LOCK_STRIPES );
 }
 
-void SP_DictShmCache :: dumpHash()
+void SP_DictShmCache :: unlockBucket( size_t bucket )
+{
+	if( isConcurrent() ) SP_DictShmLock::unlock( mHeader->mStripeLock + bucket % LOCK_STRIPES );
+}
+
+size_t SP_DictShmCache :: lockHash( unsigned int hash )
 {
-	for( int i = 0; i < (int)mMaxBucket; i++ ) {
-		size_t iter = mHeader->mBucket[i];
-		for( ; iter > 0; ) {
-			SP_DictShmHashMapEntry_t * entry = (SP_DictShmHashMapEntry_t*)mAllocator->getPtr( iter );
+	for( ; ; ) {
+		size_t bucket = mHashMap->getBucket( hash );
+
+		lockBucket( bucket );
+
+		// a split needs the lock of the bucket, so the bucket is stable now
+		if( ! isConcurrent() || bucket == mHashMap->getBucket( hash ) ) return bucket;
 
-			mHandler->onDumpHash( i, entry->mPtr );
+		unlockBucket( bucket );
+	}
+}
 
-			iter = entry->mKeyNext;
+void SP_DictShmCache :: grow( int budget )
+{
+	for( ; budget > 0 && mHashMap->needSplit(); budget-- ) {
+		size_t from = 0, to = 0;
+		if( ! mHashMap->getSplit( &from, &to ) ) break;
+
+		// lock the two stripes in order, lockAll takes them in the same order
+		size_t first = from % LOCK_STRIPES, second = to % LOCK_STRIPES;
+		if( first > second ) {
+			size_t tmp = first;
+			first = second;
+			second = tmp;
 		}
+
+		lockBucket( first );
+		if( first != second ) lockBucket( second );
+
+		// another process may have split it
+		size_t currFrom = 0, currTo = 0;
+		if( mHashMap->getSplit( &currFrom, &currTo ) && currTo == to ) mHashMap->split();
+
+		if( first != second ) unlockBucket( second );
+		unlockBucket( first );
 	}
 }
 
-void SP_DictShmCache :: dumpEvict()
+void SP_DictShmCache :: lockGlobal()
 {
-	for( SP_DictShmHashMapEntry_t * iter = mEvictList->getHead(); NULL != iter; ) {
-		mHandler->onDumpEvict( iter->mExpTime, iter->mPtr );
+	if( ! isConcurrent() ) return;
 
-		if( iter->mEvictNext > 0 ) {
-			iter = (SP_DictShmHashMapEntry_t*)mAllocator->getPtr( iter->mEvictNext );
-		} else {
-			break;
-		}
+	// the dead owner may have left the evict list half linked
+	if( SP_DictShmLock::lock( &( mHeader->mLock ), isOwnerAlive, this ) ) {
+		mEvictList->repair( mAllocator->getMaxCount() );
 	}
 }
 
-unsigned int SP_DictShmCache :: fnvHash( const char * key, size_t len )
+void SP_DictShmCache :: unlockGlobal()
 {
-	static const unsigned int FNV_32_INIT = 2166136261UL;
-	static const unsigned int FNV_32_PRIME = 16777619;
+	if( isConcurrent() ) SP_DictShmLock::unlock( &( mHeader->mLock ) );
+}
 
-	unsigned int hash = FNV_32_INIT;
+void SP_DictShmCache :: lockAll( int isRepair )
+{
+	if( ! isConcurrent() ) return;
 
-	for( unsigned int x = 0; x < len; x++ ) {
-		hash *= FNV_32_PRIME;
-		hash ^= key[x];
+	for( int i = 0; i < LOCK_STRIPES; i++ ) {
+		if( SP_DictShmLock::lock( mHeader->mStripeLock + i, isOwnerAlive, this ) ) isRepair = 1;
 	}
 
-	return hash;
+	if( SP_DictShmLock::lock( &( mHeader->mLock ), isOwnerAlive, this ) ) {
+		mEvictList->repair( mAllocator->getMaxCount() );
+	}
+
+	// the seqs left odd would hold the readers and the writeBegin below
+	if( isRepair ) mHashMap->repairSeq();
+
+	// no split while all the stripes are locked
+	size_t activeBucket = mHashMap->getActiveBucket();
+	for( size_t i = 0; i < activeBucket; i++ ) mHashMap->writeBegin( i );
+}
+
+void SP_DictShmCache :: unlockAll()
+{
+	if( ! isConcurrent() ) return;
+
+	size_t activeBucket = mHashMap->getActiveBucket();
+	for( size_t i = 0; i < activeBucket; i++ ) mHashMap->writeEnd( i );
+
+	SP_DictShmLock::unlock( &( mHeader->mLock ) );
+	for( int i = LOCK_STRIPES - 1; i >= 0; i-- ) SP_DictShmLock::unlock( mHeader->mStripeLock + i );
 }
 
+int SP_DictShmCache :: init( const char * filePath, size_t len )
+{
+	int retCode = -1;
+
+	int isNewFile = 0;
+
+	size_t headerLen = getHeaderLen( len );
+	void * ptrHeader = SP_DictShmAllocator::getMmapPtr(
+			filePath, len + headerLen, &isNewFile, mMmapFlags, &mPageSize,
+			mZeroThreads, progressFunc, mHandler );
+
+	if( NULL != ptrHeader ) {
+		//printf( "%s file %s", isNewFile ? "create" : "reuse", filePath );
+
+		mHeader = (Header_t*)ptrHeader;
+		mAccessList = (unsigned char*)getBucketList() + getBucketLen( len );
+		if( mFlags & eSlabClass ) {
+			mAllocator = new SP_DictShmSlabAllocator( (char*)ptrHeader + headerLen, len,
+					mMinRecordSize, mRecordSize );
+		} else {
+			mAllocator = new SP_DictShmAllocator( (char*)ptrHeader + headerLen, len,
+					mRecordSize, isConcurrent() );
+		}
+
+		int isHeaderValid = 1;
+
+		if( isNewFile ) {
+			retCode = 0;
+
+			memset( mHeader, 0, headerLen );
+
+			mHeader->mType0 = 'S';
+			mHeader->mType1 = 'P';
+			mHeader->mVersion = VERSION;
+			mHeader->mCheckSumType = mCheckSumType;
+			mHeader->mFlags = mFlags;
+			mHeader->mLen = len;
+			mHeader->mMaxBucket = mMaxBucket;
+			mHeader->mActiveBucket = mMaxBucket;
+			mHeader->mItemSize = mItemSize;
+			mHeader->mMinItemSize = mMinItemSize;
+			mHeader->mEvictHeader = 0;
+			mHeader->mEvictTail = 0;
+			memset( mHeader->mCursor, 0, sizeof( mHeader->mCursor ) );
+			mHeader->mUnsealedCount = 0;
+			mHeader->mCount = 0;
+			mHeader->mMaxOverflow = getMaxOverflow( len );
+			mHeader->mIsClean = 1;
+
+			mAllocator->reset();
+		} else {
+			retCode = 1;
+
+			if( mHeader->mType0 != 'S' || mHeader->mType1 != 'P' ) {
+				printf( "init %s fail, invalid type, %c%c",
+						filePath, mHeader->mType0, mHeader->mType1 );
+				isHeaderValid = 0;
+				retCode = -1;
+			} else if( mHeader->mVersion != VERSION ) {
+				printf( "init %s fail, invalid version, %d %d",
+						filePath, mHeader->mVersion, VERSION );
+				isHeaderValid = 0;
+				retCode = -1;
+			} else if( mHeader->mLen != len || mHeader->mMaxBucket != mMaxBucket
+					|| mHeader->mItemSize != mItemSize || mHeader->mFlags != mFlags
+					|| mHeader->mMinItemSize != mMinItemSize
+					|| mHeader->mMaxOverflow != getMaxOverflow( len ) ) {
+				printf( "init %s fail, invalid metadata, "
+						"len %d %d, max.bucket %d %d, item.size %d %d, min.item.size %d %d, flags %d %d",
+						filePath, (int)mHeader->mLen, (int)len,
+						(int)mHeader->mMaxBucket, (int)mMaxBucket,
+						(int)mHeader->mItemSize, (int)mItemSize,
+						(int)mHeader->mMinItemSize, (int)mMinItemSize, mHeader->mFlags, mFlags );
+				isHeaderValid = 0;
+				retCode = -1;
+			} else if( mHeader->mCheckSumType != eCheckSumFNV
+					&& mHeader->mCheckSumType != eCheckSumCRC32C
+					&& mHeader->mCheckSumType != eCheckSumNone ) {
+				printf( "init %s fail, invalid checksum type, %d",
+						filePath, mHeader->mCheckSumType );
+				isHeaderValid = 0;
+				retCode = -1;
+			} else if( mHeader->mActiveBucket < mMaxBucket
+					|| mHeader->mActiveBucket > getBucketCapacity( len ) ) {
+				// the buckets are rebuilt below, a broken count only loses the growth
+				mHeader->mActiveBucket = mMaxBucket;
+			}
+		}
+
+		if( isHeaderValid ) {
+			mCheckSumType = mHeader->mCheckSumType;
+
+			mEvictList = new SP_DictShmHashMapEntryList( &( mHeader->mEvictHeader ),
+					&( mHeader->mEvictTail ), mAllocator, mHeader->mCursor, CURSOR_COUNT );
+			mHashMap = newHashMap();
+
+			if( isNewFile ) mHashMap->reset();
+
+			mIsRecovered = 0;
+
+			// a lock taken over in attach without a recover is rebuilt by the next call
+			mTakeOverCount = SP_DictShmLock::getTakeOverCount();
+
+			int attachRet = attach();
+
+			if( attachRet < 0 ) {
+				printf( "init %s fail, all the %d attach slots are busy", filePath, MAX_ATTACH );
+				retCode = -1;
+			} else {
+				if( attachRet > 0 ) {
+					// the other processes may be running, rebuild under all the locks
+					lockAll( 1 );
+					recover();
+					mTakeOverCount = SP_DictShmLock::getTakeOverCount();
+					unlockAll();
+
+					mIsRecovered = 1;
+				}
+
+				lockGlobal();
+				mAllocator->attachMagazine( mAttachSlot );
+				unlockGlobal();
+			}
+		}
+
+		//printf( "allocator.count %d", mAllocator->getFreeCount() );
+	}
+
+	return retCode;
+}
+
+#ifndef WIN32
+void * SP_DictShmCache :: recoverFunc( void * arg )
+#else
+unsigned long __stdcall SP_DictShmCache :: recoverFunc( void * arg )
+#endif
+{
+	RecoverArg_t * recoverArg = (RecoverArg_t*)arg;
+
+	recoverArg->mAllocator->checkRange( checkFunc, recoverArg,
+			recoverArg->mBegin, recoverArg->mEnd );
+
+	return 0;
+}
+
+bool SP_DictShmCache :: expTimeLess( const SP_DictShmHashMapEntry_t * entry1,
+		const SP_DictShmHashMapEntry_t * entry2 )
+{
+	return entry1->mExpTime < entry2->mExpTime;
+}
+
+void SP_DictShmCache :: recover()
+{
+	size_t maxCount = mAllocator->getRangeCount();
+
+	size_t threads = mRecoverThreads > 1 ? mRecoverThreads : 1;
+	if( threads > maxCount ) threads = maxCount > 0 ? maxCount : 1;
+
+	size_t step = ( maxCount + threads - 1 ) / threads;
+
+	RecoverArg_t * argList = new RecoverArg_t[ threads ];
+
+	for( size_t i = 0; i < threads; i++ ) {
+		argList[i].mAllocator = mAllocator;
+		argList[i].mHandler = mHandler;
+		argList[i].mItemSize = mItemSize;
+		argList[i].mCheckSumType = mCheckSumType;
+		argList[i].mBegin = i * step;
+		argList[i].mEnd = ( i + 1 ) * step < maxCount ? ( i + 1 ) * step : maxCount;
+	}
+
+	// check allocator, every thread checks its own range of the records
+#ifndef WIN32
+	vector< pthread_t > threadList( threads );
+	vector< int > isStarted( threads, 0 );
+
+	for( size_t i = 1; i < threads; i++ ) {
+		isStarted[i] = 0 == pthread_create( &threadList[i], NULL, recoverFunc, argList + i );
+		if( ! isStarted[i] ) recoverFunc( argList + i );
+	}
+
+	recoverFunc( argList );
+
+	for( size_t i = 1; i < threads; i++ ) {
+		if( isStarted[i] ) pthread_join( threadList[i], NULL );
+	}
+#else
+	vector< HANDLE > threadList( threads, (HANDLE)NULL );
+
+	for( size_t i = 1; i < threads; i++ ) {
+		threadList[i] = CreateThread( NULL, 0, recoverFunc, argList + i, 0, NULL );
+		if( NULL == threadList[i] ) recoverFunc( argList + i );
+	}
+
+	recoverFunc( argList );
+
+	for( size_t i = 1; i < threads; i++ ) {
+		if( NULL != threadList[i] ) {
+			WaitForSingleObject( threadList[i], INFINITE );
+			CloseHandle( threadList[i] );
+		}
+	}
+#endif
+
+	mAllocator->rebuildFreeList();
+
+	EntryList entryList;
+	for( size_t i = 0; i < threads; i++ ) {
+		entryList.insert( entryList.end(), argList[i].mEntryList.begin(),
+				argList[i].mEntryList.end() );
+	}
+
+	delete [] argList;
+
+	stable_sort( entryList.begin(), entryList.end(), expTimeLess );
+
+	// rebuild hashmap and evictlist, checkFunc has verified the hash of the entries
+	mHeader->mEvictHeader = 0;
+	mHeader->mEvictTail = 0;
+	memset( mHeader->mCursor, 0, sizeof( mHeader->mCursor ) );
+	mHeader->mUnsealedCount = 0;
+	mHeader->mCount = 0;
+	mHashMap->reset();
+
+	for( EntryList::iterator it = entryList.begin(); entryList.end() != it; it++ ) {
+		mHashMap->put( *it );
+		mEvictList->append( *it );
+	}
+}
+
+int SP_DictShmCache :: checkFunc( void * ptr, void * arg )
+{
+	RecoverArg_t * recoverArg = ( RecoverArg_t * ) arg;
+
+	SP_DictShmHashMapEntry_t * entry = (SP_DictShmHashMapEntry_t*)ptr;
+
+	int ret = 0;
+
+	// a broken length must not lead the checksum out of the record
+	size_t capacity = recoverArg->mAllocator->getItemSize( recoverArg->mAllocator->getOffset( ptr ) );
+	if( entry->mLen > recoverArg->mItemSize
+			|| entry->mLen + offsetof( SP_DictShmHashMapEntry_t, mPtr ) > capacity ) {
+		printf( "length fail, %u, %d\n", entry->mLen, (int)capacity );
+		return 0;
+	}
+
+	// it crashed before seal
+	if( CHECKSUM_UNSEALED == entry->mCheckSum ) return 0;
+
+	unsigned long int checksum = getCheckSum( recoverArg->mCheckSumType, entry->mPtr, entry->mLen );
+
+	if( entry->mCheckSum != checksum ) {
+		printf( "checksum fail, %ld, %ld\n", entry->mCheckSum, checksum );
+	} else if( recoverArg->mHandler->hash( entry->mPtr ) != entry->mHash ) {
+		// the checksum doesn't cover the hash, a torn hash files it in a wrong bucket
+		printf( "hash fail, %u\n", entry->mHash );
+	} else {
+		ret = 1;
+
+		recoverArg->mEntryList.push_back( entry );
+	}
+
+	return ret;
+}
+
+void SP_DictShmCache :: selfCheck()
+{
+	size_t freeCount = 0, usedCount = 0;
+
+	lockAll();
+
+	// 1. check allocator
+	mAllocator->selfCheck( &freeCount, &usedCount );
+
+	// 2. check hashmap, all used record must been in hashmap
+	size_t hashCount = mHashMap->selfCheck();
+	assert( usedCount == hashCount );
+
+	set<size_t> entrySet;
+
+	// 3. check evictlist
+	size_t evictPrev = 0, unsealedCount = 0;
+	for( SP_DictShmHashMapEntry_t * entry = mEvictList->getHead(); NULL != entry; ) {
+		size_t iter = mAllocator->getOffset( entry );
+
+		// 3.1 check loop entry
+		set<size_t>::iterator it = entrySet.find( iter );
+		assert( entrySet.end() == it );
+		entrySet.insert( iter );
+
+		// 3.2 entry must been in hashmap
+		assert( entry == mHashMap->get( entry->mPtr ) );
+		assert( entry->mLen <= mItemSize && entry->mLen <= getCapacity( entry ) );
+
+		// 3.3 check prev point
+		assert( evictPrev == entry->mEvictPrev );
+		evictPrev = iter;
+
+		// 3.4 the records not sealed yet
+		if( CHECKSUM_UNSEALED == entry->mCheckSum ) unsealedCount++;
+
+		if( entry->mEvictNext > 0 ) {
+			entry = (SP_DictShmHashMapEntry_t*)mAllocator->getPtr( entry->mEvictNext );
+		} else {
+			break;
+		}
+	}
+
+	// 3.5 all used count must been in evictlist
+	assert( usedCount == entrySet.size() );
+	assert( unsealedCount == mHeader->mUnsealedCount );
+
+	unlockAll();
+}
+
+int SP_DictShmCache :: get( const void * keyItem, void * resultHolder )
+{
+	int ret = 0;
+
+	checkTakeOver();
+
+	if( isConcurrent() ) {
+		char * buffer = mReadBuffer;
+
+		time_t expTime = 0;
+		size_t itemLen = 0;
+
+		size_t offset = mHashMap->read( keyItem, buffer, mItemSize, &itemLen, &expTime );
+
+		if( offset > 0 ) {
+			if( expTime > 0 && expTime < time( NULL ) ) {
+				removeEntry( keyItem, 1 );
+			} else {
+				ret = 1;
+
+				mHandler->onHit( buffer, itemLen, resultHolder );
+
+				accessEntry( keyItem, offset );
+			}
+		}
+	} else {
+		SP_DictShmHashMapEntry_t * entry = mHashMap->get( keyItem );
+
+		if( NULL != entry ) {
+			if( entry->mExpTime > 0 && entry->mExpTime < time( NULL ) ) {
+				removeEntry( keyItem, 1 );
+			} else {
+				ret = 1;
+
+				mHandler->onHit( entry->mPtr, entry->mLen, resultHolder );
+
+				accessEntry( keyItem, mAllocator->getOffset( entry ) );
+			}
+		}
+	}
+
+	if( ret ) {
+		mStat.markHit();
+	} else {
+		mStat.markMiss();
+	}
+
+	return ret;
+}
+
+int SP_DictShmCache :: getBatch( const void ** keyItems, int count,
+		void ** resultHolders, int * found )
+{
+	int ret = 0;
+
+	checkTakeOver();
+
+	unsigned int hashList[ BATCH_SIZE ];
+
+	for( int begin = 0; begin < count; begin += BATCH_SIZE ) {
+		int end = begin + BATCH_SIZE < count ? begin + BATCH_SIZE : count;
+
+		for( int i = begin; i < end; i++ ) {
+			hashList[ i - begin ] = mHandler->hash( keyItems[i] );
+			mHashMap->prefetchBucket( hashList[ i - begin ] );
+		}
+
+		// the buckets are on the way, read them for the first records
+		for( int i = begin; i < end; i++ ) mHashMap->prefetchEntry( hashList[ i - begin ] );
+
+		for( int i = begin; i < end; i++ ) {
+			int isFound = get( keyItems[i], resultHolders[i] );
+
+			if( NULL != found ) found[i] = isFound;
+			ret += isFound;
+		}
+	}
+
+	return ret;
+}
+
+int SP_DictShmCache :: acquire( const void * keyItem, View_t * view )
+{
+	int ret = 0;
+
+	size_t offset = 0;
+
+	if( isConcurrent() ) {
+		size_t itemLen = 0;
+
+		// only find the record, the item is not copied
+		offset = mHashMap->read( keyItem, NULL, 0, &itemLen, &( view->mExpTime ),
+				&( view->mBucket ), &( view->mSeq ) );
+	} else {
+		SP_DictShmHashMapEntry_t * entry = mHashMap->get( keyItem );
+
+		if( NULL != entry ) {
+			offset = mAllocator->getOffset( entry );
+
+			view->mExpTime = entry->mExpTime;
+			view->mBucket = mHashMap->getBucket( entry->mHash );
+			view->mSeq = mHashMap->readBegin( view->mBucket );
+		}
+	}
+
+	if( offset > 0 ) {
+		if( view->mExpTime > 0 && view->mExpTime < time( NULL ) ) {
+			removeEntry( keyItem, 1 );
+		} else {
+			ret = 1;
+
+			SP_DictShmHashMapEntry_t * entry = (SP_DictShmHashMapEntry_t*)mAllocator->getPtr( offset );
+
+			// a torn length must not lead the reader out of the record
+			size_t capacity = getCapacity( entry );
+
+			view->mItem = entry->mPtr;
+			view->mLen = entry->mLen < capacity ? entry->mLen : capacity;
+
+			accessEntry( keyItem, offset );
+		}
+	}
+
+	if( ret ) {
+		mStat.markHit();
+	} else {
+		mStat.markMiss();
+	}
+
+	return ret;
+}
+
+int SP_DictShmCache :: release( const View_t * view )
+{
+	return mHashMap->readRetry( view->mBucket, view->mSeq ) ? 0 : 1;
+}
+
+void SP_DictShmCache :: accessEntry( const void * keyItem, size_t offset )
+{
+	if( eLRU == mEvictAlgo ) {
+		if( isConcurrent() ) {
+			touchEntry( keyItem );
+		} else {
+			mEvictList->update( (SP_DictShmHashMapEntry_t*)mAllocator->getPtr( offset ) );
+		}
+	}
+
+	// the record may be reused after a lock-free read, a wrong bit only delays it
+	if( eCLOCK == mEvictAlgo ) {
+		unsigned char * access = getAccess( offset );
+		if( 0 == *access ) *access = 1;
+	}
+}
+
+void SP_DictShmCache :: touchEntry( const void * keyItem )
+{
+	size_t bucket = lockHash( mHandler->hash( keyItem ) );
+
+	// it may be gone after the lock-free read
+	SP_DictShmHashMapEntry_t * entry = mHashMap->get( keyItem );
+
+	if( NULL != entry ) {
+		lockGlobal();
+		mEvictList->update( entry );
+		unlockGlobal();
+	}
+
+	unlockBucket( bucket );
+}
+
+size_t SP_DictShmCache :: alloc( size_t lockedBucket, size_t len,
+		SP_DictShmHashMapEntry_t * keepEntry )
+{
+	size_t size = offsetof( SP_DictShmHashMapEntry_t, mPtr ) + len;
+
+	// a lock-free allocator only needs the global lock to evict
+	if( mAllocator->isConcurrent() ) {
+		size_t offset = mAllocator->alloc( size );
+		if( offset > 0 ) return offset;
+	}
+
+	lockGlobal();
+
+	size_t offset = mAllocator->alloc( size );
+
+	// a slab record of a smaller class doesn't help, only evict the larger ones
+	size_t fitSize = mAllocator->getFitSize( size );
+	time_t now = time( NULL );
+
+	SP_DictShmHashMapEntry_t * iter = 0 == offset ? mEvictList->getHead() : NULL;
+
+	for( int i = 0, chances = 0; 0 == offset && NULL != iter && i < EVICT_BUDGET; i++ ) {
+		size_t iterOffset = mAllocator->getOffset( iter );
+
+		// save the next one, the entry may move or go away
+		SP_DictShmHashMapEntry_t * next = iter->mEvictNext > 0
+				? (SP_DictShmHashMapEntry_t*)mAllocator->getPtr( iter->mEvictNext ) : NULL;
+
+		int isExpired = iter->mExpTime > 0 && iter->mExpTime < now;
+		unsigned char * access = getAccess( iterOffset );
+
+		if( keepEntry == iter ) {
+			// the caller replaces it after alloc
+		} else if( ! isExpired && eCLOCK == mEvictAlgo && 0 != *access
+				&& chances++ < CLOCK_BUDGET ) {
+			// eCLOCK : a referenced entry gets a second chance at the tail
+			*access = 0;
+			mEvictList->update( iter );
+			i--;
+		} else if( isExpired || mAllocator->getItemSize( iterOffset ) >= fitSize ) {
+			if( evictEntry( iter, (int)( lockedBucket % LOCK_STRIPES ) ) ) {
+				offset = mAllocator->alloc( size );
+			}
+		}
+
+		iter = next;
+	}
+
+	unlockGlobal();
+
+	return offset;
+}
+
+int SP_DictShmCache :: evictEntry( SP_DictShmHashMapEntry_t * entry, int lockedStripe )
+{
+	size_t bucket = mHashMap->getBucket( entry->mHash );
+
+	int isLocked = (int)( bucket % LOCK_STRIPES ) == lockedStripe;
+	int needUnlock = 0;
+
+	if( ! isLocked && tryLockBucket( bucket ) ) {
+		isLocked = needUnlock = 1;
+
+		// it may be split before the lock
+		if( bucket != mHashMap->getBucket( entry->mHash ) ) {
+			unlockBucket( bucket );
+			isLocked = needUnlock = 0;
+		}
+	}
+
+	if( ! isLocked ) return 0;
+
+	mHandler->onDestroy( entry->mPtr );
+
+	mHashMap->writeBegin( bucket );
+	mHashMap->remove( entry->mPtr );
+	mHashMap->writeEnd( bucket );
+
+	freeEntry( entry );
+
+	if( needUnlock ) unlockBucket( bucket );
+
+	return 1;
+}
+
+int SP_DictShmCache :: sweepExpired( int maxWork )
+{
+	int count = 0;
+
+	checkTakeOver();
+
+	time_t now = time( NULL );
+
+	lockGlobal();
+
+	for( int i = 0; i < maxWork; i++ ) {
+		SP_DictShmHashMapEntry_t * iter = mHeader->mCursor[ SWEEP_CURSOR ] > 0
+				? (SP_DictShmHashMapEntry_t*)mAllocator->getPtr( mHeader->mCursor[ SWEEP_CURSOR ] )
+				: mEvictList->getHead();
+		if( NULL == iter ) break;
+
+		// remove moves the cursor too, a busy stripe is skipped until the next pass
+		mHeader->mCursor[ SWEEP_CURSOR ] = iter->mEvictNext;
+
+		if( iter->mExpTime > 0 && iter->mExpTime < now ) count += evictEntry( iter, -1 );
+
+		if( 0 == mHeader->mCursor[ SWEEP_CURSOR ] ) break;
+	}
+
+	unlockGlobal();
+
+	return count;
+}
+
+int SP_DictShmCache :: seal( int maxWork )
+{
+	int count = 0;
+
+	checkTakeOver();
+
+	lockGlobal();
+
+	for( int i = 0; i < maxWork && mHeader->mUnsealedCount > 0; i++ ) {
+		SP_DictShmHashMapEntry_t * iter = mHeader->mCursor[ SEAL_CURSOR ] > 0
+				? (SP_DictShmHashMapEntry_t*)mAllocator->getPtr( mHeader->mCursor[ SEAL_CURSOR ] )
+				: mEvictList->getHead();
+		if( NULL == iter ) break;
+
+		mHeader->mCursor[ SEAL_CURSOR ] = iter->mEvictNext;
+
+		if( CHECKSUM_UNSEALED == iter->mCheckSum ) {
+			size_t bucket = mHashMap->getBucket( iter->mHash );
+
+			// the writers of the item hold the stripe, a busy one waits for the next pass,
+			// the item doesn't change, so the readers and the views go on
+			if( tryLockBucket( bucket ) ) {
+				// it may be split before the lock
+				if( bucket == mHashMap->getBucket( iter->mHash ) ) {
+					iter->mCheckSum = getCheckSum( mCheckSumType, iter->mPtr, iter->mLen );
+					mHeader->mUnsealedCount--;
+					count++;
+				}
+
+				unlockBucket( bucket );
+			}
+		}
+
+		if( 0 == mHeader->mCursor[ SEAL_CURSOR ] ) break;
+	}
+
+	unlockGlobal();
+
+	return count;
+}
+
+void SP_DictShmCache :: freeEntry( SP_DictShmHashMapEntry_t * entry )
+{
+	if( CHECKSUM_UNSEALED == entry->mCheckSum ) mHeader->mUnsealedCount--;
+
+	mEvictList->remove( entry );
+	mAllocator->free( mAllocator->getOffset( entry ) );
+}
+
+unsigned long int SP_DictShmCache :: getRecordCheckSum( const char * ptr, size_t len )
+{
+	if( mIsDeferSeal && eCheckSumNone != mCheckSumType ) return CHECKSUM_UNSEALED;
+
+	return getCheckSum( mCheckSumType, ptr, len );
+}
+
+size_t SP_DictShmCache :: getCapacity( SP_DictShmHashMapEntry_t * entry )
+{
+	return mAllocator->getItemSize( mAllocator->getOffset( entry ) )
+			- offsetof( SP_DictShmHashMapEntry_t, mPtr );
+}
+
+int SP_DictShmCache :: put( void * item, time_t expTime )
+{
+	return put( item, mItemSize, expTime );
+}
+
+int SP_DictShmCache :: put( void * item, size_t len, time_t expTime )
+{
+	if( len > mItemSize ) return -1;
+
+	checkTakeOver();
+
+	int retCode = -1;
+
+	unsigned int hash = mHandler->hash( item );
+	size_t bucket = lockHash( hash );
+
+	SP_DictShmHashMapEntry_t * entry = mHashMap->get( item );
+
+	if( NULL != entry && len <= getCapacity( entry ) ) {
+		retCode = 1;
+
+		mHashMap->writeBegin( bucket );
+
+		long unsealedDelta = CHECKSUM_UNSEALED == entry->mCheckSum ? -1 : 0;
+
+		memcpy( entry->mPtr, item, len );
+		entry->mLen = len;
+		entry->mCheckSum = getRecordCheckSum( entry->mPtr, len );
+		entry->mExpTime = expTime;
+
+		mHashMap->writeEnd( bucket );
+
+		if( CHECKSUM_UNSEALED == entry->mCheckSum ) unsealedDelta++;
+
+		lockGlobal();
+		mEvictList->update( entry );
+		mHeader->mUnsealedCount += unsealedDelta;
+		unlockGlobal();
+	} else {
+		size_t offset = alloc( bucket, len, entry );
+
+		if( offset > 0 ) {
+			retCode = NULL != entry ? 1 : 0;
+
+			SP_DictShmHashMapEntry_t * newEntry =
+					(SP_DictShmHashMapEntry_t*)mAllocator->getPtr( offset );
+
+			// the record is not reachable yet, fill it before linking it,
+			// the checksum is the last, init trusts mHash of a valid record
+			newEntry->mHash = hash;
+			newEntry->mLen = len;
+
+			unsigned char * access = getAccess( offset );
+			if( 0 != *access ) *access = 0;
+
+			memcpy( newEntry->mPtr, item, len );
+			newEntry->mCheckSum = getRecordCheckSum( newEntry->mPtr, len );
+			newEntry->mExpTime = expTime;
+
+			// the item outgrows its record, replace the record
+			mHashMap->writeBegin( bucket );
+			if( NULL != entry ) mHashMap->remove( item );
+			mHashMap->put( newEntry );
+			mHashMap->writeEnd( bucket );
+
+			lockGlobal();
+			if( NULL != entry ) freeEntry( entry );
+			mEvictList->append( newEntry );
+			if( CHECKSUM_UNSEALED == newEntry->mCheckSum ) mHeader->mUnsealedCount++;
+			unlockGlobal();
+		}
+	}
+
+	unlockBucket( bucket );
+
+	if( 0 == retCode ) grow( GROW_BUDGET );
+
+	return retCode;
+}
+
+int SP_DictShmCache :: removeEntry( const void * keyItem, int onlyExpired )
+{
+	int ret = 0;
+
+	size_t bucket = lockHash( mHandler->hash( keyItem ) );
+
+	SP_DictShmHashMapEntry_t * entry = mHashMap->get( keyItem );
+
+	if( NULL != entry && onlyExpired ) {
+		// it may be updated after the lock-free read
+		if( 0 == entry->mExpTime || entry->mExpTime >= time( NULL ) ) entry = NULL;
+	}
+
+	if( NULL != entry ) {
+		ret = 1;
+
+		mHandler->onDestroy( entry->mPtr );
+
+		mHashMap->writeBegin( bucket );
+		mHashMap->remove( keyItem );
+		mHashMap->writeEnd( bucket );
+
+		lockGlobal();
+		freeEntry( entry );
+		unlockGlobal();
+	}
+
+	unlockBucket( bucket );
+
+	return ret;
+}
+
+int SP_DictShmCache :: erase( const void * keyItem )
+{
+	checkTakeOver();
+
+	return removeEntry( keyItem, 0 );
+}
+
+const SP_DictShmCacheStatistics * SP_DictShmCache :: getStatistics()
+{
+	SP_DictShmCacheStatistics * ret = new SP_DictShmCacheStatistics( mStat );
+	ret->setSize( mHashMap->getCount() );
+
+	return ret;
+}
+
+void SP_DictShmCache :: dumpFunc( size_t bucket, SP_DictShmHashMapEntry_t * entry, void * arg )
+{
+	SP_DictShmCacheHandler * handler = (SP_DictShmCacheHandler*)arg;
+
+	handler->onDumpHash( (int)bucket, entry->mPtr );
+}
+
+void SP_DictShmCache :: progressFunc( size_t doneLen, size_t totalLen, void * arg )
+{
+	SP_DictShmCacheHandler * handler = (SP_DictShmCacheHandler*)arg;
+
+	handler->onCreateProgress( doneLen, totalLen );
+}
+
+void SP_DictShmCache :: dumpHash()
+{
+	mHashMap->visit( dumpFunc, mHandler );
+}
+
+void SP_DictShmCache :: dumpEvict()
+{
+	for( SP_DictShmHashMapEntry_t * iter = mEvictList->getHead(); NULL != iter; ) {
+		mHandler->onDumpEvict( iter->mExpTime, iter->mPtr );
+
+		if( iter->mEvictNext > 0 ) {
+			iter = (SP_DictShmHashMapEntry_t*)mAllocator->getPtr( iter->mEvictNext );
+		} else {
+			break;
+		}
+	}
+}
+
+unsigned int SP_DictShmCache :: fnvHash( const char * key, size_t len )
+{
+	static const unsigned int FNV_32_INIT = 2166136261UL;
+	static const unsigned int FNV_32_PRIME = 16777619;
+
+	unsigned int hash = FNV_32_INIT;
+
+	for( unsigned int x = 0; x < len; x++ ) {
+		hash *= FNV_32_PRIME;
+		hash ^= key[x];
+	}
+
+	return hash;
+}
+
+unsigned int SP_DictShmCache :: getCheckSum( int checkSumType, const char * ptr, size_t len )
+{
+	if( eCheckSumNone == checkSumType ) return 0;
+
+	return eCheckSumCRC32C == checkSumType ? crc32c( ptr, len ) : fnvHash( ptr, len );
+}
+
+//---------------------------------------------------------------------------
+
+static const unsigned long long WY_SECRET0 = 0xa0761d6478bd642fULL;
+static const unsigned long long WY_SECRET1 = 0xe7037ed1a0b428dbULL;
+static const unsigned long long WY_SECRET2 = 0x8ebc6af09c88c6e3ULL;
+static const unsigned long long WY_SECRET3 = 0x589965cc75374cc3ULL;
+
+// a * b, a gets the low 64 bits, b gets the high 64 bits
+static inline void wyMum( unsigned long long * a, unsigned long long * b )
+{
+#if defined( __GNUC__ ) && defined( __SIZEOF_INT128__ )
+	__uint128_t r = (__uint128_t)( *a ) * ( *b );
+	*a = (unsigned long long)r;
+	*b = (unsigned long long)( r >> 64 );
+#else
+	unsigned long long ha = *a >> 32, hb = *b >> 32;
+	unsigned long long la = (unsigned int)*a, lb = (unsigned int)*b;
+	unsigned long long rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+
+	unsigned long long t = rl + ( rm0 << 32 ), carry = t < rl;
+	unsigned long long lo = t + ( rm1 << 32 );
+	carry += lo < t;
+
+	*a = lo;
+	*b = rh + ( rm0 >> 32 ) + ( rm1 >> 32 ) + carry;
+#endif
+}
+
+static inline unsigned long long wyMix( unsigned long long a, unsigned long long b )
+{
+	wyMum( &a, &b );
+
+	return a ^ b;
+}
+
+// unaligned loads, memcpy becomes a single mov
+static inline unsigned long long wyRead8( const unsigned char * p )
+{
+	unsigned long long v;
+	memcpy( &v, p, sizeof( v ) );
+	return v;
+}
+
+static inline unsigned long long wyRead4( const unsigned char * p )
+{
+	unsigned int v;
+	memcpy( &v, p, sizeof( v ) );
+	return v;
+}
+
+unsigned long long SP_DictShmCache :: fastHash( const void * key, size_t len,
+		unsigned long long seed )
+{
+	const unsigned char * p = (const unsigned char*)key;
+
+	seed ^= wyMix( seed ^ WY_SECRET0, WY_SECRET1 );
+
+	unsigned long long a = 0, b = 0;
+
+	if( len <= 16 ) {
+		if( len >= 4 ) {
+			// two overlapped reads cover 4 to 16 bytes
+			size_t shift = ( len >> 3 ) << 2;
+			a = ( wyRead4( p ) << 32 ) | wyRead4( p + shift );
+			b = ( wyRead4( p + len - 4 ) << 32 ) | wyRead4( p + len - 4 - shift );
+		} else if( len > 0 ) {
+			a = ( (unsigned long long)p[0] << 16 ) | ( (unsigned long long)p[ len >> 1 ] << 8 )
+					| p[ len - 1 ];
+		}
+	} else {
+		size_t i = len;
+
+		if( i > 48 ) {
+			// three independent lanes keep the multipliers busy
+			unsigned long long see1 = seed, see2 = seed;
+
+			for( ; i > 48; i -= 48, p += 48 ) {
+				seed = wyMix( wyRead8( p ) ^ WY_SECRET1, wyRead8( p + 8 ) ^ seed );
+				see1 = wyMix( wyRead8( p + 16 ) ^ WY_SECRET2, wyRead8( p + 24 ) ^ see1 );
+				see2 = wyMix( wyRead8( p + 32 ) ^ WY_SECRET3, wyRead8( p + 40 ) ^ see2 );
+			}
+
+			seed ^= see1 ^ see2;
+		}
+
+		for( ; i > 16; i -= 16, p += 16 ) {
+			seed = wyMix( wyRead8( p ) ^ WY_SECRET1, wyRead8( p + 8 ) ^ seed );
+		}
+
+		// the last 16 bytes, may overlap the bytes above
+		a = wyRead8( p + i - 16 );
+		b = wyRead8( p + i - 8 );
+	}
+
+	a ^= WY_SECRET1;
+	b ^= seed;
+	wyMum( &a, &b );
+
+	return wyMix( a ^ WY_SECRET0 ^ len, b ^ WY_SECRET1 );
+}
+
+//---------------------------------------------------------------------------
+
+// slicing-by-8 tables of the castagnoli polynomial
+class SP_Crc32cTable {
+public:
+	SP_Crc32cTable() {
+		for( unsigned int i = 0; i < 256; i++ ) {
+			unsigned int crc = i;
+			for( int j = 0; j < 8; j++ ) crc = ( crc >> 1 ) ^ ( ( crc & 1 ) ? 0x82f63b78 : 0 );
+			mTable[0][i] = crc;
+		}
+
+		for( unsigned int i = 0; i < 256; i++ ) {
+			for( int k = 1; k < 8; k++ ) {
+				mTable[k][i] = ( mTable[k - 1][i] >> 8 ) ^ mTable[0][ mTable[k - 1][i] & 0xff ];
+			}
+		}
+	}
+
+	unsigned int update( unsigned int crc, const unsigned char * p, size_t len ) const {
+		for( ; len >= 8; len -= 8, p += 8 ) {
+			unsigned int lo = crc ^ (unsigned int)wyRead4( p );
+			unsigned int hi = (unsigned int)wyRead4( p + 4 );
+
+			crc = mTable[7][ lo & 0xff ] ^ mTable[6][ ( lo >> 8 ) & 0xff ]
+					^ mTable[5][ ( lo >> 16 ) & 0xff ] ^ mTable[4][ lo >> 24 ]
+					^ mTable[3][ hi & 0xff ] ^ mTable[2][ ( hi >> 8 ) & 0xff ]
+					^ mTable[1][ ( hi >> 16 ) & 0xff ] ^ mTable[0][ hi >> 24 ];
+		}
+
+		for( ; len > 0; len--, p++ ) crc = ( crc >> 8 ) ^ mTable[0][ ( crc ^ *p ) & 0xff ];
+
+		return crc;
+	}
+
+private:
+	unsigned int mTable[ 8 ][ 256 ];
+};
+
+static const SP_Crc32cTable gCrc32cTable;
+
+#if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+
+#define SP_HAS_CRC32_INSN
+
+__attribute__(( target( "sse4.2" ) ))
+static unsigned int crc32cInsn( unsigned int crc, const unsigned char * p, size_t len )
+{
+#ifdef __x86_64__
+	unsigned long long crc64 = crc;
+	for( ; len >= 8; len -= 8, p += 8 ) crc64 = __builtin_ia32_crc32di( crc64, wyRead8( p ) );
+	crc = (unsigned int)crc64;
+#endif
+
+	for( ; len >= 4; len -= 4, p += 4 ) crc = __builtin_ia32_crc32si( crc, (unsigned int)wyRead4( p ) );
+	for( ; len > 0; len--, p++ ) crc = __builtin_ia32_crc32qi( crc, *p );
+
+	return crc;
+}
+
+#endif
+
+unsigned int SP_DictShmCache :: crc32c( const void * data, size_t len, unsigned int crc )
+{
+	const unsigned char * p = (const unsigned char*)data;
+
+	crc = ~crc;
+
+#ifdef SP_HAS_CRC32_INSN
+	static const int hasInsn = __builtin_cpu_supports( "sse4.2" ) ? 1 : 0;
+
+	if( hasInsn ) return ~crc32cInsn( crc, p, len );
+#endif
+
+	return ~gCrc32cTable.update( crc, p, len );
+}
@@ -8,7 +8,7 @@
 
 #include <sys/types.h>
 #include <time.h>
-#include <map>
+#include <vector>
 
 using namespace std;
 
@@ -26,13 +26,21 @@ public:
 	// @return 1 : item1 > item2, 0 : item1 == item2, -1 : item1 < item2
 	virtual int compare( const void * item1, const void * item2 ) = 0;
 
-	virtual void onHit( const void * item, void * resultHolder ) = 0;
+	virtual void onHit( const void * item, void * resultHolder ) {}
+
+	// len is the length given to put, the default ignores it
+	virtual void onHit( const void * item, size_t len, void * resultHolder ) {
+		onHit( item, resultHolder );
+	}
 
 	virtual void onDestroy( const void * item ) {}
 
 	virtual void onDumpHash( int bucket, const void * item ) {}
 
 	virtual void onDumpEvict( time_t expTime, const void * item ) {}
+
+	// init creates a new file, doneLen of totalLen bytes are ready
+	virtual void onCreateProgress( size_t doneLen, size_t totalLen ) {}
 };
 
 class SP_DictShmCacheStatistics {
@@ -55,14 +63,109 @@ private:
 
 class SP_DictShmCache {
 public:
-	SP_DictShmCache( SP_DictShmCacheHandler * handler, size_t maxBucket, size_t itemSize );
+	/**
+	 * eConcurrent : several processes attach the same file and call the cache
+	 *   at the same time. get walks the bucket chains without any lock and
+	 *   copies the item out under the seqlock of the bucket, so onHit gets a
+	 *   private copy of the item, and compare may see a half-written item,
+	 *   whose result is discarded. Writers lock a stripe of the buckets, and
+	 *   a global lock for the evict list. The fixed records come from a
+	 *   lock-free free list, through a magazine of every attached process,
+	 *   the slab records are allocated under the global lock.
+	 *   A cache object is used by one thread, the magazine and the statistics
+	 *   are not synchronized. Every thread attaches the file with its own
+	 *   object, it takes one of the MAX_ATTACH slots.
+	 *   A process killed while it holds a lock leaves the lock held, a waiter
+	 *   which finds the owner dead takes the lock over, and ends the writes
+	 *   of the dead owner before anyone else gets the lock : the seqs of a
+	 *   stripe, or the links of the evict list. Its next call of the cache
+	 *   frees the slot of the dead owner and recovers the file under all the
+	 *   locks, as the init of a new process does.
+	 *
+	 * eTagBucket : every bucket is a cache line of 8 ( hash tag, offset ) pairs,
+	 *   a lookup compares the 16-bit tags of a bucket at once, and only calls
+	 *   compare() for the records whose tag matches. The default buckets chain
+	 *   the records, and a lookup calls compare() on every record it walks.
+	 *
+	 * eSlabClass : the records are cut from pages of size classes, from
+	 *   setMinItemSize to itemSize, so a short item takes a short record.
+	 *   The default records are all of itemSize bytes.
+	 *
+	 * The flags are saved in the file, all the processes must use the same flags.
+	 */
+	enum { eConcurrent = 0x01, eTagBucket = 0x02, eSlabClass = 0x04 };
+
+	/**
+	 * @param maxBucket : initial count of the buckets. The file reserves room
+	 *   for the buckets of a full cache, and put splits a few buckets at a
+	 *   time when the load factor is too high, so the table grows in place.
+	 * @param itemSize : the max length of the items
+	 */
+	SP_DictShmCache( SP_DictShmCacheHandler * handler, size_t maxBucket, size_t itemSize,
+			int flags = 0 );
 
 	~SP_DictShmCache();
 
-	// @return 0 : init ok, create file, 1 : init ok, reuse file, -1 : init Fail
+	/**
+	 * A file closed by the destructor of the last attached cache is reused as
+	 * it is. Otherwise some process crashed, all the records are checked and
+	 * the buckets and the evict list are rebuilt, by setRecoverThreads threads.
+	 * A file of another format version is rejected, remove it to create a new one.
+	 *
+	 * @return 0 : init ok, create file, 1 : init ok, reuse file, -1 : init Fail
+	 */
 	int init( const char * filePath, size_t len );
 
-	enum { eFIFO, eLRU };
+	// default is 4, each thread checks a range of the records
+	void setRecoverThreads( int recoverThreads );
+
+	// eSlabClass : size of the smallest class, default is 64, call it before init
+	void setMinItemSize( size_t minItemSize );
+
+	// SP_DictShmAllocator::eMmapXXX of this process, default is 0, call it before init
+	void setMmapFlags( int mmapFlags );
+
+	// page size of the mapping after init
+	size_t getPageSize();
+
+	// > 0 : a new file is zeroed by these threads, default is 0, only reserve the blocks
+	void setZeroThreads( int zeroThreads );
+
+	// @return 1 : the last init checked all the records
+	int isRecovered();
+
+	/**
+	 * The checksum of the used bytes of a record, init checks it to recover
+	 * a file. eCheckSumNone : no checksum, recover only checks the lengths.
+	 */
+	enum { eCheckSumFNV = 0, eCheckSumCRC32C = 1, eCheckSumNone = 2 };
+
+	// the type of a new file, default is fnv, a reused file keeps its own type, call it before init
+	void setCheckSumType( int checkSumType );
+
+	// the type of the file after init
+	int getCheckSumType();
+
+	/**
+	 * 1 : put leaves the checksum of the record to seal, a write only costs
+	 * the copy. recover drops the records not sealed yet, so call seal from a
+	 * timer to keep the window short. Default is 0, put seals the record.
+	 */
+	void setDeferSeal( int isDeferSeal );
+
+	/**
+	 * Checksum up to maxWork records of the evict list which are not sealed.
+	 * Like sweepExpired, the cursor is saved in the file, a call stops at the tail.
+	 *
+	 * @return count of the sealed records
+	 */
+	int seal( int maxWork );
+
+	// eLRU : a hit moves the item to the tail of the evict list, it writes 3 records
+	// eCLOCK : second chance, a hit only sets a byte of the access array,
+	//   alloc moves a referenced head to the tail instead of reclaiming it
+	// a full cache evicts from the head of the evict list
+	enum { eFIFO, eLRU, eCLOCK };
 
 	// default is fifo
 	void setEvictAlgo( int evictAlgo );
@@ -70,12 +173,65 @@ public:
 	// @return 0 : no such key, 1 : found it
 	int get( const void * keyItem, void * resultHolder );
 
-	// @return 0 : insert ok, 1 : update ok, -1 : Out of memory
+	/**
+	 * Look up count keys at once, so the cache misses of the keys overlap :
+	 * hash all the keys, prefetch their buckets, then their first records,
+	 * then get them one by one. Up to BATCH_SIZE keys are in flight.
+	 *
+	 * @param found : NULL, or count flags, 1 : found the key
+	 * @return count of the keys found
+	 */
+	int getBatch( const void ** keyItems, int count, void ** resultHolders, int * found );
+
+	// a pinned view of an item, mItem points into the mmap file
+	typedef struct tagView {
+		const void * mItem;
+		size_t mLen;
+		time_t mExpTime;
+
+		// the lease, the seq of the bucket when the item was found
+		size_t mBucket;
+		unsigned int mSeq;
+	} View_t;
+
+	/**
+	 * Zero-copy get, the item is read in place instead of through onHit.
+	 * The writers never wait for a view, an item may be updated or evicted
+	 * while it is read, so parse at most mLen bytes, and only trust the
+	 * result if release returns 1, otherwise acquire it again.
+	 *
+	 * @return 0 : no such key, 1 : found it
+	 */
+	int acquire( const void * keyItem, View_t * view );
+
+	// @return 1 : the item was not changed since acquire, 0 : it may be changed
+	int release( const View_t * view );
+
+	/**
+	 * A full cache evicts the items at the head of the evict list to make room.
+	 * eSlabClass only evicts the items whose record is large enough.
+	 *
+	 * @return 0 : insert ok, 1 : update ok,
+	 *   -1 : Out of memory, no item near the head to evict
+	 */
 	int put( void * item, time_t expTime = 0 );
 
+	// the first len bytes of item, @return -1 : Out of memory, or len > itemSize
+	int put( void * item, size_t len, time_t expTime );
+
 	// @return 0 : no such key, 1 : erase it
 	int erase( const void * keyItem );
 
+	/**
+	 * Walk up to maxWork items of the evict list, and remove the expired ones.
+	 * The cursor is saved in the file, the next call goes on from it, so a
+	 * timer can sweep the whole list in short slices. A call stops at the tail,
+	 * the next one starts from the head again.
+	 *
+	 * @return count of the removed items
+	 */
+	int sweepExpired( int maxWork );
+
 	// caller need to delete the return object
 	const SP_DictShmCacheStatistics * getStatistics();
 
@@ -87,20 +243,156 @@ public:
 
 	static unsigned int fnvHash( const char * key, size_t len );
 
+	// 64-bit hash of wyhash quality, 48 bytes per step
+	static unsigned long long fastHash( const void * key, size_t len, unsigned long long seed = 0 );
+
+	// crc is the result of the previous part, uses the crc32 instruction of sse4.2 if the cpu has it
+	static unsigned int crc32c( const void * data, size_t len, unsigned int crc = 0 );
+
 private:
+	// bumped on every change of the file layout, there is no reader of the older ones
+	enum { VERSION = 13, LOCK_STRIPES = 64, GROW_BUDGET = 2, MAX_ATTACH = 64,
+			EVICT_BUDGET = 1024, CLOCK_BUDGET = 64, BATCH_SIZE = 64 };
+
+	enum { SWEEP_CURSOR = 0, SEAL_CURSOR = 1, CURSOR_COUNT = 2 };
+
+	// followed by the buckets, the access array, then the records
 	typedef struct tagHeader {
 		char mType0;
 		char mType1;
+		char mVersion;
+		char mCheckSumType;  // eCheckSumXXX of the records
+		int mFlags;
 		size_t mLen;
-		size_t mMaxBucket;
-		size_t mItemSize;
+		size_t mMaxBucket, mActiveBucket;
+		size_t mItemSize, mMinItemSize;
 		size_t mEvictHeader, mEvictTail;
-		size_t mBucket[1];
+		size_t mCursor[ CURSOR_COUNT ];  // the walkers of the evict list
+		size_t mUnsealedCount;           // guarded by mLock
+		size_t mCount;
+
+		// eConcurrent : mLock guards the evict list and the slab allocator,
+		// mStripeLock[ bucket % LOCK_STRIPES ] guards the writers of the bucket,
+		// the lock order is stripe then global, a held lock is the pid of the owner
+		unsigned int mLock;
+		unsigned int mStripeLock[ LOCK_STRIPES ];
+
+		// eTagBucket : the overflow buckets, mOverflowLock is taken after the others
+		size_t mMaxOverflow, mOverflowFree;
+		unsigned int mOverflowLock;
+
+		// guarded by mLock, mIsClean is set when the last process detaches,
+		// the stamp of a pid tells a reused pid from the attached process
+		int mIsClean;
+		int mAttachPid[ MAX_ATTACH ];
+		unsigned long long mAttachStamp[ MAX_ATTACH ];
 	} Header_t;
 
+	// @return bytes of the header, the buckets and the access array, the records follow them
+	size_t getHeaderLen( size_t len );
+
+	size_t getBucketLen( size_t len );
+
+	// one byte for every mMinRecordSize bytes of the records
+	size_t getAccessLen( size_t len );
+
+	// eCLOCK : the access byte of the record
+	unsigned char * getAccess( size_t offset );
+
+	size_t getMaxOverflow( size_t len );
+
+	// @return count of the buckets when the cache is full
+	size_t getBucketCapacity( size_t len );
+
+	char * getBucketList();
+
+	SP_DictShmHashMap * newHashMap();
+
+	int isConcurrent();
+
+	void lockBucket( size_t bucket );
+	int tryLockBucket( size_t bucket );
+	void unlockBucket( size_t bucket );
+
+	// lock the bucket of the hash, @return the bucket, it doesn't move until unlockBucket
+	size_t lockHash( unsigned int hash );
+
+	// split up to budget buckets if the load factor is too high
+	void grow( int budget );
+
+	void lockGlobal();
+	void unlockGlobal();
+
+	/**
+	 * lock all the stripes and the global lock, readers wait until unlockAll
+	 *
+	 * @param isRepair : a writer was killed, end its writes to the buckets
+	 */
+	void lockAll( int isRepair = 0 );
+	void unlockAll();
+
+	/**
+	 * evict the records from the head of the evict list if the allocator is
+	 * full, the expired ones, or the ones alloc( len ) may reuse, but not
+	 * keepEntry, the caller holds the lock of lockedBucket
+	 *
+	 * @return 0 : out of memory
+	 */
+	size_t alloc( size_t lockedBucket, size_t len, SP_DictShmHashMapEntry_t * keepEntry );
+
+	/**
+	 * the caller holds the global lock, never wait for a stripe lock here
+	 *
+	 * @param lockedStripe : the stripe the caller holds, -1 : none
+	 * @return 1 : remove it, 0 : the stripe is busy
+	 */
+	int evictEntry( SP_DictShmHashMapEntry_t * entry, int lockedStripe );
+
+	// @return bytes of the item the record of the entry can hold
+	size_t getCapacity( SP_DictShmHashMapEntry_t * entry );
+
+	// unlink the entry from the evict list and free the record, the caller holds the global lock
+	void freeEntry( SP_DictShmHashMapEntry_t * entry );
+
+	// @return the checksum put saves, CHECKSUM_UNSEALED if mIsDeferSeal
+	unsigned long int getRecordCheckSum( const char * ptr, size_t len );
+
+	// @return 0 : no such key, 1 : remove it
+	int removeEntry( const void * keyItem, int onlyExpired );
+
+	// move the entry to the tail of the evict list
+	void touchEntry( const void * keyItem );
+
+	// eLRU, eCLOCK : record a hit of the record
+	void accessEntry( const void * keyItem, size_t offset );
+
+	// SP_DictShmLock::IsAliveFunc_t of the lock owners, arg is the cache
+	static int isOwnerAlive( unsigned int owner, void * arg );
+
+	// a lock-free reader waits too long for a bucket, take its lock to end a killed writer
+	static void onReadStall( size_t bucket, void * arg );
+
+	// free the attach slots of the killed processes, the caller holds the global lock
+	// @return count of the freed slots
+	int freeDeadSlots();
+
+	// this process took over a lock from a killed writer, rebuild the file
+	// under all the locks, call it before taking any lock
+	void checkTakeOver();
+
+	// @return 1 : the file was not closed cleanly, it needs recover, -1 : no free slot
+	int attach();
+
+	void detach();
+
+	// check all the records, rebuild the buckets and the evict list
+	void recover();
+
 	SP_DictShmCacheHandler * mHandler;
 	size_t mItemSize, mRecordSize;
+	size_t mMinItemSize, mMinRecordSize;
 	size_t mMaxBucket;
+	int mFlags;
 	Header_t * mHeader;
 
 	SP_DictShmAllocator * mAllocator;
@@ -109,12 +401,49 @@ private:
 
 	SP_DictShmCacheStatistics mStat;
 
+	unsigned char * mAccessList;
+
+	// get copies an item here under the seqlock, mItemSize bytes
+	char * mReadBuffer;
+
 	int mEvictAlgo;
 
-	typedef multimap< time_t, SP_DictShmHashMapEntry_t * > EntryMap;
-	typedef pair< int, EntryMap > CheckArg;
+	int mRecoverThreads, mIsRecovered;
+	int mMmapFlags, mZeroThreads;
+	int mCheckSumType, mIsDeferSeal;
+	size_t mPageSize;
+	int mAttachSlot;
+
+	// SP_DictShmLock::getTakeOverCount after the last rebuild
+	unsigned int mTakeOverCount;
+
+	typedef vector< SP_DictShmHashMapEntry_t * > EntryList;
+
+	typedef struct tagRecoverArg {
+		SP_DictShmAllocator * mAllocator;
+		SP_DictShmCacheHandler * mHandler;
+		size_t mItemSize;
+		int mCheckSumType;
+		size_t mBegin, mEnd;
+		EntryList mEntryList;
+	} RecoverArg_t;
 
 	static int checkFunc( void * ptr, void * arg );
+
+	static unsigned int getCheckSum( int checkSumType, const char * ptr, size_t len );
+
+	static bool expTimeLess( const SP_DictShmHashMapEntry_t * entry1,
+			const SP_DictShmHashMapEntry_t * entry2 );
+
+#ifndef WIN32
+	static void * recoverFunc( void * arg );
+#else
+	static unsigned long __stdcall recoverFunc( void * arg );
+#endif
+
+	static void dumpFunc( size_t bucket, SP_DictShmHashMapEntry_t * entry, void * arg );
+
+	static void progressFunc( size_t doneLen, size_t totalLen, void * arg );
 };
 
 #endif
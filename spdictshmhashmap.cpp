@@ -4,17 +4,33 @@
  */
 
 #include <stdio.h>
+#include <stddef.h>
+#include <string.h>
 #include <assert.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#pragma warning(disable : 4786)
+
+#include <set>
+#include <vector>
+
+using namespace std;
+
 #include "spdictshmhashmap.hpp"
 #include "spdictshmalloc.hpp"
+#include "spdictshmlock.hpp"
 
 SP_DictShmHashMapEntryList :: SP_DictShmHashMapEntryList( size_t * evictHeader,
-		size_t * evictTail, const SP_DictShmAllocator * allocator )
+		size_t * evictTail, const SP_DictShmAllocator * allocator, size_t * cursorList, int cursorCount )
 {
 	mAllocator = allocator;
 	mEvictHeader = evictHeader;
 	mEvictTail = evictTail;
+	mCursorList = cursorList;
+	mCursorCount = cursorCount;
 }
 
 SP_DictShmHashMapEntryList :: ~SP_DictShmHashMapEntryList()
@@ -60,6 +76,10 @@ void SP_DictShmHashMapEntryList :: remove( SP_DictShmHashMapEntry_t * entry )
 	if( curr == *mEvictHeader ) assert( 0 == prev );
 	if( curr == *mEvictTail ) assert( 0 == next );
 
+	for( int i = 0; i < mCursorCount; i++ ) {
+		if( curr == mCursorList[i] ) mCursorList[i] = next;
+	}
+
 	if( 0 == prev ) {
 		*mEvictHeader = next;
 	} else {
@@ -84,60 +104,272 @@ void SP_DictShmHashMapEntryList :: update( SP_DictShmHashMapEntry_t * entry )
 	append( entry );
 }
 
+void SP_DictShmHashMapEntryList :: repair( size_t maxCount )
+{
+	// the next links are written first, follow them and rebuild the prev links
+	size_t prev = 0, curr = *mEvictHeader;
+
+	for( size_t count = 0; curr > 0 && count < maxCount; count++ ) {
+		if( ! mAllocator->isValid( curr ) ) break;
+
+		SP_DictShmHashMapEntry_t * entry = (SP_DictShmHashMapEntry_t*)( mAllocator->getPtr( curr ) );
+
+		entry->mEvictPrev = prev;
+
+		prev = curr;
+		curr = entry->mEvictNext;
+	}
+
+	// a loop is cut at maxCount
+	if( prev > 0 ) {
+		SP_DictShmHashMapEntry_t * entry = (SP_DictShmHashMapEntry_t*)( mAllocator->getPtr( prev ) );
+		entry->mEvictNext = 0;
+	}
+
+	*mEvictTail = prev;
+	if( 0 == prev ) *mEvictHeader = 0;
+}
+
 //---------------------------------------------------------------------------
 
-SP_DictShmHashMap :: SP_DictShmHashMap( size_t * bucketList, size_t maxBucket,
-		const SP_DictShmAllocator * allocator, SP_DictShmHashMapHandler * handler )
+SP_DictShmHashMap :: SP_DictShmHashMap( size_t baseBucket, size_t maxBucket,
+		size_t * activeBucket, size_t maxLoad,
+		const SP_DictShmAllocator * allocator, SP_DictShmHashMapHandler * handler,
+		size_t * count, int isConcurrent )
 {
 	mAllocator = allocator;
 	mHandler = handler;
-
-	mBucketList = bucketList;
+	mBaseBucket = baseBucket;
 	mMaxBucket = maxBucket;
+	mActiveBucket = activeBucket;
+	mMaxLoad = maxLoad;
 
-	mCount = 0;
+	mCount = count;
+	mIsConcurrent = isConcurrent;
 
-	for( int i = 0; i < (int)mMaxBucket; i++ ) {
-		size_t iter = mBucketList[i];
-		for( ; iter > 0; ) {
-			SP_DictShmHashMapEntry_t * entry = (SP_DictShmHashMapEntry_t*)mAllocator->getPtr( iter );
-			iter = entry->mKeyNext;
-
-			mCount++;
-		}
-	}
+	mIsAlive = NULL;
+	mOnStall = NULL;
+	mDeadCheckArg = NULL;
 }
 
 SP_DictShmHashMap :: ~SP_DictShmHashMap()
 {
+	delete mHandler;
 }
 
 size_t SP_DictShmHashMap :: getCount()
 {
-	return mCount;
+	return *mCount;
+}
+
+size_t SP_DictShmHashMap :: getActiveBucket()
+{
+	return *mActiveBucket;
+}
+
+size_t SP_DictShmHashMap :: loadActiveBucket()
+{
+	return mIsConcurrent ? SP_DictShmLock::load( mActiveBucket ) : *mActiveBucket;
+}
+
+size_t SP_DictShmHashMap :: copyEntry( size_t offset, const SP_DictShmHashMapEntry_t * entry,
+		void * buffer, size_t len )
+{
+	size_t itemSize = mAllocator->getItemSize( offset );
+	itemSize = itemSize > offsetof( SP_DictShmHashMapEntry_t, mPtr )
+			? itemSize - offsetof( SP_DictShmHashMapEntry_t, mPtr ) : 0;
+
+	size_t copyLen = entry->mLen;
+	if( copyLen > itemSize ) copyLen = itemSize;
+	if( copyLen > len ) copyLen = len;
+
+	if( copyLen > 0 ) memcpy( buffer, entry->mPtr, copyLen );
+
+	return copyLen;
+}
+
+size_t SP_DictShmHashMap :: getBucket( unsigned int hash, size_t activeBucket )
+{
+	size_t low = mBaseBucket;
+	for( ; low * 2 <= activeBucket; ) low *= 2;
+
+	size_t bucket = hash % ( low * 2 );
+
+	// not split yet
+	if( bucket >= activeBucket ) bucket = hash % low;
+
+	return bucket;
+}
+
+size_t SP_DictShmHashMap :: getBucket( unsigned int hash )
+{
+	return getBucket( hash, loadActiveBucket() );
+}
+
+size_t SP_DictShmHashMap :: getBucket( const void * keyItem )
+{
+	return getBucket( mHandler->hash( keyItem ) );
+}
+
+int SP_DictShmHashMap :: needSplit()
+{
+	size_t activeBucket = *mActiveBucket;
+
+	return activeBucket < mMaxBucket && *mCount > activeBucket * mMaxLoad ? 1 : 0;
+}
+
+int SP_DictShmHashMap :: getSplit( size_t * from, size_t * to )
+{
+	size_t activeBucket = loadActiveBucket();
+
+	if( activeBucket >= mMaxBucket ) return 0;
+
+	size_t low = mBaseBucket;
+	for( ; low * 2 <= activeBucket; ) low *= 2;
+
+	*from = activeBucket - low;
+	*to = activeBucket;
+
+	return 1;
+}
+
+void SP_DictShmHashMap :: split()
+{
+	size_t from = 0, to = 0;
+
+	if( ! getSplit( &from, &to ) ) return;
+
+	writeBegin( from );
+	writeBegin( to );
+
+	splitBucket( from, to, ( to - from ) * 2 );
+
+	// publish the new address of the moved entries
+	if( mIsConcurrent ) {
+		SP_DictShmLock::atomicAdd( mActiveBucket, 1 );
+	} else {
+		( *mActiveBucket )++;
+	}
+
+	writeEnd( to );
+	writeEnd( from );
+}
+
+void SP_DictShmHashMap :: writeBegin( size_t bucket )
+{
+	if( mIsConcurrent ) {
+		SP_DictShmLock::writeBegin( getSeq( bucket ) );
+	} else {
+		// no barrier, but the seq still tells the pinned views about the change
+		( *getSeq( bucket ) )++;
+	}
+}
+
+void SP_DictShmHashMap :: writeEnd( size_t bucket )
+{
+	if( mIsConcurrent ) {
+		SP_DictShmLock::writeEnd( getSeq( bucket ) );
+	} else {
+		( *getSeq( bucket ) )++;
+	}
+}
+
+void SP_DictShmHashMap :: repairSeq( size_t first, size_t step )
+{
+	// a split writes the bucket after the active ones, check them all
+	for( size_t i = first; i < mMaxBucket; i += step ) {
+		if( ( *getSeq( i ) ) & 1 ) writeEnd( i );
+	}
+}
+
+void SP_DictShmHashMap :: setDeadCheck( SP_DictShmLock::IsAliveFunc_t isAlive,
+		StallFunc_t onStall, void * arg )
+{
+	mIsAlive = isAlive;
+	mOnStall = onStall;
+	mDeadCheckArg = arg;
+}
+
+unsigned int SP_DictShmHashMap :: readBeginOrStall( unsigned int * seq, size_t bucket )
+{
+	unsigned int start = SP_DictShmLock::readBegin( seq, NULL != mOnStall );
+
+	if( start & 1 ) mOnStall( bucket, mDeadCheckArg );
+
+	return start;
+}
+
+unsigned int SP_DictShmHashMap :: readBegin( size_t bucket )
+{
+	return mIsConcurrent ? SP_DictShmLock::readBegin( getSeq( bucket ) ) : *getSeq( bucket );
 }
 
-void SP_DictShmHashMap :: put( SP_DictShmHashMapEntry_t * entry )
+int SP_DictShmHashMap :: readRetry( size_t bucket, unsigned int seq )
+{
+	if( mIsConcurrent ) return SP_DictShmLock::readRetry( getSeq( bucket ), seq );
+
+	return *getSeq( bucket ) != seq ? 1 : 0;
+}
+
+void SP_DictShmHashMap :: addCount( long delta )
+{
+	// the writers of different buckets update the count at the same time
+	if( mIsConcurrent ) {
+		SP_DictShmLock::atomicAdd( mCount, delta );
+	} else {
+		*mCount += delta;
+	}
+}
+
+//---------------------------------------------------------------------------
+
+SP_DictShmChainHashMap :: SP_DictShmChainHashMap( size_t * bucketList,
+		unsigned int * seqList, size_t baseBucket, size_t maxBucket, size_t * activeBucket,
+		const SP_DictShmAllocator * allocator, SP_DictShmHashMapHandler * handler,
+		size_t * count, int isConcurrent )
+	: SP_DictShmHashMap( baseBucket, maxBucket, activeBucket, MAX_LOAD,
+			allocator, handler, count, isConcurrent )
+{
+	mBucketList = bucketList;
+	mSeqList = seqList;
+}
+
+SP_DictShmChainHashMap :: ~SP_DictShmChainHashMap()
+{
+}
+
+unsigned int * SP_DictShmChainHashMap :: getSeq( size_t bucket )
+{
+	return mSeqList + bucket;
+}
+
+void SP_DictShmChainHashMap :: reset()
+{
+	memset( mBucketList, 0, sizeof( size_t ) * mMaxBucket );
+}
+
+void SP_DictShmChainHashMap :: put( SP_DictShmHashMapEntry_t * entry )
 {
 	size_t offset = mAllocator->getOffset( entry );
 
-	size_t bucket = mHandler->hash( entry->mPtr ) % mMaxBucket;
+	size_t bucket = getBucket( entry->mHash );
 	entry->mKeyNext = mBucketList[ bucket ];
 	mBucketList[ bucket ] = offset;
 
-	mCount++;
+	addCount( 1 );
 }
 
-SP_DictShmHashMapEntry_t * SP_DictShmHashMap :: get( const void * keyItem )
+SP_DictShmHashMapEntry_t * SP_DictShmChainHashMap :: get( const void * keyItem )
 {
 	SP_DictShmHashMapEntry_t * ret = NULL;
 
-	size_t bucket = mHandler->hash( keyItem ) % mMaxBucket;
+	unsigned int hash = mHandler->hash( keyItem );
+	size_t bucket = getBucket( hash );
 
 	for( size_t iter = mBucketList[ bucket ]; iter > 0; ) {
 		SP_DictShmHashMapEntry_t * entry = (SP_DictShmHashMapEntry_t*)mAllocator->getPtr( iter );
 
-		if( 0 == mHandler->compare( entry->mPtr, keyItem ) ) {
+		if( entry->mHash == hash && 0 == mHandler->compare( entry->mPtr, keyItem ) ) {
 			ret = entry;
 			break;
 		}
@@ -148,20 +380,21 @@ SP_DictShmHashMapEntry_t * SP_DictShmHashMap :: get( const void * keyItem )
 	return ret;
 }
 
-SP_DictShmHashMapEntry_t * SP_DictShmHashMap :: remove( const void * keyItem )
+SP_DictShmHashMapEntry_t * SP_DictShmChainHashMap :: remove( const void * keyItem )
 {
 	SP_DictShmHashMapEntry_t * ret = NULL;
 
-	int bucket = mHandler->hash( keyItem ) % mMaxBucket;
+	unsigned int hash = mHandler->hash( keyItem );
+	size_t bucket = getBucket( hash );
 
 	for( size_t * iter = &( mBucketList[ bucket ] ); *iter > 0; ) {
 		SP_DictShmHashMapEntry_t * entry = (SP_DictShmHashMapEntry_t*)mAllocator->getPtr( *iter );
 
-		if( 0 == mHandler->compare( entry->mPtr, keyItem ) ) {
+		if( entry->mHash == hash && 0 == mHandler->compare( entry->mPtr, keyItem ) ) {
 			ret = entry;
 			*iter = entry->mKeyNext;
 
-			mCount--;
+			addCount( -1 );
 
 			break;
 		}
@@ -172,3 +405,524 @@ SP_DictShmHashMapEntry_t * SP_DictShmHashMap :: remove( const void * keyItem )
 	return ret;
 }
 
+size_t SP_DictShmChainHashMap :: read( const void * keyItem, void * buffer,
+		size_t len, size_t * itemLen, time_t * expTime, size_t * leaseBucket, unsigned int * leaseSeq )
+{
+	assert( mIsConcurrent );
+
+	unsigned int hash = mHandler->hash( keyItem );
+
+	// a chain may be relinked under the reader, never walk more than all the records
+	size_t maxSteps = mAllocator->getMaxCount();
+
+	for( ; ; ) {
+		size_t found = 0;
+
+		size_t activeBucket = loadActiveBucket();
+		size_t bucket = getBucket( hash, activeBucket );
+
+		unsigned int seq = readBeginOrStall( mSeqList + bucket, bucket );
+		if( seq & 1 ) continue;
+
+		size_t iter = mBucketList[ bucket ];
+		for( size_t steps = 0; iter > 0 && steps < maxSteps; steps++ ) {
+			if( ! mAllocator->isValid( iter ) ) break;
+
+			SP_DictShmHashMapEntry_t * entry = (SP_DictShmHashMapEntry_t*)mAllocator->getPtr( iter );
+
+			if( entry->mHash == hash && 0 == mHandler->compare( entry->mPtr, keyItem ) ) {
+				*itemLen = copyEntry( iter, entry, buffer, len );
+				*expTime = entry->mExpTime;
+				found = iter;
+				break;
+			}
+
+			iter = entry->mKeyNext;
+		}
+
+		// a split may move the key between the snapshot and readBegin
+		if( ! SP_DictShmLock::readRetry( mSeqList + bucket, seq )
+				&& activeBucket == loadActiveBucket() ) {
+			if( NULL != leaseBucket ) *leaseBucket = bucket;
+			if( NULL != leaseSeq ) *leaseSeq = seq;
+
+			return found;
+		}
+	}
+}
+
+void SP_DictShmChainHashMap :: prefetchBucket( unsigned int hash )
+{
+#ifdef __GNUC__
+	size_t bucket = getBucket( hash );
+
+	__builtin_prefetch( mBucketList + bucket );
+	if( mIsConcurrent ) __builtin_prefetch( mSeqList + bucket );
+#endif
+}
+
+void SP_DictShmChainHashMap :: prefetchEntry( unsigned int hash )
+{
+#ifdef __GNUC__
+	// a prefetch never faults, a stale offset only wastes it
+	size_t offset = mBucketList[ getBucket( hash ) ];
+
+	if( offset > 0 ) __builtin_prefetch( mAllocator->getPtr( offset ) );
+#endif
+}
+
+void SP_DictShmChainHashMap :: splitBucket( size_t from, size_t to, size_t mod )
+{
+	for( size_t * iter = &( mBucketList[ from ] ); *iter > 0; ) {
+		size_t offset = *iter;
+
+		SP_DictShmHashMapEntry_t * entry = (SP_DictShmHashMapEntry_t*)mAllocator->getPtr( offset );
+
+		if( to == entry->mHash % mod ) {
+			*iter = entry->mKeyNext;
+			entry->mKeyNext = mBucketList[ to ];
+			mBucketList[ to ] = offset;
+		} else {
+			iter = &( entry->mKeyNext );
+		}
+	}
+}
+
+void SP_DictShmChainHashMap :: visit( VisitFunc_t visitFunc, void * arg )
+{
+	size_t activeBucket = getActiveBucket();
+
+	for( size_t i = 0; i < activeBucket; i++ ) {
+		for( size_t iter = mBucketList[i]; iter > 0; ) {
+			SP_DictShmHashMapEntry_t * entry = (SP_DictShmHashMapEntry_t*)mAllocator->getPtr( iter );
+
+			visitFunc( i, entry, arg );
+
+			iter = entry->mKeyNext;
+		}
+	}
+}
+
+size_t SP_DictShmChainHashMap :: selfCheck()
+{
+	set<size_t> entrySet;
+
+	size_t activeBucket = getActiveBucket();
+	assert( activeBucket >= mBaseBucket && activeBucket <= mMaxBucket );
+
+	// 0. the buckets which are not split yet must be empty
+	for( size_t i = activeBucket; i < mMaxBucket; i++ ) assert( 0 == mBucketList[i] );
+
+	for( size_t i = 0; i < activeBucket; i++ ) {
+		size_t iter = mBucketList[i];
+		for( ; iter > 0; ) {
+			// 1. check loop entry
+			set<size_t>::iterator it = entrySet.find( iter );
+			assert( entrySet.end() == it );
+			entrySet.insert( iter );
+
+			// 2. entry must been used
+			assert( mAllocator->isUsed( iter ) );
+
+			SP_DictShmHashMapEntry_t * entry = (SP_DictShmHashMapEntry_t*)mAllocator->getPtr( iter );
+
+			// 3. entry must been in its bucket, with its hash
+			assert( entry->mHash == mHandler->hash( entry->mPtr ) );
+			assert( i == getBucket( entry->mHash, activeBucket ) );
+
+			iter = entry->mKeyNext;
+		}
+	}
+
+	assert( entrySet.size() == getCount() );
+
+	return entrySet.size();
+}
+
+//---------------------------------------------------------------------------
+
+SP_DictShmTagHashMap :: SP_DictShmTagHashMap( SP_DictShmHashBucket_t * bucketList,
+		size_t baseBucket, size_t maxBucket, size_t * activeBucket,
+		size_t maxOverflow, size_t * overflowFree, unsigned int * overflowLock,
+		const SP_DictShmAllocator * allocator, SP_DictShmHashMapHandler * handler,
+		size_t * count, int isConcurrent )
+	: SP_DictShmHashMap( baseBucket, maxBucket, activeBucket, MAX_LOAD,
+			allocator, handler, count, isConcurrent )
+{
+	mBucketList = bucketList;
+	mOverflowList = bucketList + maxBucket;
+	mMaxOverflow = maxOverflow;
+	mOverflowFree = overflowFree;
+	mOverflowLock = overflowLock;
+}
+
+SP_DictShmTagHashMap :: ~SP_DictShmTagHashMap()
+{
+}
+
+size_t SP_DictShmTagHashMap :: getBucketLen( size_t maxBucket, size_t maxOverflow )
+{
+	return sizeof( SP_DictShmHashBucket_t ) * ( maxBucket + maxOverflow );
+}
+
+unsigned int * SP_DictShmTagHashMap :: getSeq( size_t bucket )
+{
+	return &( mBucketList[ bucket ].mSeq );
+}
+
+unsigned short SP_DictShmTagHashMap :: getTag( unsigned int hash )
+{
+	// the low bits choose the bucket
+	return (unsigned short)( hash >> 16 );
+}
+
+unsigned int SP_DictShmTagHashMap :: matchTags( const SP_DictShmHashBucket_t * bucket,
+		unsigned short tag )
+{
+	unsigned int count = bucket->mCount < 8 ? bucket->mCount : 8;
+
+	unsigned int mask = 0;
+
+#ifdef __SSE2__
+	__m128i tags = _mm_load_si128( (const __m128i*)bucket->mTags );
+	unsigned int bytes = _mm_movemask_epi8( _mm_cmpeq_epi16( tags, _mm_set1_epi16( tag ) ) );
+
+	// two mask bits per tag, keep one
+	for( unsigned int i = 0; i < count; i++ ) {
+		if( bytes & ( 1 << ( i * 2 ) ) ) mask |= 1 << i;
+	}
+#else
+	for( unsigned int i = 0; i < count; i++ ) {
+		if( bucket->mTags[i] == tag ) mask |= 1 << i;
+	}
+#endif
+
+	return mask;
+}
+
+SP_DictShmHashBucket_t * SP_DictShmTagHashMap :: getNext( const SP_DictShmHashBucket_t * bucket )
+{
+	unsigned int next = bucket->mNext;
+
+	return ( next > 0 && next <= mMaxOverflow ) ? mOverflowList + next - 1 : NULL;
+}
+
+void SP_DictShmTagHashMap :: reset()
+{
+	for( size_t i = 0; i < mMaxBucket; i++ ) {
+		// keep the seqlock, the caller may be in writeBegin
+		unsigned int seq = mBucketList[i].mSeq;
+		memset( mBucketList + i, 0, sizeof( SP_DictShmHashBucket_t ) );
+		mBucketList[i].mSeq = seq;
+	}
+
+	for( size_t i = 0; i < mMaxOverflow; i++ ) {
+		memset( mOverflowList + i, 0, sizeof( SP_DictShmHashBucket_t ) );
+		mOverflowList[i].mNext = i + 1 < mMaxOverflow ? i + 2 : 0;
+	}
+
+	*mOverflowFree = mMaxOverflow > 0 ? 1 : 0;
+}
+
+SP_DictShmHashBucket_t * SP_DictShmTagHashMap :: allocOverflow()
+{
+	if( mIsConcurrent ) SP_DictShmLock::lock( mOverflowLock, mIsAlive, mDeadCheckArg );
+
+	SP_DictShmHashBucket_t * ret = NULL;
+
+	if( *mOverflowFree > 0 ) {
+		ret = mOverflowList + *mOverflowFree - 1;
+		*mOverflowFree = ret->mNext;
+
+		memset( ret, 0, sizeof( SP_DictShmHashBucket_t ) );
+	}
+
+	if( mIsConcurrent ) SP_DictShmLock::unlock( mOverflowLock );
+
+	return ret;
+}
+
+void SP_DictShmTagHashMap :: freeOverflow( SP_DictShmHashBucket_t * bucket )
+{
+	if( mIsConcurrent ) SP_DictShmLock::lock( mOverflowLock, mIsAlive, mDeadCheckArg );
+
+	bucket->mCount = 0;
+	bucket->mNext = *mOverflowFree;
+	*mOverflowFree = bucket - mOverflowList + 1;
+
+	if( mIsConcurrent ) SP_DictShmLock::unlock( mOverflowLock );
+}
+
+SP_DictShmHashBucket_t * SP_DictShmTagHashMap :: find( const void * keyItem,
+		unsigned int hash, int * slot )
+{
+	unsigned short tag = getTag( hash );
+
+	SP_DictShmHashBucket_t * bucket = mBucketList + getBucket( hash );
+
+	for( ; NULL != bucket; bucket = getNext( bucket ) ) {
+		for( unsigned int mask = matchTags( bucket, tag ); 0 != mask; mask &= mask - 1 ) {
+			int i = 0;
+			for( ; 0 == ( mask & ( 1 << i ) ); ) i++;
+
+			SP_DictShmHashMapEntry_t * entry = (SP_DictShmHashMapEntry_t*)
+					mAllocator->getPtr( (size_t)bucket->mOffsets[i] << 3 );
+
+			if( entry->mHash == hash && 0 == mHandler->compare( entry->mPtr, keyItem ) ) {
+				*slot = i;
+				return bucket;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+void SP_DictShmTagHashMap :: put( SP_DictShmHashMapEntry_t * entry )
+{
+	size_t offset = mAllocator->getOffset( entry );
+	assert( 0 == ( offset & 7 ) && ( offset >> 3 ) <= 0xFFFFFFFFUL );
+
+	append( getBucket( entry->mHash ), getTag( entry->mHash ), (unsigned int)( offset >> 3 ) );
+
+	addCount( 1 );
+}
+
+void SP_DictShmTagHashMap :: append( size_t home, unsigned short tag, unsigned int offset )
+{
+	SP_DictShmHashBucket_t * bucket = mBucketList + home;
+
+	for( SP_DictShmHashBucket_t * next = getNext( bucket ); NULL != next; next = getNext( next ) ) {
+		bucket = next;
+	}
+
+	if( bucket->mCount >= 8 ) {
+		SP_DictShmHashBucket_t * overflow = allocOverflow();
+
+		// there are always enough overflow buckets for all the records
+		assert( NULL != overflow );
+
+		bucket->mNext = overflow - mOverflowList + 1;
+		bucket = overflow;
+	}
+
+	bucket->mTags[ bucket->mCount ] = tag;
+	bucket->mOffsets[ bucket->mCount ] = offset;
+	bucket->mCount++;
+}
+
+SP_DictShmHashMapEntry_t * SP_DictShmTagHashMap :: get( const void * keyItem )
+{
+	int slot = 0;
+
+	SP_DictShmHashBucket_t * bucket = find( keyItem, mHandler->hash( keyItem ), &slot );
+
+	if( NULL == bucket ) return NULL;
+
+	return (SP_DictShmHashMapEntry_t*)mAllocator->getPtr( (size_t)bucket->mOffsets[ slot ] << 3 );
+}
+
+SP_DictShmHashMapEntry_t * SP_DictShmTagHashMap :: remove( const void * keyItem )
+{
+	unsigned int hash = mHandler->hash( keyItem );
+
+	int slot = 0;
+	SP_DictShmHashBucket_t * bucket = find( keyItem, hash, &slot );
+
+	if( NULL == bucket ) return NULL;
+
+	SP_DictShmHashMapEntry_t * ret = (SP_DictShmHashMapEntry_t*)
+			mAllocator->getPtr( (size_t)bucket->mOffsets[ slot ] << 3 );
+
+	// fill the hole with the last slot of the chain, keep the chain compact
+	SP_DictShmHashBucket_t * prev = NULL, * last = mBucketList + getBucket( hash );
+	for( SP_DictShmHashBucket_t * next = getNext( last ); NULL != next; next = getNext( next ) ) {
+		prev = last;
+		last = next;
+	}
+
+	last->mCount--;
+	bucket->mTags[ slot ] = last->mTags[ last->mCount ];
+	bucket->mOffsets[ slot ] = last->mOffsets[ last->mCount ];
+
+	if( 0 == last->mCount && NULL != prev ) {
+		prev->mNext = 0;
+		freeOverflow( last );
+	}
+
+	addCount( -1 );
+
+	return ret;
+}
+
+size_t SP_DictShmTagHashMap :: read( const void * keyItem, void * buffer,
+		size_t len, size_t * itemLen, time_t * expTime, size_t * leaseBucket, unsigned int * leaseSeq )
+{
+	assert( mIsConcurrent );
+
+	unsigned int hash = mHandler->hash( keyItem );
+	unsigned short tag = getTag( hash );
+
+	for( ; ; ) {
+		size_t found = 0;
+
+		size_t activeBucket = loadActiveBucket();
+		SP_DictShmHashBucket_t * home = mBucketList + getBucket( hash, activeBucket );
+
+		unsigned int seq = readBeginOrStall( &( home->mSeq ), home - mBucketList );
+		if( seq & 1 ) continue;
+
+		// a chain may be relinked under the reader, never walk more than all the buckets
+		SP_DictShmHashBucket_t * bucket = home;
+		for( size_t steps = 0; NULL != bucket && steps <= mMaxOverflow && ! found; steps++ ) {
+			for( unsigned int mask = matchTags( bucket, tag ); 0 != mask; mask &= mask - 1 ) {
+				int i = 0;
+				for( ; 0 == ( mask & ( 1 << i ) ); ) i++;
+
+				size_t offset = (size_t)bucket->mOffsets[i] << 3;
+				if( ! mAllocator->isValid( offset ) ) continue;
+
+				SP_DictShmHashMapEntry_t * entry = (SP_DictShmHashMapEntry_t*)mAllocator->getPtr( offset );
+
+				if( entry->mHash == hash && 0 == mHandler->compare( entry->mPtr, keyItem ) ) {
+					*itemLen = copyEntry( offset, entry, buffer, len );
+					*expTime = entry->mExpTime;
+					found = offset;
+					break;
+				}
+			}
+
+			bucket = getNext( bucket );
+		}
+
+		// a split may move the key between the snapshot and readBegin
+		if( ! SP_DictShmLock::readRetry( &( home->mSeq ), seq )
+				&& activeBucket == loadActiveBucket() ) {
+			if( NULL != leaseBucket ) *leaseBucket = home - mBucketList;
+			if( NULL != leaseSeq ) *leaseSeq = seq;
+
+			return found;
+		}
+	}
+}
+
+void SP_DictShmTagHashMap :: prefetchBucket( unsigned int hash )
+{
+#ifdef __GNUC__
+	__builtin_prefetch( mBucketList + getBucket( hash ) );
+#endif
+}
+
+void SP_DictShmTagHashMap :: prefetchEntry( unsigned int hash )
+{
+#ifdef __GNUC__
+	// only the home bucket, the records whose tag matches
+	SP_DictShmHashBucket_t * home = mBucketList + getBucket( hash );
+
+	for( unsigned int mask = matchTags( home, getTag( hash ) ); 0 != mask; mask &= mask - 1 ) {
+		int i = 0;
+		for( ; 0 == ( mask & ( 1 << i ) ); ) i++;
+
+		__builtin_prefetch( mAllocator->getPtr( (size_t)home->mOffsets[i] << 3 ) );
+	}
+#endif
+}
+
+void SP_DictShmTagHashMap :: splitBucket( size_t from, size_t to, size_t mod )
+{
+	SP_DictShmHashBucket_t * home = mBucketList + from;
+
+	vector< pair< unsigned short, unsigned int > > slotList;
+
+	for( SP_DictShmHashBucket_t * bucket = home; NULL != bucket; bucket = getNext( bucket ) ) {
+		for( unsigned int i = 0; i < bucket->mCount; i++ ) {
+			slotList.push_back( make_pair( bucket->mTags[i], bucket->mOffsets[i] ) );
+		}
+	}
+
+	// empty the chain first, the two chains never need more overflow buckets than it
+	for( SP_DictShmHashBucket_t * bucket = getNext( home ); NULL != bucket; ) {
+		SP_DictShmHashBucket_t * next = getNext( bucket );
+		freeOverflow( bucket );
+		bucket = next;
+	}
+
+	home->mCount = 0;
+	home->mNext = 0;
+
+	for( size_t i = 0; i < slotList.size(); i++ ) {
+		SP_DictShmHashMapEntry_t * entry = (SP_DictShmHashMapEntry_t*)
+				mAllocator->getPtr( (size_t)slotList[i].second << 3 );
+
+		append( to == entry->mHash % mod ? to : from, slotList[i].first, slotList[i].second );
+	}
+}
+
+void SP_DictShmTagHashMap :: visit( VisitFunc_t visitFunc, void * arg )
+{
+	size_t activeBucket = getActiveBucket();
+
+	for( size_t i = 0; i < activeBucket; i++ ) {
+		for( SP_DictShmHashBucket_t * bucket = mBucketList + i; NULL != bucket;
+				bucket = getNext( bucket ) ) {
+			for( unsigned int j = 0; j < bucket->mCount; j++ ) {
+				visitFunc( i, (SP_DictShmHashMapEntry_t*)mAllocator->getPtr(
+						(size_t)bucket->mOffsets[j] << 3 ), arg );
+			}
+		}
+	}
+}
+
+size_t SP_DictShmTagHashMap :: selfCheck()
+{
+	set<size_t> entrySet;
+	size_t overflowCount = 0;
+
+	size_t activeBucket = getActiveBucket();
+	assert( activeBucket >= mBaseBucket && activeBucket <= mMaxBucket );
+
+	// 0. the buckets which are not split yet must be empty
+	for( size_t i = activeBucket; i < mMaxBucket; i++ ) {
+		assert( 0 == mBucketList[i].mCount && 0 == mBucketList[i].mNext );
+	}
+
+	for( size_t i = 0; i < activeBucket; i++ ) {
+		for( SP_DictShmHashBucket_t * bucket = mBucketList + i; NULL != bucket;
+				bucket = getNext( bucket ) ) {
+			// 1. only the last bucket of a chain has free slots
+			assert( bucket->mCount <= 8 );
+			if( 0 != bucket->mNext ) assert( 8 == bucket->mCount );
+			if( bucket != mBucketList + i ) overflowCount++;
+
+			for( unsigned int j = 0; j < bucket->mCount; j++ ) {
+				size_t offset = (size_t)bucket->mOffsets[j] << 3;
+
+				// 2. check duplicate entry
+				assert( entrySet.end() == entrySet.find( offset ) );
+				entrySet.insert( offset );
+
+				// 3. entry must been used
+				assert( mAllocator->isUsed( offset ) );
+
+				// 4. entry must been in its bucket, with its tag
+				SP_DictShmHashMapEntry_t * entry = (SP_DictShmHashMapEntry_t*)mAllocator->getPtr( offset );
+				assert( entry->mHash == mHandler->hash( entry->mPtr ) );
+				assert( i == getBucket( entry->mHash, activeBucket ) );
+				assert( getTag( entry->mHash ) == bucket->mTags[j] );
+			}
+		}
+	}
+
+	// 5. every overflow bucket is in a chain or in the free list
+	size_t freeCount = 0;
+	for( size_t iter = *mOverflowFree; iter > 0; iter = mOverflowList[ iter - 1 ].mNext ) {
+		assert( iter <= mMaxOverflow );
+		freeCount++;
+	}
+	assert( freeCount + overflowCount == mMaxOverflow );
+
+	assert( entrySet.size() == getCount() );
+
+	return entrySet.size();
+}
+
@@ -7,6 +7,9 @@
 #define __spdictshmhashmap_hpp__
 
 #include <sys/types.h>
+#include <time.h>
+
+#include "spdictshmlock.hpp"
 
 class SP_DictShmAllocator;
 
@@ -24,14 +27,17 @@ typedef struct tagSP_DictShmHashMapEntry {
 	size_t mEvictPrev, mEvictNext;
 	size_t mKeyNext;
 	unsigned long int mCheckSum;
+	unsigned int mHash;  // handler hash of mPtr, compare() is only called on a match
+	unsigned int mLen;   // bytes of mPtr
 	time_t mExpTime;
 	char mPtr[1];
 } SP_DictShmHashMapEntry_t;
 
 class SP_DictShmHashMapEntryList {
 public:
+	// cursorList : the next entries of cursorCount walkers, remove and update move them past the entry
 	SP_DictShmHashMapEntryList( size_t * evictHeader, size_t * evictTail,
-			const SP_DictShmAllocator * allocator );
+			const SP_DictShmAllocator * allocator, size_t * cursorList = NULL, int cursorCount = 0 );
 	~SP_DictShmHashMapEntryList();
 
 	SP_DictShmHashMapEntry_t * getHead();
@@ -42,34 +48,267 @@ public:
 
 	void update( SP_DictShmHashMapEntry_t * entry );
 
+	// a writer was killed, relink the list from the head, maxCount : the records in the list at most
+	void repair( size_t maxCount );
+
 private:
 	const SP_DictShmAllocator * mAllocator;
 
 	size_t * mEvictHeader;
 	size_t * mEvictTail;
+	size_t * mCursorList;
+	int mCursorCount;
 };
 
+/**
+ * Linear hashing : the table starts with baseBucket buckets, and grows one
+ * bucket at a time up to maxBucket. A split moves the entries of bucket
+ * ( active - low ) which belong to bucket active, so the old and the new
+ * addresses of a key never change at the same time for other buckets.
+ */
 class SP_DictShmHashMap {
 public:
-	SP_DictShmHashMap( size_t * bucketList, size_t maxBucket,
-			const SP_DictShmAllocator * allocator, SP_DictShmHashMapHandler * handler );
-	~SP_DictShmHashMap();
+	/**
+	 * @param activeBucket : count of the buckets in use, it lives in the mmap file
+	 * @param maxLoad : split a bucket when count > activeBucket * maxLoad
+	 * @param count : the item count, it lives in the mmap file
+	 * @param isConcurrent : 1 : keep the seqlocks for the lock-free readers
+	 */
+	SP_DictShmHashMap( size_t baseBucket, size_t maxBucket, size_t * activeBucket,
+			size_t maxLoad, const SP_DictShmAllocator * allocator,
+			SP_DictShmHashMapHandler * handler, size_t * count, int isConcurrent );
+	virtual ~SP_DictShmHashMap();
 
 	size_t getCount();
 
-	void put( SP_DictShmHashMapEntry_t * entry );
+	size_t getActiveBucket();
 
-	SP_DictShmHashMapEntry_t * get( const void * keyItem );
+	size_t getBucket( const void * keyItem );
 
-	SP_DictShmHashMapEntry_t * remove( const void * keyItem );
+	size_t getBucket( unsigned int hash );
+
+	// @return 1 : the load factor is too high and the table can grow
+	int needSplit();
+
+	// @return 0 : the table is full, 1 : the next split moves from into to
+	int getSplit( size_t * from, size_t * to );
+
+	// split the next bucket, the caller must hold the locks of both buckets
+	void split();
+
+	// writers must hold the lock of the bucket, and wrap the changes
+	// of the bucket and of its items in writeBegin/writeEnd
+	void writeBegin( size_t bucket );
+	void writeEnd( size_t bucket );
+
+	// end the writes of the writers which were killed, the caller holds the
+	// locks of the buckets first, first + step, first + 2 * step ...
+	void repairSeq( size_t first = 0, size_t step = 1 );
+
+	// a lock-free reader waits too long for the writer of the bucket, which may be killed
+	typedef void ( * StallFunc_t ) ( size_t bucket, void * arg );
+
+	// the checks of the killed writers, isAlive is for the locks of the hashmap itself
+	void setDeadCheck( SP_DictShmLock::IsAliveFunc_t isAlive, StallFunc_t onStall, void * arg );
+
+	// @return the seq of the bucket, every write of the bucket or of its items changes it
+	unsigned int readBegin( size_t bucket );
+
+	// @return 1 : the bucket was written after readBegin
+	int readRetry( size_t bucket, unsigned int seq );
+
+	// clear all the buckets
+	virtual void reset() = 0;
+
+	// entry->mHash must be set
+	virtual void put( SP_DictShmHashMapEntry_t * entry ) = 0;
+
+	virtual SP_DictShmHashMapEntry_t * get( const void * keyItem ) = 0;
+
+	virtual SP_DictShmHashMapEntry_t * remove( const void * keyItem ) = 0;
+
+	/**
+	 * lock-free lookup, copy the item out under the seqlock of the bucket,
+	 * it never writes the mmap file
+	 *
+	 * @param len : bytes of buffer, itemLen gets the bytes copied
+	 * @param leaseBucket, leaseSeq : the bucket and its seq when the record was
+	 *   found, readRetry( leaseBucket, leaseSeq ) tells if it may be changed since
+	 * @return 0 : no such key, > 0 : offset of the record
+	 */
+	virtual size_t read( const void * keyItem, void * buffer, size_t len,
+			size_t * itemLen, time_t * expTime,
+			size_t * leaseBucket = NULL, unsigned int * leaseSeq = NULL ) = 0;
+
+	// a batch lookup prefetches the buckets of all the keys, then their first records,
+	// they only read the buckets, a racy read is harmless
+	virtual void prefetchBucket( unsigned int hash ) = 0;
+	virtual void prefetchEntry( unsigned int hash ) = 0;
+
+	typedef void ( * VisitFunc_t ) ( size_t bucket, SP_DictShmHashMapEntry_t * entry, void * arg );
+
+	virtual void visit( VisitFunc_t visitFunc, void * arg ) = 0;
+
+	// assert the buckets are consistent, @return count of the items in the buckets
+	virtual size_t selfCheck() = 0;
+
+protected:
+	virtual unsigned int * getSeq( size_t bucket ) = 0;
+
+	// move the entries of from whose hash % mod is to
+	virtual void splitBucket( size_t from, size_t to, size_t mod ) = 0;
+
+	void addCount( long delta );
+
+	// bucket of the hash for the given active bucket count
+	size_t getBucket( unsigned int hash, size_t activeBucket );
+
+	// the lock-free readers take a snapshot, and retry if it changes
+	size_t loadActiveBucket();
+
+	// copy a record which may be written at the same time, never past the record
+	// @return bytes copied
+	size_t copyEntry( size_t offset, const SP_DictShmHashMapEntry_t * entry,
+			void * buffer, size_t len );
+
+	// readBegin of the lock-free readers, @return odd : call onStall and retry
+	unsigned int readBeginOrStall( unsigned int * seq, size_t bucket );
 
-private:
 	const SP_DictShmAllocator * mAllocator;
 	SP_DictShmHashMapHandler * mHandler;
-	size_t mCount;
+	size_t * mCount;
+	size_t mBaseBucket, mMaxBucket, mMaxLoad;
+	size_t * mActiveBucket;
+	int mIsConcurrent;
+
+	SP_DictShmLock::IsAliveFunc_t mIsAlive;
+	StallFunc_t mOnStall;
+	void * mDeadCheckArg;
+};
+
+// one offset per bucket, the entries of a bucket are chained by mKeyNext
+class SP_DictShmChainHashMap : public SP_DictShmHashMap {
+public:
+	enum { MAX_LOAD = 1 };
+
+	// @param seqList : one seqlock word per bucket
+	SP_DictShmChainHashMap( size_t * bucketList, unsigned int * seqList,
+			size_t baseBucket, size_t maxBucket, size_t * activeBucket,
+			const SP_DictShmAllocator * allocator, SP_DictShmHashMapHandler * handler,
+			size_t * count, int isConcurrent );
+	virtual ~SP_DictShmChainHashMap();
+
+	virtual void reset();
+
+	virtual void put( SP_DictShmHashMapEntry_t * entry );
 
+	virtual SP_DictShmHashMapEntry_t * get( const void * keyItem );
+
+	virtual SP_DictShmHashMapEntry_t * remove( const void * keyItem );
+
+	virtual size_t read( const void * keyItem, void * buffer, size_t len,
+			size_t * itemLen, time_t * expTime,
+			size_t * leaseBucket = NULL, unsigned int * leaseSeq = NULL );
+
+	virtual void prefetchBucket( unsigned int hash );
+	virtual void prefetchEntry( unsigned int hash );
+
+	virtual void visit( VisitFunc_t visitFunc, void * arg );
+
+	virtual size_t selfCheck();
+
+protected:
+	virtual unsigned int * getSeq( size_t bucket );
+
+	virtual void splitBucket( size_t from, size_t to, size_t mod );
+
+private:
 	size_t * mBucketList;
-	size_t mMaxBucket;
+	unsigned int * mSeqList;
+};
+
+// a cache line of ( hash tag, record offset ) pairs
+typedef struct tagSP_DictShmHashBucket {
+	unsigned short mTags[ 8 ];
+	unsigned int mOffsets[ 8 ];  // record offset >> 3
+	unsigned int mNext;          // 1 + index of the overflow bucket, 0 : the last one
+	unsigned int mCount;         // mTags/mOffsets [ 0, mCount ) are used
+	unsigned int mSeq;           // seqlock of the chain, only used in the home bucket
+	unsigned int mReserved;
+} SP_DictShmHashBucket_t;
+
+/**
+ * The home buckets are followed by a pool of overflow buckets. Every bucket
+ * in a chain is full except the last one, so maxRecords / 8 overflow buckets
+ * are always enough. A lookup compares the tags of a bucket at once, and
+ * only calls compare() for the records whose tag matches.
+ */
+class SP_DictShmTagHashMap : public SP_DictShmHashMap {
+public:
+	enum { MAX_LOAD = 6 };
+
+	/**
+	 * @param overflowFree : head of the free overflow buckets, it lives in the mmap file
+	 * @param overflowLock : guards the overflow buckets if isConcurrent
+	 */
+	SP_DictShmTagHashMap( SP_DictShmHashBucket_t * bucketList,
+			size_t baseBucket, size_t maxBucket, size_t * activeBucket,
+			size_t maxOverflow, size_t * overflowFree, unsigned int * overflowLock,
+			const SP_DictShmAllocator * allocator, SP_DictShmHashMapHandler * handler,
+			size_t * count, int isConcurrent );
+	virtual ~SP_DictShmTagHashMap();
+
+	virtual void reset();
+
+	virtual void put( SP_DictShmHashMapEntry_t * entry );
+
+	virtual SP_DictShmHashMapEntry_t * get( const void * keyItem );
+
+	virtual SP_DictShmHashMapEntry_t * remove( const void * keyItem );
+
+	virtual size_t read( const void * keyItem, void * buffer, size_t len,
+			size_t * itemLen, time_t * expTime,
+			size_t * leaseBucket = NULL, unsigned int * leaseSeq = NULL );
+
+	virtual void prefetchBucket( unsigned int hash );
+	virtual void prefetchEntry( unsigned int hash );
+
+	virtual void visit( VisitFunc_t visitFunc, void * arg );
+
+	virtual size_t selfCheck();
+
+	// @return bytes of the buckets, including the overflow buckets
+	static size_t getBucketLen( size_t maxBucket, size_t maxOverflow );
+
+protected:
+	virtual unsigned int * getSeq( size_t bucket );
+
+	virtual void splitBucket( size_t from, size_t to, size_t mod );
+
+private:
+	static unsigned short getTag( unsigned int hash );
+
+	// append to the last bucket of the chain
+	void append( size_t bucket, unsigned short tag, unsigned int offset );
+
+	// @return bitmask of the used slots whose tag matches
+	static unsigned int matchTags( const SP_DictShmHashBucket_t * bucket, unsigned short tag );
+
+	// @return the next bucket of the chain, NULL for the last one
+	SP_DictShmHashBucket_t * getNext( const SP_DictShmHashBucket_t * bucket );
+
+	// @return NULL : not found, NOT NULL : the bucket and the slot of the key
+	SP_DictShmHashBucket_t * find( const void * keyItem, unsigned int hash, int * slot );
+
+	SP_DictShmHashBucket_t * allocOverflow();
+
+	void freeOverflow( SP_DictShmHashBucket_t * bucket );
+
+	SP_DictShmHashBucket_t * mBucketList;
+	SP_DictShmHashBucket_t * mOverflowList;
+	size_t mMaxOverflow;
+	size_t * mOverflowFree;
+	unsigned int * mOverflowLock;
 };
 
 #endif
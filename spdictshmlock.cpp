@@ -0,0 +1,188 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef WIN32
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#else
+#include <windows.h>
+#endif
+
+#include "spdictshmlock.hpp"
+
+#ifndef WIN32
+#define SP_ATOMIC_ADD(ptr,delta)   __sync_add_and_fetch(ptr,delta)
+#define SP_MEMORY_BARRIER()        __sync_synchronize()
+#define SP_ATOMIC_CAS(ptr,oldValue,newValue)   __sync_bool_compare_and_swap(ptr,oldValue,newValue)
+#define SP_ATOMIC_CAS32(ptr,oldValue,newValue) __sync_bool_compare_and_swap(ptr,oldValue,newValue)
+#define SP_ATOMIC_CAS64(ptr,oldValue,newValue) __sync_bool_compare_and_swap(ptr,oldValue,newValue)
+#else
+#define SP_ATOMIC_ADD(ptr,delta)   ( InterlockedExchangeAdd((volatile LONG*)(ptr),delta) + (delta) )
+#define SP_MEMORY_BARRIER()        MemoryBarrier()
+#ifdef _WIN64
+#define SP_ATOMIC_CAS(ptr,oldValue,newValue) \
+	( (LONGLONG)(oldValue) == InterlockedCompareExchange64((volatile LONGLONG*)(ptr),newValue,oldValue) )
+#else
+#define SP_ATOMIC_CAS(ptr,oldValue,newValue) \
+	( (LONG)(oldValue) == InterlockedCompareExchange((volatile LONG*)(ptr),newValue,oldValue) )
+#endif
+#define SP_ATOMIC_CAS32(ptr,oldValue,newValue) \
+	( (LONG)(oldValue) == InterlockedCompareExchange((volatile LONG*)(ptr),newValue,oldValue) )
+#define SP_ATOMIC_CAS64(ptr,oldValue,newValue) \
+	( (LONGLONG)(oldValue) == InterlockedCompareExchange64((volatile LONGLONG*)(ptr),newValue,oldValue) )
+#endif
+
+static volatile unsigned int g_selfPid = 0;
+
+static volatile unsigned int g_takeOverCount = 0;
+
+#ifndef WIN32
+static pthread_once_t g_selfOnce = PTHREAD_ONCE_INIT;
+
+// a forked child gets a new pid
+static void resetSelfPid()
+{
+	g_selfPid = 0;
+}
+
+static void registerSelfPid()
+{
+	pthread_atfork( NULL, NULL, resetSelfPid );
+}
+#endif
+
+unsigned int SP_DictShmLock :: getSelf()
+{
+	unsigned int self = g_selfPid;
+
+	if( 0 == self ) {
+#ifndef WIN32
+		pthread_once( &g_selfOnce, registerSelfPid );
+		self = (unsigned int)getpid();
+#else
+		self = (unsigned int)GetCurrentProcessId();
+#endif
+		g_selfPid = self;
+	}
+
+	return self;
+}
+
+void SP_DictShmLock :: yield()
+{
+#ifndef WIN32
+	sched_yield();
+#else
+	Sleep( 0 );
+#endif
+}
+
+int SP_DictShmLock :: lock( volatile unsigned int * word, IsAliveFunc_t isAlive, void * arg )
+{
+	unsigned int self = getSelf();
+
+	for( int spins = 0, yields = 0; ! SP_ATOMIC_CAS32( word, 0, self ); ) {
+		// spin on a plain read, it doesn't steal the cache line from the owner
+		for( unsigned int owner = *word; 0 != owner; owner = *word ) {
+			if( ++spins <= MAX_SPINS ) continue;
+
+			yield();
+			spins = 0;
+
+			if( NULL == isAlive || ++yields < CHECK_YIELDS ) continue;
+
+			yields = 0;
+
+			// only one waiter gets it, the others wait for it to repair and unlock
+			if( ! isAlive( owner, arg ) && SP_ATOMIC_CAS32( word, owner, self ) ) {
+				SP_ATOMIC_ADD( &g_takeOverCount, 1 );
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int SP_DictShmLock :: tryLock( volatile unsigned int * word )
+{
+	if( 0 != *word ) return 0;
+
+	return SP_ATOMIC_CAS32( word, 0, getSelf() ) ? 1 : 0;
+}
+
+void SP_DictShmLock :: unlock( volatile unsigned int * word )
+{
+	SP_MEMORY_BARRIER();
+	*word = 0;
+}
+
+unsigned int SP_DictShmLock :: getTakeOverCount()
+{
+	return g_takeOverCount;
+}
+
+void SP_DictShmLock :: writeBegin( volatile unsigned int * seq )
+{
+	// odd while the writer is active, the atomic add is a full barrier
+	SP_ATOMIC_ADD( seq, 1 );
+}
+
+void SP_DictShmLock :: writeEnd( volatile unsigned int * seq )
+{
+	SP_ATOMIC_ADD( seq, 1 );
+}
+
+unsigned int SP_DictShmLock :: readBegin( volatile unsigned int * seq, int isBounded )
+{
+	unsigned int start = *seq;
+
+	for( int spins = 0, yields = 0; start & 1; start = *seq ) {
+		if( ++spins > MAX_SPINS ) {
+			if( isBounded && ++yields >= CHECK_YIELDS ) return start;
+
+			yield();
+			spins = 0;
+		}
+	}
+
+	SP_MEMORY_BARRIER();
+
+	return start;
+}
+
+int SP_DictShmLock :: readRetry( volatile unsigned int * seq, unsigned int start )
+{
+	SP_MEMORY_BARRIER();
+
+	return *seq != start ? 1 : 0;
+}
+
+size_t SP_DictShmLock :: atomicAdd( volatile size_t * value, long delta )
+{
+	return SP_ATOMIC_ADD( value, delta );
+}
+
+size_t SP_DictShmLock :: load( volatile size_t * value )
+{
+	size_t ret = *value;
+
+	SP_MEMORY_BARRIER();
+
+	return ret;
+}
+
+int SP_DictShmLock :: compareAndSwap( volatile size_t * value, size_t oldValue, size_t newValue )
+{
+	return SP_ATOMIC_CAS( value, oldValue, newValue ) ? 1 : 0;
+}
+
+int SP_DictShmLock :: compareAndSwap( volatile unsigned long long * value,
+		unsigned long long oldValue, unsigned long long newValue )
+{
+	return SP_ATOMIC_CAS64( value, oldValue, newValue ) ? 1 : 0;
+}
+
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __spdictshmlock_hpp__
+#define __spdictshmlock_hpp__
+
+#include <sys/types.h>
+
+/**
+ * The lock words live in the mmap file, they are shared by all the attached
+ * processes. A held lock word is the pid of its owner, the lock of an owner
+ * which is killed is never released by itself, a waiter finds the dead owner
+ * and takes the lock over, it repairs the data of the lock before unlock.
+ */
+class SP_DictShmLock {
+public:
+
+	// @return 0 : the owner of the lock is killed, 1 : it may be running
+	typedef int ( * IsAliveFunc_t ) ( unsigned int owner, void * arg );
+
+	/**
+	 * spinlock of the current process, yields the cpu after spinning for a
+	 * while, and asks isAlive about the owner every CHECK_YIELDS yields
+	 *
+	 * @return 0 : got the lock, 1 : took it over from a dead owner, the data
+	 *   of the lock may be half written
+	 */
+	static int lock( volatile unsigned int * word, IsAliveFunc_t isAlive = 0, void * arg = 0 );
+
+	// @return 1 : got the lock, 0 : the lock is busy
+	static int tryLock( volatile unsigned int * word );
+
+	static void unlock( volatile unsigned int * word );
+
+	// count of the locks this process took over from dead owners
+	static unsigned int getTakeOverCount();
+
+	// seqlock writer side, the caller must hold the lock of the data
+	static void writeBegin( volatile unsigned int * seq );
+
+	static void writeEnd( volatile unsigned int * seq );
+
+	/**
+	 * seqlock reader side, waits while a writer is active
+	 *
+	 * @param isBounded : 1 : give up after CHECK_YIELDS yields, the writer may be killed
+	 * @return the seq, odd : gave up
+	 */
+	static unsigned int readBegin( volatile unsigned int * seq, int isBounded = 0 );
+
+	// @return 1 : a writer came in after readBegin, the data may be torn
+	static int readRetry( volatile unsigned int * seq, unsigned int start );
+
+	// @return the new value
+	static size_t atomicAdd( volatile size_t * value, long delta );
+
+	// read a word written by atomicAdd, the later reads are not moved before it
+	static size_t load( volatile size_t * value );
+
+	// @return 1 : value was oldValue and is newValue now, 0 : value is changed by others
+	static int compareAndSwap( volatile size_t * value, size_t oldValue, size_t newValue );
+
+	static int compareAndSwap( volatile unsigned long long * value,
+			unsigned long long oldValue, unsigned long long newValue );
+
+private:
+	enum { MAX_SPINS = 1024, CHECK_YIELDS = 64 };
+
+	static void yield();
+
+	// @return pid of the current process, cached until a fork
+	static unsigned int getSelf();
+};
+
+#endif
+
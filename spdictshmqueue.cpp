@@ -110,26 +110,40 @@ SP_DictShmQueue :: SP_DictShmQueue()
 	mHeader = NULL;
 	mLen = 0;
 
+	mMmapFlags = 0;
+	mPageSize = 0;
+
 	mQueue = NULL;
 	mSemID = -1;
 }
 
 SP_DictShmQueue :: ~SP_DictShmQueue()
 {
-	if( NULL != mHeader ) SP_DictShmAllocator::freeMmapPtr( mHeader, mLen );
+	if( NULL != mHeader ) SP_DictShmAllocator::freeMmapPtr( mHeader, mLen, mPageSize );
 	mHeader = NULL;
 
 	if( NULL != mQueue ) delete mQueue;
 	mQueue = NULL;
 }
 
+void SP_DictShmQueue :: setMmapFlags( int mmapFlags )
+{
+	mMmapFlags = mmapFlags;
+}
+
+size_t SP_DictShmQueue :: getPageSize()
+{
+	return mPageSize;
+}
+
 int SP_DictShmQueue :: init( const char * path, int maxCount, int itemSize )
 {
 	mLen = sizeof(SP_DictCircleQueue::Header_t) + maxCount * itemSize;
 
 	int isNew = 0;
 
-	mHeader = (SP_DictCircleQueue::Header_t*)SP_DictShmAllocator::getMmapPtr( path, mLen, &isNew );
+	mHeader = (SP_DictCircleQueue::Header_t*)SP_DictShmAllocator::getMmapPtr(
+			path, mLen, &isNew, mMmapFlags, &mPageSize );
 
 	if( NULL != mHeader ) {
 		if( 0 == mHeader->mType0 && 0 == mHeader->mType1 ) {
@@ -154,7 +168,7 @@ int SP_DictShmQueue :: init( const char * path, int maxCount, int itemSize )
 						path, mHeader->mType0, mHeader->mType1, mHeader->mMaxCount, maxCount,
 						mHeader->mItemSize, itemSize, mHeader->mLen, mLen );
 
-				SP_DictShmAllocator::freeMmapPtr( mHeader, mLen );
+				SP_DictShmAllocator::freeMmapPtr( mHeader, mLen, mPageSize );
 				mHeader = NULL;
 			}
 		}
@@ -49,6 +49,12 @@ public:
 	// @return 0 : OK, -1 : Fail
 	int init( const char * path, int maxCount, int itemSize );
 
+	// SP_DictShmAllocator::eMmapXXX, default is 0, call it before init
+	void setMmapFlags( int mmapFlags );
+
+	// page size of the mapping after init
+	size_t getPageSize();
+
 	int getCount();
 
 	// @return 0 : OK, -1 : Fail
@@ -65,6 +71,9 @@ private:
 	SP_DictCircleQueue::Header_t * mHeader;
 	int mLen;
 
+	int mMmapFlags;
+	size_t mPageSize;
+
 	SP_DictCircleQueue * mQueue;
 	int mSemID;
 };
@@ -130,6 +130,14 @@ int SP_DictSkipList :: randomLevel( int maxLevel )
 }
 
 int SP_DictSkipList :: insert( void * item )
+{
+	void * old = replace( item );
+	if( NULL != old ) mHandler->destroy( old );
+
+	return NULL != old ? 1 : 0;
+}
+
+void * SP_DictSkipList :: replace( void * item )
 {
 	SP_DictSkipListNode path( mMaxLevel );
 
@@ -137,7 +145,7 @@ int SP_DictSkipList :: insert( void * item )
 	int cmpRet = 1;
 	for( int i = mRoot->getMaxLevel() - 1; i >= 0; i-- ) {
 		SP_DictSkipListNode * next = node->getForward( i );
-		for( ; NULL != next; ) {
+		for( cmpRet = 1; NULL != next; ) {
 			cmpRet = mHandler->compare( item, next->getItem() );
 			if( cmpRet > 0 ) {
 				node = next;
@@ -149,11 +157,13 @@ int SP_DictSkipList :: insert( void * item )
 		path.setForward( i, node );
 	}
 
-	int ret = 0;
-	if( NULL != node && 0 == cmpRet ) {
-		mHandler->destroy( node->takeItem() );
+	void * ret = NULL;
+
+	// cmpRet is the result of comparing with node's successor on level 0
+	if( 0 == cmpRet ) {
+		node = node->getForward( 0 );
+		ret = node->takeItem();
 		node->setItem( item );
-		ret = 1;
 	} else {
 		int level = randomLevel( mMaxLevel );
 		if( level > mRoot->getMaxLevel() ) {
@@ -13,6 +13,7 @@
 #ifndef WIN32
 #include <unistd.h>
 #include <sys/time.h>
+#include <pthread.h>
 #endif
 
 #ifdef WIN32
@@ -76,7 +77,9 @@ private:
 
 class SP_UserCacheHandler : public SP_DictCacheHandler {
 public:
-	SP_UserCacheHandler() {}
+	SP_UserCacheHandler() {
+		mIsHashable = 1;
+	}
 
 	~SP_UserCacheHandler() {}
 
@@ -95,6 +98,34 @@ public:
 		SP_User * user = (SP_User*)item;
 		strcpy( (char*)resultHolder, user->getName() );
 	}
+
+	unsigned int hash( const void * item ) {
+		SP_User * user = (SP_User*)item;
+
+		unsigned int hash = 0;
+		for( const char * pos = user->getName(); '\0' != *pos; pos++ ) {
+			hash = hash * 31 + *pos;
+		}
+
+		return hash;
+	}
+
+	int isHashable() {
+		return mIsHashable;
+	}
+
+	size_t getSize( const void * item ) {
+		SP_User * user = (SP_User*)item;
+
+		return sizeof( SP_User ) + strlen( user->getName() ) + 1;
+	}
+
+	void setHashable( int isHashable ) {
+		mIsHashable = isHashable;
+	}
+
+private:
+	int mIsHashable;
 };
 
 static char * randStr( char * buffer, int size )
@@ -108,17 +139,69 @@ static char * randStr( char * buffer, int size )
 	return buffer;
 }
 
+#ifndef WIN32
+typedef struct tagReaderArg {
+	SP_DictCache * mCache;
+	int mCount;
+} ReaderArg_t;
+
+// the readers get a small key set, while the main thread replaces the items
+static void * readerFunc( void * arg )
+{
+	ReaderArg_t * readerArg = (ReaderArg_t*)arg;
+
+	char name[ 16 ] = { 0 }, result[ 16 ] = { 0 };
+
+	for( int i = 0; i < readerArg->mCount; i++ ) {
+		snprintf( name, sizeof( name ), "key%d", i % 64 );
+
+		SP_User key( name );
+		if( readerArg->mCache->get( &key, result ) ) assert( 0 == strcmp( result, name ) );
+	}
+
+	return NULL;
+}
+
+static void testReaders( SP_DictCache * cache, int threads, int count )
+{
+	pthread_t * threadList = (pthread_t*)malloc( sizeof( pthread_t ) * threads );
+
+	ReaderArg_t readerArg;
+	readerArg.mCache = cache;
+	readerArg.mCount = count;
+
+	for( int i = 0; i < threads; i++ ) {
+		pthread_create( threadList + i, NULL, readerFunc, &readerArg );
+	}
+
+	char name[ 16 ] = { 0 };
+	for( int i = 0; i < count / 10; i++ ) {
+		snprintf( name, sizeof( name ), "key%d", i % 64 );
+		SP_User * user = new SP_User( name );
+		if( cache->put( user ) < 0 ) delete user;
+	}
+
+	for( int i = 0; i < threads; i++ ) pthread_join( threadList[i], NULL );
+
+	free( threadList );
+}
+#endif
+
 int main( int argc, char * argv[] )
 {
-	int size = 256, count = 1000, algo = SP_DictCache::eFIFO;
+	int size = 256, count = 1000, algo = SP_DictCache::eFIFO, shards = 1, hashable = 1;
+	int ttl = 0, threads = 0;
+	size_t maxBytes = 0;
 
 #ifndef WIN32
 	extern char *optarg;
 	int c;
-	while ( ( c = getopt ( argc, argv, "a:s:c:v" ) ) != EOF ) {
+	while ( ( c = getopt ( argc, argv, "a:s:c:n:e:m:t:bv" ) ) != EOF ) {
 		switch ( c ) {
 			case 'a':
 				if( 0 == strcasecmp( "LRU", optarg ) ) algo = SP_DictCache::eLRU;
+				if( 0 == strcasecmp( "CLOCK", optarg ) ) algo = SP_DictCache::eCLOCK;
+				if( 0 == strcasecmp( "TinyLFU", optarg ) ) algo = SP_DictCache::eTinyLFU;
 				break;
 			case 's':
 				size = atoi( optarg );
@@ -126,10 +209,25 @@ int main( int argc, char * argv[] )
 			case 'c':
 				count = atoi( optarg );
 				break;
+			case 'n':
+				shards = atoi( optarg );
+				break;
+			case 'e':
+				ttl = atoi( optarg );
+				break;
+			case 'm':
+				maxBytes = strtoul( optarg, NULL, 10 );
+				break;
+			case 't':
+				threads = atoi( optarg );
+				break;
+			case 'b':
+				hashable = 0;
+				break;
 			case 'v':
 			case '?':
 			default:
-				printf( "%s -a <FIFO|LRU> -s <cache size> -c <count> [-v]\n", argv[0] );
+				printf( "%s -a <FIFO|LRU|CLOCK|TinyLFU> -s <cache size> -c <count> -n <shards> -e <ttl> -m <max bytes> -t <reader threads> [-b] [-v]\n", argv[0] );
 				exit ( 0 );
 		}
 	}
@@ -138,12 +236,16 @@ int main( int argc, char * argv[] )
 	SP_Clock clock;
 
 	SP_UserCacheHandler * handler = new SP_UserCacheHandler();
-	SP_DictCache * cache = SP_DictCache::newInstance( algo, size, handler );
+	handler->setHashable( hashable );
+	SP_DictCache * cache = SP_DictCache::newInstance( algo, size, handler, 1, shards, maxBytes );
 
 	char name[ 9 ] = { 0 };
 	for( int i = 0; i < count; i++ ) {
 		SP_User * user = new SP_User( randStr( name, sizeof( name ) ) );
-		cache->put( user );
+		if( cache->put( user, ttl > 0 ? time( NULL ) + ttl : 0 ) < 0 ) {
+			delete user;
+			continue;
+		}
 		assert( 0 != cache->get( user, name ) );
 
 		if( 1 == ( i % 10 ) ) {
@@ -153,10 +255,40 @@ int main( int argc, char * argv[] )
 		}
 	}
 
+	// the batch interface must agree with the single key interface
+	SP_User * batchList[ 16 ], * keyList[ 16 ];
+	char resultList[ 16 ][ 9 ];
+	void * holderList[ 16 ];
+	int foundList[ 16 ];
+
+	for( int i = 0; i < 16; i++ ) {
+		batchList[i] = new SP_User( randStr( name, sizeof( name ) ) );
+		keyList[i] = new SP_User( name );
+		holderList[i] = resultList[i];
+	}
+
+	cache->putMulti( (void**)batchList, NULL, 16 );
+	int foundCount = cache->getMulti( (const void**)keyList, 16, holderList, foundList );
+
+	for( int i = 0; i < 16; i++ ) {
+		assert( foundList[i] == cache->get( keyList[i], name ) );
+		if( foundList[i] ) assert( 0 == strcmp( resultList[i], keyList[i]->getName() ) );
+		foundCount -= foundList[i];
+		delete keyList[i];
+	}
+	assert( 0 == foundCount );
+
+#ifndef WIN32
+	if( threads > 0 ) testReaders( cache, threads, count );
+#endif
+
+	if( ttl > 0 ) printf( "Purge : %d\n", cache->purgeExpired( count ) );
+
 	SP_DictCacheStatistics * stat = cache->getStatistics();
 
-	printf( "Stat : accesses( %d ), hits( %d ), size( %d )\n",
-			stat->getAccesses(), stat->getHits(), stat->getSize() );
+	printf( "Stat : accesses( %d ), hits( %d ), size( %d ), rejects( %d ), bytes( %lu )\n",
+			stat->getAccesses(), stat->getHits(), stat->getSize(), stat->getRejects(),
+			(unsigned long)stat->getBytes() );
 
 	delete stat;
 
@@ -168,6 +168,23 @@ static void randTest( int type, int count )
 		clock.print( "SearchTime" );
 	}
 
+	{
+		SP_Clock clock;
+
+		for( int i = 0; i < count; i++ ) {
+			if( NULL == userList[i] ) continue;
+			SP_User * user = new SP_User( i, (char*)userList[i]->getName() );
+			SP_User * ret = (SP_User*)dictionary->replace( user );
+			assert( ret == userList[i] );
+			delete ret;
+			userList[i] = user;
+		}
+
+		assert( (SP_User*)dictionary->search( userList[0] ) == userList[0] );
+
+		clock.print( "ReplaceTime" );
+	}
+
 	int iterCount = 0;
 
 	{
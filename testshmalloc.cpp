@@ -14,6 +14,7 @@
 #include <time.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
 
 #include "spdictshmalloc.hpp"
 
@@ -50,6 +51,117 @@ int main( int argc, char * argv[] )
 		if( 0 == i % 2  ) allocator.free( offset );
 	}
 
+	size_t freeCount = 0, usedCount = 0;
+	allocator.selfCheck( &freeCount, &usedCount );
+	assert( (int)freeCount == allocator.getFreeCount() );
+
+	SP_DictShmAllocator::freeMmapPtr( ptrBase, len );
+
+	// size classes from 8 to 4096 bytes
+	filePath = "./testshmslab.map";
+	len = 1024 * 1024;
+	ptrBase = SP_DictShmAllocator::getMmapPtr( filePath, len, &isNewFile );
+
+	assert( NULL != ptrBase );
+
+	SP_DictShmSlabAllocator slab( ptrBase, len, 8, 4096 );
+	slab.reset();
+
+	int slabCount = 0;
+
+	for( ; ; slabCount++ )
+	{
+		size_t size = 1 + rand() % 4096;
+		size_t offset = slab.alloc( size );
+
+		if( 0 == offset ) break;
+
+		assert( slab.isUsed( offset ) && slab.getItemSize( offset ) >= size );
+
+		memset( slab.getPtr( offset ), 'a', size );
+
+		if( 0 == slabCount % 2 ) slab.free( offset );
+	}
+
+	freeCount = usedCount = 0;
+	slab.selfCheck( &freeCount, &usedCount );
+	assert( (int)freeCount == slab.getFreeCount() );
+
+	printf( "%d, free %d, used %d\n", slabCount, (int)freeCount, (int)usedCount );
+
+	SP_DictShmAllocator::freeMmapPtr( ptrBase, len );
+
+	// several processes on a lock-free allocator, each through its magazine
+	filePath = "./testshmconc.map";
+	len = 64 * 1024;
+	ptrBase = SP_DictShmAllocator::getMmapPtr( filePath, len, &isNewFile );
+
+	assert( NULL != ptrBase );
+
+	SP_DictShmAllocator concAllocator( ptrBase, len, 24, 1 );
+	concAllocator.reset();
+
+	int procs = 4;
+
+	for( int i = 0; i < procs; i++ )
+	{
+		if( 0 != fork() ) continue;
+
+		srand( getpid() );
+
+		concAllocator.attachMagazine( i );
+
+		size_t holdList[ 64 ];
+		int holdCount = 0;
+
+		for( int j = 0; j < 100000; j++ )
+		{
+			if( holdCount < 64 && ( 0 == holdCount || rand() % 2 ) ) {
+				size_t offset = concAllocator.alloc();
+				if( 0 == offset ) continue;
+
+				// a record is never handed out twice
+				int * owner = (int*)concAllocator.getPtr( offset );
+				assert( 0 == *owner );
+				*owner = getpid();
+
+				holdList[ holdCount++ ] = offset;
+			} else {
+				size_t offset = holdList[ --holdCount ];
+				assert( getpid() == *(int*)concAllocator.getPtr( offset ) );
+				concAllocator.free( offset );
+			}
+		}
+
+		for( ; holdCount > 0; ) concAllocator.free( holdList[ --holdCount ] );
+
+		// the first one leaves its magazine as a crash does
+		if( 0 != i ) concAllocator.detachMagazine();
+
+		_exit( 0 );
+	}
+
+	int failCount = 0;
+	for( int i = 0; i < procs; i++ ) {
+		int status = 0;
+		wait( &status );
+		if( ! WIFEXITED( status ) || 0 != WEXITSTATUS( status ) ) failCount++;
+	}
+	assert( 0 == failCount );
+
+	freeCount = usedCount = 0;
+	concAllocator.selfCheck( &freeCount, &usedCount );
+	assert( 0 == usedCount && (int)freeCount == concAllocator.getFreeCount() );
+
+	// give the magazine of the dead process back
+	concAllocator.rebuildFreeList();
+
+	freeCount = usedCount = 0;
+	concAllocator.selfCheck( &freeCount, &usedCount );
+	assert( 0 == usedCount && (int)freeCount == concAllocator.getFreeCount() );
+
+	printf( "%d processes, free %d\n", procs, (int)freeCount );
+
 	SP_DictShmAllocator::freeMmapPtr( ptrBase, len );
 
 	return 0;
@@ -8,10 +8,13 @@
 #include <assert.h>
 #include <time.h>
 #include <string.h>
+#include <stddef.h>
 
 #ifndef WIN32
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#include <signal.h>
 #endif
 
 #ifdef WIN32
@@ -30,6 +33,7 @@ class UserHandler : public SP_DictShmCacheHandler {
 public:
 	UserHandler() {
 		mCurrBucket = -1;
+		mCreateLen = 0;
 	}
 
 	~UserHandler() {}
@@ -37,7 +41,7 @@ public:
 	unsigned int hash( const void * item ) {
 		User_t * user = (User_t*) item;
 
-		return SP_DictShmCache::fnvHash( user->mName, strlen( user->mName ) );
+		return (unsigned int)SP_DictShmCache::fastHash( user->mName, strlen( user->mName ) );
 	}
 
 	int compare( const void * item1, const void * item2 ) {
@@ -47,8 +51,9 @@ public:
 		return strcmp( user1->mName, user2->mName );
 	}
 
-	void onHit( const void * item, void * resultHolder ) {
-		memcpy( resultHolder, item, sizeof( User_t ) );
+	void onHit( const void * item, size_t len, void * resultHolder ) {
+		memset( resultHolder, 0, sizeof( User_t ) );
+		memcpy( resultHolder, item, len );
 	}
 
 	void onDumpHash( int bucket, const void * item ) {
@@ -66,8 +71,17 @@ public:
 		printf( " %s[%li]\n", user->mName, expTime );
 	}
 
+	void onCreateProgress( size_t doneLen, size_t totalLen ) {
+		mCreateLen = doneLen;
+	}
+
+	size_t getCreateLen() {
+		return mCreateLen;
+	}
+
 private:
 	int mCurrBucket;
+	size_t mCreateLen;
 };
 
 static char * randStr( char * buffer, int size )
@@ -81,17 +95,277 @@ static char * randStr( char * buffer, int size )
 	return buffer;
 }
 
+// eSlabClass keeps the name only
+static int putUser( SP_DictShmCache * cache, User_t * user, int flags, time_t expTime )
+{
+	if( flags & SP_DictShmCache::eSlabClass ) {
+		return cache->put( user, offsetof( User_t, mName ) + strlen( user->mName ) + 1, expTime );
+	}
+
+	return cache->put( user, expTime );
+}
+
+// the hash and the checksum must be the same on every machine
+static void testHash()
+{
+	assert( 0xe3069283 == SP_DictShmCache::crc32c( "123456789", 9 ) );
+	assert( 0 == SP_DictShmCache::crc32c( "", 0 ) );
+
+	unsigned char buffer[ 300 ];
+	for( size_t i = 0; i < sizeof( buffer ); i++ ) buffer[i] = (unsigned char)( i * 7 + 3 );
+
+	for( size_t len = 0; len <= sizeof( buffer ); len++ ) {
+		// bit by bit
+		unsigned int crc = 0xffffffff;
+		for( size_t i = 0; i < len; i++ ) {
+			crc ^= buffer[i];
+			for( int j = 0; j < 8; j++ ) crc = ( crc >> 1 ) ^ ( ( crc & 1 ) ? 0x82f63b78 : 0 );
+		}
+		assert( ~crc == SP_DictShmCache::crc32c( buffer, len ) );
+
+		// in two parts
+		size_t half = len / 3;
+		assert( ~crc == SP_DictShmCache::crc32c( buffer + half, len - half,
+				SP_DictShmCache::crc32c( buffer, half ) ) );
+
+		// every length and every seed gives another hash
+		unsigned long long hash = SP_DictShmCache::fastHash( buffer, len );
+		assert( hash == SP_DictShmCache::fastHash( buffer, len ) );
+		if( len > 0 ) assert( hash != SP_DictShmCache::fastHash( buffer, len - 1 ) );
+		assert( hash != SP_DictShmCache::fastHash( buffer, len, 1 ) );
+	}
+}
+
+#ifndef WIN32
+
+// @param mayRecover : 1 : another child may be killed before the init
+// @return 0 : ok, 1 : fail
+static int runChild( const char * mapFile, int count, int algo, size_t buckets, int flags,
+		int isDeferSeal, int mayRecover = 0 )
+{
+	SP_DictShmCache cache( new UserHandler(), buckets, sizeof( User_t ), flags );
+	cache.setEvictAlgo( algo );
+	cache.setMinItemSize( 8 );
+	cache.setDeferSeal( isDeferSeal );
+	if( cache.init( mapFile, 102400 ) < 0 ) return 1;
+
+	// the parent is attached, join it without recover
+	if( cache.isRecovered() && ! mayRecover ) return 1;
+
+	srand( getpid() );
+
+	for( int j = 0; j < count; j++ ) {
+		User_t user, result;
+		memset( &user, 0, sizeof( user ) );
+
+		for( int k = 0; k < 3; k++ ) user.mName[k] = 'a' + rand() % 8;
+		user.mID = SP_DictShmCache::fnvHash( user.mName, strlen( user.mName ) );
+
+		if( isDeferSeal && 0 == j % 100 ) cache.seal( 16 );
+
+		int action = rand() % 10;
+
+		if( action < 3 ) {
+			putUser( &cache, &user, flags, time( NULL ) + 10 );
+		} else if( action < 4 ) {
+			cache.erase( &user );
+		} else if( action < 7 ) {
+			SP_DictShmCache::View_t view;
+
+			if( cache.acquire( &user, &view ) ) {
+				// parse in place, a writer may change the item under the reader
+				const User_t * item = (const User_t*)view.mItem;
+				size_t nameLen = view.mLen > offsetof( User_t, mName )
+						? view.mLen - offsetof( User_t, mName ) : 0;
+				if( nameLen > sizeof( item->mName ) ) nameLen = sizeof( item->mName );
+
+				int isMatch = nameLen > 3 && 0 == strncmp( item->mName, user.mName, 4 )
+						&& item->mID == user.mID;
+
+				if( cache.release( &view ) ) assert( isMatch );
+			}
+		} else if( cache.get( &user, &result ) ) {
+			// a torn read would break the relation of the name and the id
+			assert( 0 == strcmp( result.mName, user.mName ) );
+			assert( result.mID == user.mID );
+		}
+	}
+
+	return 0;
+}
+
+// every process attaches the file, and works on the same small key set
+static int testConcurrent( const char * mapFile, int procs, int count, int algo,
+		size_t buckets, int flags, int isDeferSeal )
+{
+	for( int i = 0; i < procs; i++ ) {
+		fflush( stdout );
+
+		if( 0 != fork() ) continue;
+
+		exit( runChild( mapFile, count, algo, buckets, flags, isDeferSeal ) );
+	}
+
+	int failCount = 0;
+
+	for( int i = 0; i < procs; i++ ) {
+		int status = 0;
+		wait( &status );
+		if( ! WIFEXITED( status ) || 0 != WEXITSTATUS( status ) ) failCount++;
+	}
+
+	return failCount;
+}
+
+// a writer is killed at a random point, the live process must take over its locks,
+// and the next process must recover the file, both without a hang
+static int testCrash( const char * mapFile, int rounds, int algo, size_t buckets, int flags )
+{
+	int failCount = 0;
+
+	for( int i = 0; i < rounds; i++ ) {
+		fflush( stdout );
+
+		pid_t writer = fork();
+		if( 0 == writer ) exit( runChild( mapFile, 0x7fffffff, algo, buckets, flags, 0 ) );
+
+		// it runs on after the writer is killed
+		pid_t survivor = fork();
+		if( 0 == survivor ) {
+			alarm( 10 );
+			exit( runChild( mapFile, 200000, algo, buckets, flags, 0, 1 ) );
+		}
+
+		usleep( 1000 + rand() % 20000 );
+		kill( writer, SIGKILL );
+
+		int status = 0;
+		waitpid( writer, &status, 0 );
+		if( ! WIFSIGNALED( status ) ) failCount++;
+
+		waitpid( survivor, &status, 0 );
+		if( ! WIFEXITED( status ) || 0 != WEXITSTATUS( status ) ) failCount++;
+
+		// a lock left by the writer would hang the init
+		pid_t checker = fork();
+		if( 0 == checker ) {
+			alarm( 10 );
+
+			int ret = 1;
+			{
+				SP_DictShmCache cache( new UserHandler(), buckets, sizeof( User_t ), flags );
+				cache.setEvictAlgo( algo );
+				cache.setMinItemSize( 8 );
+				// the survivor may have recovered it already
+				if( cache.init( mapFile, 102400 ) >= 0 ) {
+					cache.selfCheck();
+
+					// a seq left odd would hang the readers, read all the keys of runChild
+					for( int j = 0; j < 512; j++ ) {
+						User_t user, result;
+						memset( &user, 0, sizeof( user ) );
+						for( int k = 0; k < 3; k++ ) user.mName[k] = 'a' + ( ( j >> ( k * 3 ) ) & 7 );
+
+						cache.get( &user, &result );
+					}
+
+					ret = 0;
+				}
+			}
+
+			exit( ret );
+		}
+
+		waitpid( checker, &status, 0 );
+		if( ! WIFEXITED( status ) || 0 != WEXITSTATUS( status ) ) failCount++;
+	}
+
+	return failCount;
+}
+
+static double getSeconds()
+{
+	struct timeval now;
+	gettimeofday( &now, NULL );
+
+	return now.tv_sec + now.tv_usec / 1000000.0;
+}
+
+// single get against getBatch on a cache much larger than the cpu cache
+static void benchBatch( int megaBytes, int algo, int flags )
+{
+	const char * mapFile = "testshmbench.map";
+	size_t len = (size_t)megaBytes * 1024 * 1024;
+
+	// the size may differ from the last run
+	unlink( mapFile );
+
+	SP_DictShmCache cache( new UserHandler(), 1024, sizeof( User_t ), flags );
+	cache.setEvictAlgo( algo );
+	if( cache.init( mapFile, len ) < 0 ) return;
+
+	int userCount = (int)( len / ( sizeof( User_t ) * 4 ) );
+	User_t * userList = (User_t*)calloc( userCount, sizeof( User_t ) );
+
+	for( int i = 0; i < userCount; i++ ) {
+		userList[i].mID = i;
+		snprintf( userList[i].mName, sizeof( userList[i].mName ), "u%d", i );
+		putUser( &cache, userList + i, flags, 0 );
+	}
+
+	enum { BATCH = 64, ROUNDS = 16384 };
+
+	const void * keyList[ BATCH ];
+	void * holderList[ BATCH ];
+	User_t resultList[ BATCH ];
+
+	for( int i = 0; i < BATCH; i++ ) holderList[i] = resultList + i;
+
+	int singleHits = 0, batchHits = 0;
+
+	srand( 1 );
+	double begin = getSeconds();
+	for( int i = 0; i < ROUNDS; i++ ) {
+		for( int j = 0; j < BATCH; j++ ) {
+			singleHits += cache.get( userList + rand() % userCount, holderList[j] );
+		}
+	}
+	double singleTime = getSeconds() - begin;
+
+	srand( 1 );
+	begin = getSeconds();
+	for( int i = 0; i < ROUNDS; i++ ) {
+		for( int j = 0; j < BATCH; j++ ) keyList[j] = userList + rand() % userCount;
+		batchHits += cache.getBatch( keyList, BATCH, holderList, NULL );
+	}
+	double batchTime = getSeconds() - begin;
+
+	assert( singleHits == batchHits );
+
+	printf( "Bench : %d items, %d gets, single %.3f (seconds), batch %.3f (seconds), speedup %.2f\n",
+			userCount, BATCH * ROUNDS, singleTime, batchTime,
+			batchTime > 0 ? singleTime / batchTime : 0.0 );
+
+	free( userList );
+}
+
+#endif
+
 int main( int argc, char * argv[] )
 {
-	int size = 256, count = 10000, algo = SP_DictShmCache::eFIFO;
+	int size = 256, count = 10000, algo = SP_DictShmCache::eFIFO, procs = 0;
+	int buckets = 1024, flags = 0, threads = 4, isKill = 0, mmapFlags = 0, zeroThreads = 0;
+	int benchSize = 0, checkSumType = SP_DictShmCache::eCheckSumFNV, isDeferSeal = 0;
+	int crashRounds = 0;
 
 #ifndef WIN32
 	extern char *optarg;
 	int c;
-	while ( ( c = getopt ( argc, argv, "a:s:c:v" ) ) != EOF ) {
+	while ( ( c = getopt ( argc, argv, "a:s:c:p:n:t:m:z:g:x:r:bldkv" ) ) != EOF ) {
 		switch ( c ) {
 			case 'a':
 				if( 0 == strcasecmp( "LRU", optarg ) ) algo = SP_DictShmCache::eLRU;
+				if( 0 == strcasecmp( "CLOCK", optarg ) ) algo = SP_DictShmCache::eCLOCK;
 				break;
 			case 's':
 				size = atoi( optarg );
@@ -99,39 +373,131 @@ int main( int argc, char * argv[] )
 			case 'c':
 				count = atoi( optarg );
 				break;
+			case 'p':
+				procs = atoi( optarg );
+				break;
+			case 'n':
+				buckets = atoi( optarg );
+				break;
+			case 'b':
+				flags |= SP_DictShmCache::eTagBucket;
+				break;
+			case 'l':
+				flags |= SP_DictShmCache::eSlabClass;
+				break;
+			case 't':
+				threads = atoi( optarg );
+				break;
+			case 'm':
+				mmapFlags = atoi( optarg );
+				break;
+			case 'z':
+				zeroThreads = atoi( optarg );
+				break;
+			case 'g':
+				benchSize = atoi( optarg );
+				break;
+			case 'x':
+				if( 0 == strcasecmp( "CRC32C", optarg ) ) checkSumType = SP_DictShmCache::eCheckSumCRC32C;
+				if( 0 == strcasecmp( "NONE", optarg ) ) checkSumType = SP_DictShmCache::eCheckSumNone;
+				break;
+			case 'r':
+				crashRounds = atoi( optarg );
+				break;
+			case 'd':
+				isDeferSeal = 1;
+				break;
+			case 'k':
+				isKill = 1;
+				break;
 			case 'v':
 			case '?':
 			default:
-				printf( "%s -a <FIFO|LRU> -s <cache size> -c <count> [-v]\n", argv[0] );
+				printf( "%s -a <FIFO|LRU|CLOCK> -s <cache size> -c <count> -p <processes> "
+						"-n <buckets> -t <recover threads> -m <mmap flags> -z <zero threads> "
+						"-g <bench MB> -x <FNV|CRC32C|NONE> -r <crash rounds> [-b] [-l] [-d] [-k] [-v]\n", argv[0] );
 				exit ( 0 );
 		}
 	}
 #endif
 
-	SP_DictShmCache cache( new UserHandler(), 1024, sizeof( User_t ) );
+	if( procs > 0 || crashRounds > 0 ) flags |= SP_DictShmCache::eConcurrent;
+
+	testHash();
+
+#ifndef WIN32
+	if( benchSize > 0 ) {
+		benchBatch( benchSize, algo, flags );
+		return 0;
+	}
+#endif
+
+	UserHandler * handler = new UserHandler();
+
+	SP_DictShmCache cache( handler, buckets, sizeof( User_t ), flags );
+	cache.setEvictAlgo( algo );
+	cache.setRecoverThreads( threads );
+	cache.setZeroThreads( zeroThreads );
+	cache.setMinItemSize( 8 );
+	cache.setMmapFlags( mmapFlags );
+	cache.setCheckSumType( checkSumType );
+	cache.setDeferSeal( isDeferSeal );
 
 	const char * mapFile  = "testshmcache.map";
 
 	int ret = cache.init( mapFile, 102400 );
 
 	if( 0 == ret ) {
-		printf( "Create file %s\n", mapFile );
+		printf( "Create file %s, %d bytes\n", mapFile, (int)handler->getCreateLen() );
 	} else if ( 1 == ret ) {
-		printf( "Reuse file %s\n", mapFile );
+		printf( "Reuse file %s%s\n", mapFile, cache.isRecovered() ? ", recovered" : "" );
 	} else {
 		printf( "Fail to init file %s\n", mapFile );
 		exit( 0 );
 	}
 
+	if( mmapFlags ) printf( "Page size %d\n", (int)cache.getPageSize() );
+
+#ifndef WIN32
+	if( procs > 0 ) {
+		int failCount = testConcurrent( mapFile, procs, count, algo, buckets, flags, isDeferSeal );
+		printf( "%d processes, %d fail\n", procs, failCount );
+
+		cache.selfCheck();
+
+		return failCount > 0 ? 1 : 0;
+	}
+
+	if( crashRounds > 0 ) {
+		int failCount = testCrash( mapFile, crashRounds, algo, buckets, flags );
+		printf( "%d crashes, %d fail\n", crashRounds, failCount );
+
+		// a lock left by a writer would hang the parent too
+		if( failCount > 0 ) {
+			fflush( stdout );
+			_exit( 1 );
+		}
+
+		cache.selfCheck();
+
+		return 0;
+	}
+#endif
+
 	srand( time( NULL ) );
 
 	for( int i = 0; i < count; i++ ) {
 		User_t user;
 
 		user.mID = rand();
-		randStr( user.mName, sizeof( user.mName ) );
+		memset( user.mName, 0, sizeof( user.mName ) );
+		if( flags & SP_DictShmCache::eSlabClass ) {
+			randStr( user.mName, 4 + rand() % ( sizeof( user.mName ) - 3 ) );
+		} else {
+			randStr( user.mName, sizeof( user.mName ) );
+		}
 
-		if( -1 == cache.put( &user, time( NULL ) + 10 ) ) {
+		if( -1 == putUser( &cache, &user, flags, time( NULL ) + 10 ) ) {
 			printf( "\nout of memory on index #%d\n", i );
 			break;
 		}
@@ -139,6 +505,13 @@ int main( int argc, char * argv[] )
 		User_t result;
 
 		assert( 0 != cache.get( &user, &result ) );
+		assert( result.mID == user.mID && 0 == strcmp( result.mName, user.mName ) );
+
+		SP_DictShmCache::View_t view;
+
+		assert( 0 != cache.acquire( &user, &view ) );
+		assert( 0 == memcmp( view.mItem, &user, offsetof( User_t, mName ) + strlen( user.mName ) + 1 ) );
+		assert( 1 == cache.release( &view ) );
 
 		if( 1 == ( i % 10 ) ) {
 			printf( "#" );
@@ -149,6 +522,36 @@ int main( int argc, char * argv[] )
 
 	printf( "\n" );
 
+	// the expired items are swept in short slices
+	int expiredCount = 0, sweepCount = 0;
+	for( int i = 0; i < 100; i++ ) {
+		User_t user;
+
+		user.mID = i;
+		memset( user.mName, 0, sizeof( user.mName ) );
+		snprintf( user.mName, sizeof( user.mName ), "expired%d", i );
+
+		if( 0 == putUser( &cache, &user, flags, time( NULL ) - 1 ) ) expiredCount++;
+	}
+
+	for( int i = 0; i < count && sweepCount < expiredCount; i++ ) {
+		sweepCount += cache.sweepExpired( 16 );
+	}
+
+	printf( "Sweep : expired( %d ), swept( %d )\n", expiredCount, sweepCount );
+	assert( sweepCount >= expiredCount );
+
+	// seal all the records, so a crash after it loses nothing
+	if( isDeferSeal ) {
+		// a call returns at once when all are sealed
+		int sealCount = 0;
+		for( int i = 0; i < count; i++ ) sealCount += cache.seal( 64 );
+
+		printf( "Seal : sealed( %d )\n", sealCount );
+	}
+
+	cache.selfCheck();
+
 	const SP_DictShmCacheStatistics * stat = cache.getStatistics();
 
 	printf( "Stat : accesses( %d ), hits( %d ), size( %d )\n",
@@ -156,6 +559,12 @@ int main( int argc, char * argv[] )
 
 	delete stat;
 
+	// leave the file as a crash does, the next init recovers it
+	if( isKill ) {
+		fflush( stdout );
+		_exit( 0 );
+	}
+
 #ifdef WIN32
 	printf( "\npress any key to exit ...\n" );
 	getchar();
@@ -101,6 +101,10 @@ SOURCE=..\spdictcache.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=..\spdicthash.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=..\spdictionary.cpp
 # End Source File
 # Begin Source File
@@ -125,6 +129,10 @@ SOURCE=..\spdictshmhashmap.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=..\spdictshmlock.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=..\spdictslist.cpp
 # End Source File
 # End Group
@@ -149,6 +157,10 @@ SOURCE=..\spdictcache.hpp
 # End Source File
 # Begin Source File
 
+SOURCE=..\spdicthash.hpp
+# End Source File
+# Begin Source File
+
 SOURCE=..\spdictionary.hpp
 # End Source File
 # Begin Source File
@@ -173,6 +185,10 @@ SOURCE=..\spdictshmhashmap.hpp
 # End Source File
 # Begin Source File
 
+SOURCE=..\spdictshmlock.hpp
+# End Source File
+# Begin Source File
+
 SOURCE=..\spdictslist.hpp
 # End Source File
 # End Group